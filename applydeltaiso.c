@@ -12,6 +12,7 @@
 #include <string.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <unistd.h>
 
 #include <zlib.h>
 #include <bzlib.h>
@@ -23,6 +24,8 @@
 
 #define BLKSIZE 8192
 
+int addblkcomp = CFILE_COMP_BZ;
+
 static void perror_fread(FILE *const fp, char const *const msg)
 {
   if (ferror(fp))
@@ -93,7 +96,7 @@ void applydelta(FILE *fpold, struct cfile *ocf, struct cfile *cf, unsigned char
 void
 processrpm(FILE *fpold, struct cfile *ocf, struct cfile *cf, unsigned int *nmp, int nmpn)
 {
-  int rpmn, i;
+  int rpmn, i, oldfd;
   unsigned int ctype;
   off64_t o;
   struct cfile *opcf, *npcf;
@@ -160,38 +163,26 @@ processrpm(FILE *fpold, struct cfile *ocf, struct cfile *cf, unsigned int *nmp,
   o = 0;
   for (i = 0; i < 2 * rpmn + 1; i++)
     o += nmp[i];
-  if (fseeko64(fpold, o, SEEK_SET))
+  /* the old iso is only read through the fd from here on, the
+   * payloads are mapped instead of copied through stdio */
+  oldfd = fileno(fpold);
+  if (lseek64(oldfd, o, SEEK_SET) == (off64_t)-1)
     {
-      perror("fseeko64");
+      perror("lseek64");
       exit(1);
     }
   if (ctype == 254)
     {
-      unsigned int len, l;
-      unsigned char buf[8192];
-
-      len = nmp[i];
-      while (len)
+      if (cfile_copy(cfile_open(CFILE_OPEN_RD, CFILE_IO_MMAP, &oldfd, CFILE_COMP_UN, nmp[i], 0, 0), ocf, CFILE_COPY_CLOSE_IN))
 	{
-	  l = len > sizeof(buf) ? sizeof(buf) : len;
-	  l = fread(buf, 1, l, fpold);
-	  if (l <= 0 && ferror(fpold))
-	    {
-	      perror("unchanged copy read");
-	      exit(1);
-	    }
-	  if (ocf->write(ocf, buf, l) != l)
-	    {
-	      perror("unchanged copy write");
-	      exit(1);
-            }
-	  len -= l;
+	  fprintf(stderr, "unchanged copy failed\n");
+	  exit(1);
 	}
       return;
     }
   paylen = cget4(cf);
   paydata = xmalloc(paylen);
-  opcf = cfile_open(CFILE_OPEN_RD, CFILE_IO_FILE, fpold, CFILE_COMP_XX, nmp[i], 0, 0);
+  opcf = cfile_open(CFILE_OPEN_RD, CFILE_IO_MMAP, &oldfd, CFILE_COMP_XX, nmp[i], 0, 0);
   if (!opcf)
     {
       fprintf(stderr, "payload open failed\n");
@@ -233,9 +224,9 @@ applydelta(FILE *fpold, struct cfile *ocf, struct cfile *cf, unsigned char *outd
   unsigned int *out;
   unsigned int *inp;
   unsigned int *outp;
-  unsigned char *addbz2 = 0;
-  unsigned int addbz2len = 0;
-  bz_stream addbz2strm;
+  unsigned char *addblk = 0;
+  unsigned int addblklen = 0;
+  struct cfile *acf = 0;
   unsigned char *b;
   unsigned char buf[BLKSIZE];
   unsigned int off, len, l;
@@ -256,11 +247,11 @@ applydelta(FILE *fpold, struct cfile *ocf, struct cfile *cf, unsigned char *outd
     out[2 * i] = cget4(cf);
   for (i = 0; i < outn; i++)
     out[2 * i + 1] = cget4(cf);
-  addbz2len = cget4(cf);
-  if (addbz2len)
+  addblklen = cget4(cf);
+  if (addblklen)
     {
-      addbz2 = xmalloc(addbz2len);
-      if (cf->read(cf, addbz2, addbz2len) != addbz2len)
+      addblk = xmalloc(addblklen);
+      if (cf->read(cf, addblk, addblklen) != addblklen)
 	{
 	  perror("addblk read");
 	  exit(1);
@@ -295,18 +286,14 @@ applydelta(FILE *fpold, struct cfile *ocf, struct cfile *cf, unsigned char *outd
 	  exit(1);
 	}
     }
-  if (addbz2len)
+  if (addblklen)
     {
-      addbz2strm.bzalloc = NULL;
-      addbz2strm.bzfree = NULL;
-      addbz2strm.opaque = NULL;
-      if (BZ2_bzDecompressInit(&addbz2strm, 0, 0) != BZ_OK)
+      acf = cfile_open(CFILE_OPEN_RD, CFILE_IO_BUFFER, addblk, addblkcomp, addblklen, 0, 0);
+      if (!acf)
         {
-          fprintf(stderr, "addbz2: BZ2_bzDecompressInit error\n");
+          fprintf(stderr, "add block open failed\n");
           exit(1);
         }
-      addbz2strm.next_in = (char *)addbz2;
-      addbz2strm.avail_in = addbz2len;
     }
 
   inp = in;
@@ -322,14 +309,11 @@ applydelta(FILE *fpold, struct cfile *ocf, struct cfile *cf, unsigned char *outd
 	    {
 	      b = outdata + off;
 	      l = len > BLKSIZE ? BLKSIZE : len;
-	      if (addbz2len)
+	      if (acf)
 		{
-		  addbz2strm.next_out = (char *)buf;
-		  addbz2strm.avail_out = l;
-		  i = BZ2_bzDecompress(&addbz2strm);
-                  if (addbz2strm.avail_out != 0)
+		  if (acf->read(acf, buf, l) != l)
 		    {
-		      fprintf(stderr, "addbz2: BZ2_bzDecompress error\n");
+		      fprintf(stderr, "add block read error\n");
 		      exit(1);
 		    }
 		  for (i = 0; i < l; i++)
@@ -370,8 +354,9 @@ applydelta(FILE *fpold, struct cfile *ocf, struct cfile *cf, unsigned char *outd
 	    }
 	}
     }
-  if (addbz2len)
-    BZ2_bzDecompressEnd(&addbz2strm);
+  if (acf)
+    acf->close(acf);
+  addblk = xfree(addblk);
   in = xfree(in);
   out = xfree(out);
 }
@@ -380,22 +365,42 @@ int main(int argc, char **argv)
 {
   FILE *fpold, *fpnew, *fpdlt;
   struct cfile *cfnew;
-  int vers;
+  int vers, comp;
   unsigned char md5res[16];
   unsigned char targetres[16];
   MD5_CTX md5;
   unsigned int nmpn;
   unsigned int *nmp;
   struct cfile *cf;
-  int i;
+  int i, c;
   unsigned char *outdata;
   uint64_t outlen, outspc;
+  int verbose = 0;
+  struct cfile_stats cfstats[CFILE_STATS_N];
 
-  if (argc != 4)
+  while ((c = getopt(argc, argv, "v")) != -1)
+    {
+      switch(c)
+	{
+	case 'v':
+	  verbose++;
+	  break;
+	default:
+	  fprintf(stderr, "usage: applydeltaiso [-v] <oldiso> <deltaiso> <newiso>\n");
+	  exit(1);
+	}
+    }
+  if (argc - optind != 3)
     {
-      fprintf(stderr, "usage: applydeltaiso <oldiso> <deltaiso> <newiso>\n");
+      fprintf(stderr, "usage: applydeltaiso [-v] <oldiso> <deltaiso> <newiso>\n");
       exit(1);
     }
+  if (verbose)
+    {
+      memset(cfstats, 0, sizeof(cfstats));
+      cfile_stats(cfstats);
+    }
+  argv += optind - 1;
   if ((fpold = fopen64(argv[1], "r")) == 0)
     {
       perror(argv[1]);
@@ -412,13 +417,24 @@ int main(int argc, char **argv)
       exit(1);
     }
   vers = get4(fpdlt);
-  if (vers != 1 && vers != 2)
+  if (vers != 1 && vers != 2 && vers != 3)
     {
       fprintf(stderr, "%s: unsupported version V%d\n", argv[2], vers);
       exit(1);
     }
+  comp = CFILE_COMP_BZ;
+  if (vers == 3)
+    {
+      comp = get4(fpdlt);
+      addblkcomp = get4(fpdlt);
+    }
   /* switch to compression */
-  cf = cfile_open(CFILE_OPEN_RD, CFILE_IO_FILE, fpdlt, CFILE_COMP_BZ, CFILE_LEN_UNLIMITED, 0, 0);
+  cf = cfile_open(CFILE_OPEN_RD, CFILE_IO_FILE, fpdlt, comp, CFILE_LEN_UNLIMITED, 0, 0);
+  if (!cf)
+    {
+      fprintf(stderr, "%s: unsupported compression\n", argv[2]);
+      exit(1);
+    }
   nmpn = cget4(cf);
   nmp = xmalloc2(nmpn + 1, 2 * sizeof(*nmp));
   for (i = 0; i < nmpn * 2 + 1; i++)
@@ -506,6 +522,8 @@ int main(int argc, char **argv)
   for (i = 0; i < 16; i++)
      printf("%02x", md5res[i]);
   printf("\n");
+  if (verbose)
+    cfile_printstats(stdout, cfstats);
   exit(0);
 }
 
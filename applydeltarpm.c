@@ -5,7 +5,7 @@
  * for further information
  */
 
-#define _XOPEN_SOURCE 500
+#define _XOPEN_SOURCE 600
 #ifdef DELTARPM_64BIT
 # define _LARGEFILE64_SOURCE
 #endif
@@ -18,6 +18,7 @@
 #include <fcntl.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
+#include <sys/mman.h>
 
 #include <bzlib.h>
 #include <zlib.h>
@@ -32,7 +33,10 @@
 #include "deltarpm.h"
 #include "prelink.h"
 
-#define BLKSHIFT 13
+/* block size, set with -b */
+int blkshift = 13;
+
+#define BLKSHIFT blkshift
 #define BLKSIZE  (1 << BLKSHIFT)
 #define BLKMASK  ((1 << BLKSHIFT) - 1)
 
@@ -135,22 +139,59 @@ newopen(struct seqdescr *sd, struct fileblock *fb)
 
 struct blk {
   struct blk *next;
+  struct blk *prev;
   int type;
   int id;
+  int heapidx;
+  struct blk *pb;		/* core: page that still has the data */
   union {
     unsigned int off;
     unsigned char *buf;
   } e;
 };
 
+/* in-core blocks, newest first */
 struct blk *coreblks;
-struct blk *freecoreblks;
-struct blk *pageblks;
+struct blk *coreblkstail;
+
+/* binary heaps of the in-core blocks and the pages, ordered by the
+ * last time the block will be used. So the top is the block that
+ * is the first to be no longer needed. */
+struct blkheap {
+  struct blk **b;
+  int n;
+  int a;
+};
+
+struct blkheap coreheap;
+struct blkheap pageheap;
+
 int ncoreblk = 0;
 int npageblk = 0;
 int ndropblk = 0;
 
-int maxcoreblk = 5000;
+int maxcoreblk;
+unsigned long long corebudget = 5000 << 13;	/* bytes, set with -m */
+
+/* half of the memory the kernel thinks is available */
+unsigned long long
+autocorebudget(void)
+{
+  FILE *fp;
+  char line[256];
+  unsigned long long kb = 0;
+
+  if ((fp = fopen("/proc/meminfo", "r")) != 0)
+    {
+      while (fgets(line, sizeof(line), fp))
+	if (sscanf(line, "MemAvailable: %llu kB", &kb) == 1)
+	  break;
+      fclose(fp);
+    }
+  if (kb)
+    return kb * 1024 / 2;
+  return (unsigned long long)sysconf(_SC_AVPHYS_PAGES) * sysconf(_SC_PAGESIZE) / 2;
+}
 
 unsigned int *maxblockuse;	/* last time the block will be used */
 struct blk **vmem;
@@ -167,60 +208,194 @@ drpmuint outfpleft_raw;
 int outfpid;
 
 
+/*****************************************************************
+ * page area, a file in pagedir that is mapped in segments. If
+ * that does not work we fall back to pread/pwrite.
+ */
+
 int pagefd = -1;
+char *pagedir;			/* -T, default $TMPDIR or /tmp */
+
+#define PAGESEG_SIZE (16 * 1024 * 1024)
+
+unsigned char **pagesegs;
+int npagesegs;
+int pagesegsfailed;
+
+void
+openpagearea(void)
+{
+  char *dir = pagedir;
+  char *tmpname;
+
+  if (!dir)
+    dir = getenv("TMPDIR");
+  if (!dir || !*dir)
+    dir = "/tmp";
+  tmpname = xmalloc(strlen(dir) + 32);
+  sprintf(tmpname, "%s/deltarpmpageXXXXXX", dir);
+#ifdef DELTARPM_64BIT
+  pagefd = mkstemp64(tmpname);
+#else
+  pagefd = mkstemp(tmpname);
+#endif
+  if (pagefd < 0)
+    {
+      fprintf(stderr, "could not create page area in %s\n", dir);
+      exit(1);
+    }
+  unlink(tmpname);
+  xfree(tmpname);
+}
+
+/* address of page off, maps a new segment when we get to it */
+unsigned char *
+pageaddr(unsigned int off)
+{
+  unsigned int segblks = PAGESEG_SIZE > BLKSIZE ? PAGESEG_SIZE >> BLKSHIFT : 1;
+  unsigned int seg = off / segblks;
+  size_t segsize = (size_t)segblks << BLKSHIFT;
+  void *p;
+
+  if (seg < npagesegs)
+    return pagesegs[seg] + ((size_t)(off % segblks) << BLKSHIFT);
+  if (pagesegsfailed || seg != npagesegs)
+    return 0;
+  /* allocate the space, a full disk would give us SIGBUS otherwise */
+#ifdef DELTARPM_64BIT
+  if (posix_fallocate64(pagefd, (off64_t)seg * segsize, segsize) != 0)
+    p = MAP_FAILED;
+  else
+    p = mmap64(0, segsize, PROT_READ | PROT_WRITE, MAP_SHARED, pagefd, (off64_t)seg * segsize);
+#else
+  if (posix_fallocate(pagefd, (off_t)seg * segsize, segsize) != 0)
+    p = MAP_FAILED;
+  else
+    p = mmap(0, segsize, PROT_READ | PROT_WRITE, MAP_SHARED, pagefd, (off_t)seg * segsize);
+#endif
+  if (p == MAP_FAILED)
+    {
+      pagesegsfailed = 1;
+      return 0;
+    }
+  pagesegs = xrealloc2(pagesegs, npagesegs + 1, sizeof(unsigned char *));
+  pagesegs[npagesegs++] = p;
+  return pageaddr(off);
+}
 
 
 void (*fillblock_method)(struct blk *b, int id, struct seqdescr *sdesc, int nsdesc, struct fileblock *fb, int idx);
 
+static inline int
+blkheap_less(struct blk *b1, struct blk *b2)
+{
+  if (maxblockuse[b1->id] != maxblockuse[b2->id])
+    return maxblockuse[b1->id] < maxblockuse[b2->id];
+  return b1->id < b2->id;
+}
+
+static void
+blkheap_set(struct blkheap *h, int i, struct blk *b)
+{
+  h->b[i] = b;
+  b->heapidx = i;
+}
+
+void
+blkheap_up(struct blkheap *h, int i)
+{
+  struct blk *b = h->b[i];
+
+  for (; i > 0 && blkheap_less(b, h->b[(i - 1) / 2]); i = (i - 1) / 2)
+    blkheap_set(h, i, h->b[(i - 1) / 2]);
+  blkheap_set(h, i, b);
+}
+
+void
+blkheap_down(struct blkheap *h, int i)
+{
+  struct blk *b = h->b[i];
+  int c;
+
+  for (; (c = 2 * i + 1) < h->n; i = c)
+    {
+      if (c + 1 < h->n && blkheap_less(h->b[c + 1], h->b[c]))
+	c++;
+      if (!blkheap_less(h->b[c], b))
+	break;
+      blkheap_set(h, i, h->b[c]);
+    }
+  blkheap_set(h, i, b);
+}
+
+void
+blkheap_add(struct blkheap *h, struct blk *b)
+{
+  if (h->n == h->a)
+    {
+      h->a = h->a ? h->a * 2 : 256;
+      h->b = xrealloc(h->b, h->a * sizeof(struct blk *));
+    }
+  blkheap_set(h, h->n++, b);
+  blkheap_up(h, h->n - 1);
+}
+
+void
+blkheap_del(struct blkheap *h, struct blk *b)
+{
+  struct blk *m;
+  int i = b->heapidx;
+
+  if (i != --h->n)
+    {
+      m = h->b[h->n];
+      blkheap_set(h, i, m);
+      blkheap_up(h, i);
+      blkheap_down(h, m->heapidx);
+    }
+}
+
 void
 pageoutblock(struct blk *cb, int idx)
 {
   struct blk *b;
+  unsigned char *p;
 
   // printf("pageoutblock %d\n", cb->id);
-  for (b = pageblks; b; b = b->next)
-    if (b->id == cb->id)
-      {
-        vmem[b->id] = b;
-        return;
-      }
-  for (b = pageblks; b; b = b->next)
-    if (maxblockuse[b->id] < idx)
-      break;
-  if (!b)
+  if (cb->pb && cb->pb->id == cb->id)
+    {
+      /* data is still in the page area */
+      vmem[cb->id] = cb->pb;
+      return;
+    }
+  b = pageheap.n ? pageheap.b[0] : 0;
+  if (b && maxblockuse[b->id] < idx)
+    {
+      /* reuse page that is no longer needed */
+      b->id = cb->id;
+      blkheap_down(&pageheap, 0);
+    }
+  else
     {
       b = xmalloc(sizeof(*b));
-      b->next = pageblks;
       b->type = BLK_PAGE;
       b->e.off = npageblk;
-      pageblks = b;
+      b->id = cb->id;
+      blkheap_add(&pageheap, b);
       npageblk++;
       if (pagefd < 0)
-	{
-	  char tmpname[80];
-	  sprintf(tmpname, "/tmp/deltarpmpageXXXXXX");
-#ifdef DELTARPM_64BIT
-	  pagefd = mkstemp64(tmpname);
-#else
-	  pagefd = mkstemp(tmpname);
-#endif
-	  if (pagefd < 0)
-	    {
-	      fprintf(stderr, "could not create page area\n");
-	      exit(1);
-	    }
-	  unlink(tmpname);
-	}
+	openpagearea();
     }
-  b->id = cb->id;
+  if ((p = pageaddr(b->e.off)) != 0)
+    memcpy(p, cb->e.buf, BLKSIZE);
 #ifdef DELTARPM_64BIT
-  if (pwrite64(pagefd, cb->e.buf, BLKSIZE, (off64_t)b->e.off * BLKSIZE) != BLKSIZE)
+  else if (pwrite64(pagefd, cb->e.buf, BLKSIZE, (off64_t)b->e.off * BLKSIZE) != BLKSIZE)
     {
       perror("page area write");
       exit(1);
     }
 #else
-  if (pwrite(pagefd, cb->e.buf, BLKSIZE, (off_t)b->e.off * BLKSIZE) != BLKSIZE)
+  else if (pwrite(pagefd, cb->e.buf, BLKSIZE, (off_t)b->e.off * BLKSIZE) != BLKSIZE)
     {
       perror("page area write");
       exit(1);
@@ -232,16 +407,20 @@ pageoutblock(struct blk *cb, int idx)
 void
 pageinblock(struct blk *cb, struct blk *b)
 {
+  unsigned char *p;
+
   if (b->type != BLK_PAGE)
     abort();
+  if ((p = pageaddr(b->e.off)) != 0)
+    memcpy(cb->e.buf, p, BLKSIZE);
 #ifdef DELTARPM_64BIT
-  if (pread64(pagefd, cb->e.buf, BLKSIZE, (off64_t)b->e.off * BLKSIZE) != BLKSIZE)
+  else if (pread64(pagefd, cb->e.buf, BLKSIZE, (off64_t)b->e.off * BLKSIZE) != BLKSIZE)
     {
       perror("page area read");
       exit(1);
     }
 #else
-  if (pread(pagefd, cb->e.buf, BLKSIZE, (off_t)b->e.off * BLKSIZE) != BLKSIZE)
+  else if (pread(pagefd, cb->e.buf, BLKSIZE, (off_t)b->e.off * BLKSIZE) != BLKSIZE)
     {
       perror("page area read");
       exit(1);
@@ -249,6 +428,7 @@ pageinblock(struct blk *cb, struct blk *b)
 #endif
   cb->id = b->id;
   cb->type = BLK_CORE_ONE;
+  cb->pb = b;
   vmem[cb->id] = cb;
 }
 
@@ -257,27 +437,65 @@ newcoreblk(void)
 {
   struct blk *b;
   b = xmalloc(sizeof(*b) + BLKSIZE);
-  b->next = coreblks;
   b->type = BLK_FREE;
+  b->pb = 0;
   b->e.buf = (unsigned char *)(b + 1);
-  coreblks = b;
   ncoreblk++;
   // printf("created new coreblk, have now %d\n", ncoreblk);
   return b;
 }
 
+/* add a filled block to the in-core blocks */
+void
+linkcoreblk(struct blk *b)
+{
+  b->prev = 0;
+  b->next = coreblks;
+  if (coreblks)
+    coreblks->prev = b;
+  else
+    coreblkstail = b;
+  coreblks = b;
+  blkheap_add(&coreheap, b);
+}
+
+void
+unlinkcoreblk(struct blk *b)
+{
+  if (b->next)
+    b->next->prev = b->prev;
+  else
+    coreblkstail = b->prev;
+  if (b->prev)
+    b->prev->next = b->next;
+  else
+    coreblks = b->next;
+  blkheap_del(&coreheap, b);
+}
+
+/* get the in-core block that is no longer needed first if it is
+ * unused at instruction idx before block id */
+struct blk *
+unusedcoreblk(int idx, int id)
+{
+  struct blk *b = coreheap.n ? coreheap.b[0] : 0;
+
+  if (!b || maxblockuse[b->id] > idx || (maxblockuse[b->id] == idx && b->id >= id))
+    return 0;
+  unlinkcoreblk(b);
+  if (vmem[b->id] == b)
+    vmem[b->id] = 0;
+  b->type = BLK_FREE;
+  b->pb = 0;
+  return b;
+}
+
 void
 pushblock(struct blk *nb, int idx)
 {
   struct blk *b;
 
-  b = freecoreblks;
-  if (b)
-    {
-      freecoreblks = b->next;
-      b->next = coreblks;
-      coreblks = b;
-    }
+  b = unusedcoreblk(idx, 0);
   if (!b && ncoreblk < maxcoreblk)
     b = newcoreblk();
   if (!b)
@@ -293,6 +511,7 @@ pushblock(struct blk *nb, int idx)
   b->id = nb->id;
   memcpy(b->e.buf, nb->e.buf, BLKSIZE);
   vmem[b->id] = b;
+  linkcoreblk(b);
 }
 
 void
@@ -336,7 +555,8 @@ fillblock_prelink(struct blk *b, int id, struct seqdescr *sd, struct fileblock *
   int isp = 0;
   int l;
   unsigned char buf[128];
-  unsigned char *bp, saveblk[BLKSIZE];
+  unsigned char *bp;
+  static unsigned char *saveblk;
 
   /* go to first block that doesn't start in the middle of a
    * prelinked file */
@@ -501,7 +721,11 @@ fillblock_prelink(struct blk *b, int id, struct seqdescr *sd, struct fileblock *
       b->type = BLK_CORE_ONE;
       b->id = id;
       if (id == xid)
-	memcpy(saveblk, b->e.buf, BLKSIZE);
+	{
+	  if (!saveblk)
+	    saveblk = xmalloc(BLKSIZE);
+	  memcpy(saveblk, b->e.buf, BLKSIZE);
+	}
       else if (maxblockuse[b->id] > idx || (maxblockuse[b->id] == idx && id > xid))
 	pushblock(b, idx);
       /* finished block */
@@ -652,6 +876,141 @@ fillblock_disk(struct blk *b, int id, struct seqdescr *sdesc, int nsdesc, struct
   b->type = BLK_CORE_REC;
 }
 
+/*****************************************************************
+ * prefetching of the disk files
+ *
+ * The copy instructions tell us in which order the blocks are
+ * needed, so we can ask the kernel to read the file data of the
+ * next blocks while we are busy with the current ones.
+ */
+
+#define PREFETCH_SIZE (2 * 1024 * 1024)
+#define PREFETCH_BLKS (PREFETCH_SIZE >> BLKSHIFT > 2 ? PREFETCH_SIZE >> BLKSHIFT : 2)
+
+unsigned int *pfblks;		/* blocks in order of first use */
+unsigned int npfblks;
+unsigned int pfhead;		/* next block to prefetch */
+unsigned int pftail;		/* next block to be used */
+int pfsdesc;
+int pffile = -1;
+int pffd = -1;
+off_t pfstart, pfend;		/* pending range of pffile */
+
+void
+prefetch_init(unsigned int *out, unsigned int outn, int numblks)
+{
+  unsigned char *seen;
+  drpmuint off;
+  unsigned int i;
+  int bs, be;
+
+  if (!numblks)
+    return;
+  seen = xcalloc(numblks, 1);
+  pfblks = xcalloc(numblks, sizeof(unsigned int));
+  off = 0;
+  for (i = 0; i < outn; i++)
+    {
+      off += (int)out[2 * i];
+      bs = off >> BLKSHIFT;
+      off += out[2 * i + 1];
+      be = (off - 1) >> BLKSHIFT;
+      for (; bs <= be; bs++)
+	if (!seen[bs])
+	  {
+	    seen[bs] = 1;
+	    pfblks[npfblks++] = bs;
+	  }
+    }
+  xfree(seen);
+}
+
+void
+prefetch_flush(void)
+{
+#ifdef POSIX_FADV_WILLNEED
+  if (pffd >= 0 && pfend > pfstart)
+    posix_fadvise(pffd, pfstart, pfend - pfstart, POSIX_FADV_WILLNEED);
+#endif
+  pfstart = pfend = 0;
+}
+
+void
+prefetch_range(struct fileblock *fb, int i, drpmuint off, drpmuint len)
+{
+  if (i != pffile)
+    {
+      prefetch_flush();
+      if (pffd >= 0)
+	close(pffd);
+      pffile = i;
+      pffd = open(fb->filenames[i], O_RDONLY);
+    }
+  if (pffd < 0)
+    return;
+  if (pfend > pfstart && pfend == (off_t)off)
+    {
+      pfend += len;
+      return;
+    }
+  prefetch_flush();
+  pfstart = off;
+  pfend = (off_t)(off + len);
+}
+
+void
+prefetch_block(int id, struct seqdescr *sdesc, int nsdesc, struct fileblock *fb)
+{
+  drpmuint off, end, ds, de;
+  struct seqdescr *sd;
+  int i;
+
+  off = (drpmuint)id << BLKSHIFT;
+  end = off + BLKSIZE;
+  i = pfsdesc;
+  for (sd = sdesc + i; i > 0 && sd->off > off; i--, sd--)
+    ;
+  for (; i < nsdesc; i++, sd++)
+    if (sd->off + sd->cpiolen + sd->datalen > off)
+      break;
+  pfsdesc = i < nsdesc ? i : 0;
+  for (; i < nsdesc && sd->off < end; i++, sd++)
+    {
+      if (sd->i == -1 || !S_ISREG(fb->filemodes[sd->i]))
+	continue;
+      ds = sd->off + sd->cpiolen;
+      de = ds + fb->filesizes[sd->i];
+      if (ds < off)
+	ds = off;
+      if (de > end)
+	de = end;
+      if (ds < de)
+	prefetch_range(fb, sd->i, ds - (sd->off + sd->cpiolen), de - ds);
+    }
+}
+
+/* called when block id gets used, keeps PREFETCH_SIZE bytes ahead */
+void
+prefetch(int id, struct seqdescr *sdesc, int nsdesc, struct fileblock *fb)
+{
+  unsigned int b;
+
+  if (pftail < npfblks && pfblks[pftail] == id)
+    pftail++;
+  /* issue in batches, so that the ranges can be merged */
+  if (pfhead >= npfblks || pfhead >= pftail + PREFETCH_BLKS / 2)
+    return;
+  if (pfhead < pftail)
+    pfhead = pftail;
+  while (pfhead < npfblks && pfhead < pftail + PREFETCH_BLKS)
+    {
+      b = pfblks[pfhead++];
+      if (!vmem[b])
+	prefetch_block(b, sdesc, nsdesc, fb);
+    }
+  prefetch_flush();
+}
+
 void
 fillblock_rawrpm(struct blk *b, int id, struct seqdescr *sdesc, int nsdesc, struct fileblock *fb, int idx)
 {
@@ -696,7 +1055,8 @@ fillblock_rpm(struct blk *b, int id, struct seqdescr *sdesc, int nsdesc, struct
   struct cpiophys cph;
   static char *namebuf;
   static int namebufl;
-  char skipbuf[4096];
+  unsigned char *skipp;
+  int skipl;
 
   l = BLKSIZE;
   bp = b->e.buf;
@@ -813,13 +1173,13 @@ fillblock_rpm(struct blk *b, int id, struct seqdescr *sdesc, int nsdesc, struct
 	    size += 4 - (size & 3);
 	  while (size > 0)
 	    {
-	      l2 = size > sizeof(skipbuf) ? sizeof(skipbuf) : size;
-	      if (outfp->read(outfp, skipbuf, l2) != l2)
+	      skipl = cfile_borrow(outfp, &skipp, size > outfp->bufsize ? outfp->bufsize : size);
+	      if (skipl <= 0)
 		{
 		  fprintf(stderr, "read failed (name)\n");
 		  exit(1);
 		}
-	      size -= l2;
+	      size -= skipl;
 	    }
 	}
       createcpiohead(sd, fb);
@@ -829,13 +1189,13 @@ fillblock_rpm(struct blk *b, int id, struct seqdescr *sdesc, int nsdesc, struct
 	{
 	  while (size > 0)
 	    {
-	      l2 = size > sizeof(skipbuf) ? sizeof(skipbuf) : size;
-	      if (outfp->read(outfp, skipbuf, l2) != l2)
+	      skipl = cfile_borrow(outfp, &skipp, size > outfp->bufsize ? outfp->bufsize : size);
+	      if (skipl <= 0)
 		{
 		  fprintf(stderr, "read failed (data skip)\n");
 		  exit(1);
 		}
-	      size -= l2;
+	      size -= skipl;
 	    }
 	}
       else if (size != sd->datalen)
@@ -855,61 +1215,22 @@ fillblock_rpm(struct blk *b, int id, struct seqdescr *sdesc, int nsdesc, struct
 struct blk *
 getblock(int id, struct seqdescr *sdesc, int nsdesc, struct fileblock *fb, int idx)
 {
-  struct blk *b, **bb;
+  struct blk *b;
   struct blk *pb;
-  static int cleanup_cnt;
 
 // printf("%d %d %d\n", idx, id, maxblockuse[id]);
   b = vmem[id];
   if (b && (b->type == BLK_CORE_REC || b->type == BLK_CORE_ONE))
     return b;
 
-  b = freecoreblks;
-  if (b)
-    {
-      freecoreblks = b->next;
-      b->next = coreblks;
-      coreblks = b;
-    }
-
-  if (!b && ncoreblk < maxcoreblk && (++cleanup_cnt & 7) != 0)
-    b = newcoreblk();
-
-  if (!b)
-    {
-      for (bb = &coreblks; (b = *bb) != 0; bb = &b->next)
-	{
-	  if (maxblockuse[b->id] < idx || (maxblockuse[b->id] == idx && b->id < id))
-	    {
-	      *bb = b->next;
-	      vmem[b->id] = 0;
-	      b->type = BLK_FREE;
-	      b->next = freecoreblks;
-	      freecoreblks = b;
-	    }
-	  else
-	    bb = &b->next;
-	}
-      b = freecoreblks;
-      if (b)
-	{
-	  freecoreblks = b->next;
-	  b->next = coreblks;
-	  coreblks = b;
-	}
-    }
-
+  b = unusedcoreblk(idx, id);
   if (!b && ncoreblk < maxcoreblk)
     b = newcoreblk();
   if (!b)
     {
       /* use first created block */
-      for (bb = &coreblks; (b = *bb); bb = &b->next)
-	if (b->next == 0)
-	  break;
-      *bb = 0;
-      b->next = coreblks;
-      coreblks = b;
+      b = coreblkstail;
+      unlinkcoreblk(b);
       if (b->type == BLK_CORE_ONE)
 	pageoutblock(b, idx);
       else
@@ -918,6 +1239,7 @@ getblock(int id, struct seqdescr *sdesc, int nsdesc, struct fileblock *fb, int i
 	  ndropblk++;
 	}
       b->type = BLK_FREE;
+      b->pb = 0;
     }
 
   /* got destination block, now fill it with data */
@@ -925,10 +1247,12 @@ getblock(int id, struct seqdescr *sdesc, int nsdesc, struct fileblock *fb, int i
   if (pb && pb->type == BLK_PAGE)
     {
       pageinblock(b, pb);
+      linkcoreblk(b);
       return b;
     }
   fillblock_method(b, id, sdesc, nsdesc, fb, idx);
   vmem[id] = b;
+  linkcoreblk(b);
   return b;
 }
 
@@ -939,7 +1263,12 @@ cfile_write_uncomp(struct cfile *f, void *buf, int len)
   if (!len)
     return 0;
   l2 = len > f->len ? f->len : len;
-  if (fwrite(buf, l2, 1, (FILE *)f->fp) != 1)
+  if (f->fd == CFILE_IO_CFILE)
+    {
+      if (((struct cfile *)f->fp)->write((struct cfile *)f->fp, buf, l2) != l2)
+	return -1;
+    }
+  else if (fwrite(buf, l2, 1, (FILE *)f->fp) != 1)
     return -1;
   if (l2 && f->ctxup)
     f->ctxup(f->ctx, buf, l2);
@@ -1126,6 +1455,7 @@ main(int argc, char **argv)
   int fd;
   struct cfile *bfp = 0;
   struct cfile *obfp;
+  struct cfile *ocfp = 0;
   char *fnevr;
   unsigned int inn;
   unsigned int *in;
@@ -1145,11 +1475,14 @@ main(int argc, char **argv)
   unsigned char wrmd5res[16];
   int nofullmd5 = 0;
   FILE *ofp;
-  int numblks;
+  int numblks = 0;
   int percent = 0;
   int curpercent;
   int lastpercent = -1;
   int verbose = 0;
+  int threads = 0;
+  int pipeline = 0;
+  int targetcomp;
   int seqcheck = 0;
   int check = 0;
   int checkflags = 0;
@@ -1163,8 +1496,9 @@ main(int argc, char **argv)
   FILE *vfp;
   struct deltarpm d;
   char *arch = 0;
+  struct cfile_stats cfstats[CFILE_STATS_N];
 
-  while ((c = getopt(argc, argv, "cCisvpr:a:")) != -1)
+  while ((c = getopt(argc, argv, "cCisvpPr:a:t:b:m:T:")) != -1)
     {
       switch(c)
 	{
@@ -1174,6 +1508,9 @@ main(int argc, char **argv)
 	case 'p':
           percent++;
 	  break;
+	case 'P':
+	  pipeline = 1;
+	  break;
 	case 'r':
 	  fromrpm = optarg;
 	  break;
@@ -1195,6 +1532,38 @@ main(int argc, char **argv)
 	case 'a':
 	  arch = optarg;
 	  break;
+	case 't':
+	  threads = atoi(optarg);
+	  if (threads < 1 || threads > 255)
+	    {
+	      fprintf(stderr, "illegal thread count: %s\n", optarg);
+	      exit(1);
+	    }
+	  break;
+	case 'b':
+	  for (blkshift = 10; blkshift <= 20; blkshift++)
+	    if (atoi(optarg) == 1 << (blkshift - 10))
+	      break;
+	  if (blkshift > 20)
+	    {
+	      fprintf(stderr, "illegal block size: %s\n", optarg);
+	      exit(1);
+	    }
+	  break;
+	case 'T':
+	  pagedir = optarg;
+	  break;
+	case 'm':
+	  if (!strcmp(optarg, "auto"))
+	    corebudget = autocorebudget();
+	  else if (atoi(optarg) > 0)
+	    corebudget = (unsigned long long)atoi(optarg) << 20;
+	  else
+	    {
+	      fprintf(stderr, "illegal memory size: %s\n", optarg);
+	      exit(1);
+	    }
+	  break;
 	default:
 	  fprintf(stderr, "usage: applydeltarpm [-r <rpm>] deltarpm rpm\n");
           exit(1);
@@ -1211,8 +1580,19 @@ main(int argc, char **argv)
       fprintf(stderr, "on-disk checking does not work with the -r option.\n");
       exit(1);
     }
+  if ((corebudget >> BLKSHIFT) > 0x7fffffff)
+    maxcoreblk = 0x7fffffff;
+  else
+    maxcoreblk = corebudget >> BLKSHIFT;
+  if (maxcoreblk < 16)
+    maxcoreblk = 16;
 
   vfp = !(check || info) && !strcmp(argv[argc - 1], "-") ? stderr : stdout;
+  if (verbose > 1)
+    {
+      memset(cfstats, 0, sizeof(cfstats));
+      cfile_stats(cfstats);
+    }
 
   deltarpm = argv[optind];
 
@@ -1273,7 +1653,7 @@ main(int argc, char **argv)
 	  fprintf(vfp, "%llu bytes target payload size\n", (unsigned long long)d.paylen);
 	  fprintf(vfp, "%llu bytes internal data size\n", (unsigned long long)d.inlen);
 	  fprintf(vfp, "%u bytes add data size\n", d.addblklen);
-	  fprintf(vfp, "%d blocks\n", numblks);
+	  fprintf(vfp, "%d blocks of %d bytes\n", numblks, BLKSIZE);
 	  fprintf(vfp, "%d copy instructions\n", d.inn + d.outn);
 	}
       off = 0;
@@ -1295,6 +1675,8 @@ main(int argc, char **argv)
     addblkcomp = CFILE_COMP_LZMA;
   else if (d.addblklen > 6 && (d.addblk[0] == 0xfd && d.addblk[1] == '7' && d.addblk[2] == 'z' && d.addblk[3] == 'X' && d.addblk[4] == 'Z'))
     addblkcomp = CFILE_COMP_XZ;
+  else if (d.addblklen > 4 && d.addblk[0] == 0x28 && d.addblk[1] == 0xb5 && d.addblk[2] == 0x2f && d.addblk[3] == 0xfd)
+    addblkcomp = CFILE_COMP_ZSTD;
   if (info)
     {
       unsigned int *size;
@@ -1584,7 +1966,7 @@ main(int argc, char **argv)
 
   if (fromrpm)
     {
-      if ((outfp = cfile_open(CFILE_OPEN_RD, fd, 0, CFILE_COMP_XX, CFILE_LEN_UNLIMITED, 0, 0)) == 0)
+      if ((outfp = cfile_open(CFILE_OPEN_RD, CFILE_IO_MMAP, &fd, CFILE_COMP_XX, CFILE_LEN_UNLIMITED, 0, 0)) == 0)
 	{
 	  fprintf(stderr, "%s: payload open failed\n", deltarpm);
 	  exit(1);
@@ -1628,7 +2010,27 @@ main(int argc, char **argv)
       addblkbuf = xmalloc(BLKSIZE);
     }
 
-  obfp = cfile_open(CFILE_OPEN_WR, CFILE_IO_FILE, ofp, d.compheadlen ? CFILE_COMP_UN : d.targetcomp, CFILE_LEN_UNLIMITED, (cfile_ctxup)rpmMD5Update, &wrmd5);
+  targetcomp = d.targetcomp;
+  if (threads)
+    {
+      /* the parallel bzip2 writer creates the same output */
+      cfile_setthreads(threads);
+      if (threads > 1 && CFILE_COMPALGO(targetcomp) == CFILE_COMP_BZ)
+	targetcomp |= CFILE_COMP_MT;
+    }
+  if (pipeline && CFILE_COMPALGO(targetcomp) != CFILE_COMP_UN)
+    {
+      /* md5 and file output get a thread of their own */
+      ocfp = cfile_writethread(cfile_open(CFILE_OPEN_WR, CFILE_IO_FILE, ofp, CFILE_COMP_UN, CFILE_LEN_UNLIMITED, (cfile_ctxup)rpmMD5Update, &wrmd5));
+      if (!ocfp)
+	{
+	  fprintf(stderr, "payload write error\n");
+	  exit(1);
+	}
+      obfp = cfile_open(CFILE_OPEN_WR, CFILE_IO_CFILE, ocfp, d.compheadlen ? CFILE_COMP_UN : targetcomp, CFILE_LEN_UNLIMITED, 0, 0);
+    }
+  else
+    obfp = cfile_open(CFILE_OPEN_WR, CFILE_IO_FILE, ofp, d.compheadlen ? CFILE_COMP_UN : targetcomp, CFILE_LEN_UNLIMITED, (cfile_ctxup)rpmMD5Update, &wrmd5);
   if (!obfp)
     {
       fprintf(stderr, "payload write error\n");
@@ -1636,14 +2038,27 @@ main(int argc, char **argv)
     }
   if (d.compheadlen)
     {
-      obfp->comp = d.targetcomp;
+      obfp->comp = targetcomp;
       obfp->len = d.compheadlen;
       obfp->write = cfile_write_uncomp;
     }
+  if (pipeline)
+    {
+      /* so does the compressor, we just assemble the blocks */
+      obfp = cfile_writethread(obfp);
+      if (!obfp)
+	{
+	  fprintf(stderr, "payload write error\n");
+	  exit(1);
+	}
+    }
   if (fromrpm)
     fillblock_method = fillblock_rpm;
   else
-    fillblock_method = fillblock_disk;
+    {
+      fillblock_method = fillblock_disk;
+      prefetch_init(d.out, d.outn, numblks);
+    }
   if (fromrpm_raw)
     {
       fillblock_method = fillblock_rawrpm;
@@ -1683,6 +2098,8 @@ main(int argc, char **argv)
 	    {
 	      if (!lastblk || bs != lastblk->id)
 		{
+		  if (pfblks)
+		    prefetch(bs, sdesc, nsdesc, &fb);
 		  lastblk = vmem[bs];
 		  if (!lastblk || lastblk->type == BLK_PAGE)
 		    lastblk = getblock(bs, sdesc, nsdesc, &fb, idx);
@@ -1786,7 +2203,7 @@ main(int argc, char **argv)
     fprintf(vfp, "100 percent finished.\n");
   else if (percent)
     fprintf(vfp, "\r100 percent finished.\n");
-  if (obfp->close(obfp) == -1)
+  if (obfp->close(obfp) == -1 || (ocfp && ocfp->close(ocfp) == -1))
     {
       fprintf(stderr, "write error\n");
       exit(1);
@@ -1800,6 +2217,8 @@ main(int argc, char **argv)
     outfp->close(outfp);
   if (bfp)
     bfp->close(bfp);
+  if (pffd >= 0)
+    close(pffd);
   if (d.addblklen)
     {
       if (addblkcomp == CFILE_COMP_GZ)
@@ -1809,11 +2228,12 @@ main(int argc, char **argv)
     }
   if (verbose > 1)
     {
-      fprintf(vfp, "used %d core pages\n", ncoreblk);
+      fprintf(vfp, "used %d core pages (max %d)\n", ncoreblk, maxcoreblk);
       fprintf(vfp, "used %d swap pages\n", npageblk);
       fprintf(vfp, "had to recreate %d core pages\n", ndropblk);
       if (nprelink)
         fprintf(vfp, "had to call prelink %d times\n", nprelink);
+      cfile_printstats(vfp, cfstats);
     }
   rpmMD5Final(wrmd5res, &wrmd5);
   if (nofullmd5)
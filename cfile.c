@@ -10,13 +10,95 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
 
 #include <zlib.h>
 #include <bzlib.h>
 #include <lzma.h>
+#ifdef WITH_LIBDEFLATE
+#include <libdeflate.h>
+#endif
 
 #include "cfile.h"
 
+/*****************************************************************
+ *  statistics
+ */
+
+static struct cfile_stats *cfile_statsp;
+
+/* cfiles of the same kind can run in different threads, e.g. with
+ * applydeltarpm -P, and share a slot */
+#define STAT_ADD(f, field, n) __atomic_fetch_add(&(f)->stats->field, (unsigned long long)(n), __ATOMIC_RELAXED)
+
+void
+cfile_stats(struct cfile_stats *stats)
+{
+  cfile_statsp = stats;
+}
+
+static unsigned long long
+cfile_usecs(clockid_t clk)
+{
+  struct timespec ts;
+
+  clock_gettime(clk, &ts);
+  return (unsigned long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void
+cfile_codecstart(struct cfile *f)
+{
+  f->statwall = cfile_usecs(CLOCK_MONOTONIC);
+  f->statcpu = cfile_usecs(CLOCK_THREAD_CPUTIME_ID);
+}
+
+static void
+cfile_codecend(struct cfile *f, size_t bytes)
+{
+  STAT_ADD(f, codecusecs, cfile_usecs(CLOCK_MONOTONIC) - f->statwall);
+  STAT_ADD(f, codeccpuusecs, cfile_usecs(CLOCK_THREAD_CPUTIME_ID) - f->statcpu);
+  STAT_ADD(f, bytes, bytes);
+}
+
+/* time spent in the (de)compressor and the uncompressed bytes */
+#define CODEC_START(f) do { if ((f)->stats) cfile_codecstart(f); } while (0)
+#define CODEC_END(f, n) do { if ((f)->stats) cfile_codecend(f, n); } while (0)
+
+static void
+cfile_iostats(struct cfile *f, unsigned long long start, int len)
+{
+  if (start)
+    {
+      STAT_ADD(f, iocalls, 1);
+      STAT_ADD(f, iousecs, cfile_usecs(CLOCK_MONOTONIC) - start);
+    }
+  STAT_ADD(f, rawbytes, len);
+}
+
+void
+cfile_printstats(FILE *fp, struct cfile_stats *stats)
+{
+  int i;
+  struct cfile_stats *st;
+
+  for (i = 0; i < CFILE_STATS_N; i++)
+    {
+      st = stats + i;
+      if (!st->bytes && !st->rawbytes)
+	continue;
+      fprintf(fp, "%s %s: %llu bytes, %llu raw bytes, %llu io calls %.3fs", cfile_comp2str(i & 7), i & 8 ? "write" : "read", st->bytes, st->rawbytes, st->iocalls, st->iousecs / 1000000.);
+      if ((i & 7) != CFILE_COMP_UN)
+	fprintf(fp, ", codec %.3fs (cpu %.3fs)", st->codecusecs / 1000000., st->codeccpuusecs / 1000000.);
+      fprintf(fp, "\n");
+    }
+}
+
+
 /*****************************************************************
  *  generic input/output routines
  */
@@ -24,6 +106,9 @@
 static int
 cfile_readbuf(struct cfile *f, unsigned char *buf, int len)
 {
+  int fd = f->fd;
+  unsigned long long start = 0;
+
   if (len < 0)
     return -1;
   if (f->len != CFILE_LEN_UNLIMITED && len > f->len)
@@ -33,6 +118,8 @@ cfile_readbuf(struct cfile *f, unsigned char *buf, int len)
       f->bufN = 0;
       return 0;
     }
+  if (f->stats && (fd >= 0 || fd == CFILE_IO_FILE || fd == CFILE_IO_PUSHBACK))
+    start = cfile_usecs(CLOCK_MONOTONIC);
   switch (f->fd)
     {
     case CFILE_IO_FILE:
@@ -61,6 +148,7 @@ cfile_readbuf(struct cfile *f, unsigned char *buf, int len)
     case CFILE_IO_ALLOC:
       return -1;
     case CFILE_IO_BUFFER:
+    case CFILE_IO_MMAP:
       memcpy(buf, f->fp, len);
       f->fp += len;
       break;
@@ -73,6 +161,8 @@ cfile_readbuf(struct cfile *f, unsigned char *buf, int len)
     }
   if (len < 0)
     return -1;
+  if (f->stats)
+    cfile_iostats(f, start, len);
   if (f->len != CFILE_LEN_UNLIMITED)
     f->len -= len;
 /*
@@ -85,15 +175,41 @@ cfile_readbuf(struct cfile *f, unsigned char *buf, int len)
   return len;
 }
 
+/* fill the decompressor input. Memory backed data is used in place,
+ * everything else is read into f->buf */
+static unsigned char *
+cfile_readin(struct cfile *f)
+{
+  unsigned char *p;
+  size_t len;
+
+  if (f->fd != CFILE_IO_BUFFER && f->fd != CFILE_IO_MMAP)
+    return cfile_readbuf(f, f->buf, f->bufsize) == -1 ? 0 : f->buf;
+  len = f->len == CFILE_LEN_UNLIMITED ? f->bufsize : f->len;
+  if (len > 0x40000000)
+    len = 0x40000000;
+  p = f->fp;
+  f->fp += len;
+  if (f->len != CFILE_LEN_UNLIMITED)
+    f->len -= len;
+  if (f->stats)
+    STAT_ADD(f, rawbytes, len);
+  f->bufN = len;
+  return p;
+}
+
 static int
 cfile_writebuf(struct cfile *f, unsigned char *buf, int len)
 {
   unsigned char **bp, *nb;
+  unsigned long long start = 0;
 
   if (len == 0)
     return 0;
   if (f->len != CFILE_LEN_UNLIMITED && f->len < len)
     return 0;
+  if (f->stats && (f->fd >= 0 || f->fd == CFILE_IO_FILE))
+    start = cfile_usecs(CLOCK_MONOTONIC);
   switch (f->fd)
     {
     case CFILE_IO_FILE:
@@ -133,6 +249,8 @@ cfile_writebuf(struct cfile *f, unsigned char *buf, int len)
     }
   if (len == -1)
     return -1;
+  if (f->stats)
+    cfile_iostats(f, start, len);
   if (f->len != CFILE_LEN_UNLIMITED)
     f->len -= len;
   if (len && f->ctxup)
@@ -153,6 +271,36 @@ cwclose_fixupalloc(struct cfile *f)
     *bp = n;
 }
 
+static int cfile_threads;
+static int cfile_bufsize = CFILE_BUFSIZE_DEFAULT;
+
+void
+cfile_setbufsize(int bufsize)
+{
+  cfile_bufsize = bufsize < 4096 ? 4096 : bufsize;
+}
+
+void
+cfile_setthreads(int threads)
+{
+  cfile_threads = threads;
+}
+
+static int
+cfile_mtthreads(void)
+{
+  long ncpu;
+
+  if (cfile_threads > 0)
+    return cfile_threads;
+  ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+  if (ncpu < 1)
+    ncpu = 1;
+  if (ncpu > 8)
+    ncpu = 8;
+  return ncpu;
+}
+
 
 /*****************************************************************
  *  unread stuff
@@ -201,7 +349,7 @@ cfile_unreadbuf(struct cfile *f, void *buf, int len, int usebuf)
     return -1;
   if (len == 0)
     return 0;
-  if (usebuf && (f->unreadbuf == 0 || f->unreadbuf == f->buf) && len <= sizeof(f->buf) - f->nunread)
+  if (usebuf && (f->unreadbuf == 0 || f->unreadbuf == f->buf) && len <= f->bufsize - f->nunread)
     newbuf = f->buf;
   else
     {
@@ -237,7 +385,7 @@ cfile_unreadbuf(struct cfile *f, void *buf, int len, int usebuf)
 static int
 crread_bz(struct cfile *f, void *buf, int len)
 {
-  int ret, used;
+  int ret, used, n;
   if (f->eof)
     return 0;
   f->strm.bz.avail_out = len;
@@ -246,13 +394,17 @@ crread_bz(struct cfile *f, void *buf, int len)
     {
       if (f->strm.bz.avail_in == 0 && f->bufN)
         {
-	  if (cfile_readbuf(f, f->buf, sizeof(f->buf)) == -1)
+	  unsigned char *p = cfile_readin(f);
+	  if (!p)
 	    return -1;
           f->strm.bz.avail_in = f->bufN;
-          f->strm.bz.next_in = (char *)f->buf;
+          f->strm.bz.next_in = (char *)p;
         }
       used = f->strm.bz.avail_in;
+      n = f->strm.bz.avail_out;
+      CODEC_START(f);
       ret = BZ2_bzDecompress(&f->strm.bz);
+      CODEC_END(f, n - f->strm.bz.avail_out);
       if (ret != BZ_OK && ret != BZ_STREAM_END)
         return -1;
       used -= f->strm.bz.avail_in;
@@ -314,12 +466,15 @@ cwwrite_bz(struct cfile *f, void *buf, int len)
   f->strm.bz.next_in = buf;
   for (;;)
     {
-      f->strm.bz.avail_out = sizeof(f->buf);
+      f->strm.bz.avail_out = f->bufsize;
       f->strm.bz.next_out = (char *)f->buf;
+      n = f->strm.bz.avail_in;
+      CODEC_START(f);
       ret = BZ2_bzCompress(&f->strm.bz, BZ_RUN);
+      CODEC_END(f, n - f->strm.bz.avail_in);
       if (ret != BZ_RUN_OK)
 	return -1;
-      n = sizeof(f->buf) - f->strm.bz.avail_out;
+      n = f->bufsize - f->strm.bz.avail_out;
       if (n > 0)
 	if (cfile_writebuf(f, f->buf, n) != n)
 	  return -1;
@@ -336,12 +491,14 @@ cwclose_bz(struct cfile *f)
   f->strm.bz.next_in = 0;
   for (;;)
     {
-      f->strm.bz.avail_out = sizeof(f->buf);
+      f->strm.bz.avail_out = f->bufsize;
       f->strm.bz.next_out = (char *)f->buf;
+      CODEC_START(f);
       ret = BZ2_bzCompress(&f->strm.bz, BZ_FINISH);
+      CODEC_END(f, 0);
       if (ret != BZ_FINISH_OK && ret != BZ_STREAM_END)
 	return -1;
-      n = sizeof(f->buf) - f->strm.bz.avail_out;
+      n = f->bufsize - f->strm.bz.avail_out;
       if (n > 0)
 	if (cfile_writebuf(f, f->buf, n) != n)
 	  return -1;
@@ -356,11 +513,15 @@ cwclose_bz(struct cfile *f)
   return bytes;
 }
 
+static struct cfile *cwopen_pbz(struct cfile *f, int nthreads);
+
 static struct cfile *
 cwopen_bz(struct cfile *f)
 {
   if (!f->level)
     f->level = 9;
+  if (f->mt && cfile_mtthreads() > 1)
+    return cwopen_pbz(f, cfile_mtthreads());
   if (BZ2_bzCompressInit(&f->strm.bz, f->level, 0, 30) != BZ_OK)
     {
       free(f);
@@ -376,6 +537,294 @@ crunread_bz(struct cfile *f, void *buf, int len)
 }
 
 
+/*****************************************************************
+ *  parallel bzip2 io
+ *
+ *  libbz2 cuts the run length encoded input into blocks of
+ *  100000 * level - 19 bytes and compresses each block on its own.
+ *  We make the same cuts, compress every block as a stream of its
+ *  own in a worker thread and splice the block bits together. This
+ *  gives exactly the stream a single bz_stream would have produced.
+ */
+
+struct pbzblock {
+  pthread_t tid;
+  int started;
+  int level;
+  unsigned char *in;
+  unsigned int inl;
+  unsigned char *out;
+  unsigned int outl;
+  unsigned int crc;
+  size_t startbit;
+  size_t endbit;
+};
+
+struct cfile_pbz {
+  int nthreads;
+  struct pbzblock *blocks;	/* ring of nthreads running blocks */
+  int first;
+  int nrunning;
+  int nblockmax;		/* libbz2's block cutting state */
+  int nblock;
+  int inch;
+  int inlen;
+  unsigned char *in;		/* input of the current block */
+  unsigned int inl;
+  unsigned int ina;
+  unsigned int crc;		/* combined crc */
+  unsigned int bits;
+  int nbits;
+  int bufN;
+};
+
+static unsigned int
+pbz_getbits(unsigned char *p, size_t bit, int n)
+{
+  unsigned int v;
+
+  /* n <= 24, p has 4 bytes of slack */
+  p += bit >> 3;
+  v = p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+  return v << (bit & 7) >> (32 - n);
+}
+
+static void *
+pbz_compressblock(void *arg)
+{
+  struct pbzblock *b = arg;
+  bz_stream strm;
+  unsigned int outa;
+  size_t end;
+  int pad, ret;
+
+  outa = b->inl + b->inl / 100 + 600;
+  b->out = calloc(outa + 4, 1);
+  b->outl = 0;
+  if (!b->out)
+    return 0;
+  memset(&strm, 0, sizeof(strm));
+  if (BZ2_bzCompressInit(&strm, b->level, 0, 30) != BZ_OK)
+    return 0;
+  strm.next_in = (char *)b->in;
+  strm.avail_in = b->inl;
+  strm.next_out = (char *)b->out;
+  strm.avail_out = outa;
+  ret = BZ2_bzCompress(&strm, BZ_FINISH);
+  BZ2_bzCompressEnd(&strm);
+  if (ret != BZ_STREAM_END)
+    return 0;
+  b->outl = outa - strm.avail_out;
+  if (b->outl < 4 + 10 + 10)
+    {
+      b->outl = 0;
+      return 0;
+    }
+  /* stream header, block magic, block crc, block data, eos magic, crc, padding */
+  b->crc = b->out[10] << 24 | b->out[11] << 16 | b->out[12] << 8 | b->out[13];
+  b->startbit = 32;
+  b->endbit = 0;
+  for (pad = 0; pad < 8; pad++)
+    {
+      end = (size_t)b->outl * 8 - pad - 80;
+      if (pbz_getbits(b->out, end, 24) == 0x177245 && pbz_getbits(b->out, end + 24, 24) == 0x385090 && pbz_getbits(b->out, end + 48, 16) == b->crc >> 16 && pbz_getbits(b->out, end + 64, 16) == (b->crc & 0xffff))
+	{
+	  b->endbit = end;
+	  break;
+	}
+    }
+  return 0;
+}
+
+static int
+pbz_putbits(struct cfile *f, unsigned int v, int n)
+{
+  struct cfile_pbz *pbz = f->strm.pbz;
+
+  /* n <= 24 */
+  pbz->bits = pbz->bits << n | (v & ((1 << n) - 1));
+  pbz->nbits += n;
+  while (pbz->nbits >= 8)
+    {
+      pbz->nbits -= 8;
+      f->buf[pbz->bufN++] = pbz->bits >> pbz->nbits;
+      if (pbz->bufN == f->bufsize)
+	{
+	  if (cfile_writebuf(f, f->buf, pbz->bufN) != pbz->bufN)
+	    return -1;
+	  pbz->bufN = 0;
+	}
+    }
+  return 0;
+}
+
+/* wait for the oldest block and append it to the stream */
+static int
+pbz_finishblock(struct cfile *f)
+{
+  struct cfile_pbz *pbz = f->strm.pbz;
+  struct pbzblock *b = pbz->blocks + pbz->first;
+  size_t bit;
+  int r = 0;
+
+  if (b->started)
+    pthread_join(b->tid, 0);
+  pbz->first = (pbz->first + 1) % pbz->nthreads;
+  pbz->nrunning--;
+  free(b->in);
+  b->in = 0;
+  if (!b->outl || !b->endbit)
+    r = -1;
+  for (bit = b->startbit; !r && bit + 24 <= b->endbit; bit += 24)
+    r = pbz_putbits(f, pbz_getbits(b->out, bit, 24), 24);
+  if (!r && bit < b->endbit)
+    r = pbz_putbits(f, pbz_getbits(b->out, bit, b->endbit - bit), b->endbit - bit);
+  pbz->crc = (pbz->crc << 1 | pbz->crc >> 31) ^ b->crc;
+  free(b->out);
+  b->out = 0;
+  return r;
+}
+
+/* hand the current block to a worker, takes ownership of the input */
+static int
+pbz_submitblock(struct cfile *f, unsigned int inl)
+{
+  struct cfile_pbz *pbz = f->strm.pbz;
+  struct pbzblock *b;
+
+  if (pbz->nrunning == pbz->nthreads)
+    if (pbz_finishblock(f))
+      return -1;
+  b = pbz->blocks + (pbz->first + pbz->nrunning) % pbz->nthreads;
+  pbz->nrunning++;
+  b->level = f->level;
+  b->in = pbz->in;
+  b->inl = inl;
+  b->started = pthread_create(&b->tid, 0, pbz_compressblock, b) == 0;
+  if (!b->started)
+    pbz_compressblock(b);
+  pbz->in = 0;
+  pbz->inl = pbz->ina = 0;
+  return 0;
+}
+
+static int
+cwwrite_pbz(struct cfile *f, void *buf, int len)
+{
+  struct cfile_pbz *pbz = f->strm.pbz;
+  unsigned char *p = buf;
+  int i, c;
+
+  if (len <= 0)
+    return len < 0 ? -1 : 0;
+  /* includes waiting for the workers and writing their output */
+  CODEC_START(f);
+  for (i = 0; i < len; i++)
+    {
+      c = p[i];
+      if (pbz->inl == pbz->ina)
+	{
+	  pbz->ina = pbz->ina ? pbz->ina * 2 : pbz->nblockmax + 4096;
+	  if ((pbz->in = realloc(pbz->in, pbz->ina)) == 0)
+	    return -1;
+	}
+      pbz->in[pbz->inl++] = c;
+      /* same as ADD_CHAR_TO_BLOCK in libbz2, but only counts */
+      if (c != pbz->inch && pbz->inlen == 1)
+	{
+	  pbz->nblock++;
+	  pbz->inch = c;
+	}
+      else if (c != pbz->inch || pbz->inlen == 255)
+	{
+	  if (pbz->inch < 256)
+	    pbz->nblock += pbz->inlen < 4 ? pbz->inlen : 5;
+	  pbz->inch = c;
+	  pbz->inlen = 1;
+	}
+      else
+	pbz->inlen++;
+      if (pbz->nblock < pbz->nblockmax)
+	continue;
+      /* block is full. c starts a pending run that libbz2 puts into
+       * the next block */
+      if (pbz_submitblock(f, pbz->inl - 1))
+	return -1;
+      pbz->ina = pbz->nblockmax + 4096;
+      if ((pbz->in = malloc(pbz->ina)) == 0)
+	return -1;
+      pbz->in[0] = c;
+      pbz->inl = 1;
+      pbz->nblock = 0;
+    }
+  CODEC_END(f, len);
+  return len;
+}
+
+static int
+cwclose_pbz(struct cfile *f)
+{
+  struct cfile_pbz *pbz = f->strm.pbz;
+  int bytes, r = 0;
+
+  CODEC_START(f);
+  if (pbz->inl)
+    r = pbz_submitblock(f, pbz->inl);
+  while (pbz->nrunning)
+    if (pbz_finishblock(f))
+      r = -1;
+  CODEC_END(f, 0);
+  if (!r)
+    r = pbz_putbits(f, 0x177245, 24);
+  if (!r)
+    r = pbz_putbits(f, 0x385090, 24);
+  if (!r)
+    r = pbz_putbits(f, pbz->crc >> 16, 16);
+  if (!r)
+    r = pbz_putbits(f, pbz->crc, 16);
+  if (!r && pbz->nbits)
+    r = pbz_putbits(f, 0, 8 - pbz->nbits);
+  if (!r && pbz->bufN)
+    if (cfile_writebuf(f, f->buf, pbz->bufN) != pbz->bufN)
+      r = -1;
+  free(pbz->in);
+  free(pbz->blocks);
+  free(pbz);
+  if (f->fd == CFILE_IO_ALLOC)
+    cwclose_fixupalloc(f);
+  bytes = f->bytes;
+  free(f);
+  return r ? -1 : bytes;
+}
+
+static struct cfile *
+cwopen_pbz(struct cfile *f, int nthreads)
+{
+  struct cfile_pbz *pbz;
+
+  if ((pbz = calloc(1, sizeof(*pbz))) == 0)
+    {
+      free(f);
+      return 0;
+    }
+  if ((pbz->blocks = calloc(nthreads, sizeof(*pbz->blocks))) == 0)
+    {
+      free(pbz);
+      free(f);
+      return 0;
+    }
+  pbz->nthreads = nthreads;
+  pbz->nblockmax = 100000 * f->level - 19;
+  pbz->inch = 256;
+  f->strm.pbz = pbz;
+  f->write = cwwrite_pbz;
+  f->close = cwclose_pbz;
+  pbz_putbits(f, 'B' << 16 | 'Z' << 8 | 'h', 24);
+  pbz_putbits(f, '0' + f->level, 8);
+  return f;
+}
+
+
 /*****************************************************************
  *  gzip io
  */
@@ -383,7 +832,7 @@ crunread_bz(struct cfile *f, void *buf, int len)
 static int
 crread_gz(struct cfile *f, void *buf, int len)
 {
-  int ret, used;
+  int ret, used, n;
   if (f->eof)
     return 0;
   f->strm.gz.avail_out = len;
@@ -392,13 +841,17 @@ crread_gz(struct cfile *f, void *buf, int len)
     {
       if (f->strm.gz.avail_in == 0 && f->bufN)
         {
-	  if (cfile_readbuf(f, f->buf, sizeof(f->buf)) == -1)
+	  unsigned char *p = cfile_readin(f);
+	  if (!p)
 	    return -1;
           f->strm.gz.avail_in = f->bufN;
-          f->strm.gz.next_in = f->buf;
+          f->strm.gz.next_in = p;
         }
       used = f->strm.gz.avail_in;
+      n = f->strm.gz.avail_out;
+      CODEC_START(f);
       ret = inflate(&f->strm.gz, Z_NO_FLUSH);
+      CODEC_END(f, n - f->strm.gz.avail_out);
       if (ret != Z_OK && ret != Z_STREAM_END)
         return -1;
       used -= f->strm.gz.avail_in;
@@ -441,6 +894,84 @@ crread_gz(struct cfile *f, void *buf, int len)
     }
 }
 
+#ifdef WITH_LIBDEFLATE
+
+/* If the whole stream is in memory and ends with the input, the
+ * trailer tells us the uncompressed size and libdeflate can
+ * decompress it in one go, which is a lot faster than inflate.
+ * We fall back to inflate if that does not work out. */
+
+#define CFILE_GZMEM_MAX (1 << 28)
+
+static int
+crread_gzmem(struct cfile *f, void *buf, int len)
+{
+  if (len < 0)
+    return -1;
+  if (len > f->memlen - f->memoff)
+    len = f->memlen - f->memoff;
+  memcpy(buf, f->membuf + f->memoff, len);
+  f->memoff += len;
+  return len;
+}
+
+static int
+crread_gzfirst(struct cfile *f, void *buf, int len)
+{
+  struct libdeflate_decompressor *d;
+  unsigned char *in, *out;
+  size_t inlen, outlen, inused, outused;
+  enum libdeflate_result res;
+
+  f->read = crread_gz;
+  /* cfile_detect_rsync may have switched us to a pushback stream */
+  if (f->fd != CFILE_IO_BUFFER && f->fd != CFILE_IO_MMAP)
+    return crread_gz(f, buf, len);
+  /* the already read part is also still in front of fp */
+  in = (unsigned char *)f->fp - f->strm.gz.avail_in;
+  inlen = f->strm.gz.avail_in + f->len;
+  if (inlen < 2 + 8)
+    return crread_gz(f, buf, len);
+  outlen = in[inlen - 4] | in[inlen - 3] << 8 | in[inlen - 2] << 16 | (size_t)in[inlen - 1] << 24;
+  if (outlen > CFILE_GZMEM_MAX || outlen / 1032 > inlen)
+    return crread_gz(f, buf, len);
+  if ((out = malloc(outlen ? outlen : 1)) == 0)
+    return crread_gz(f, buf, len);
+  if ((d = libdeflate_alloc_decompressor()) == 0)
+    {
+      free(out);
+      return crread_gz(f, buf, len);
+    }
+  CODEC_START(f);
+  res = libdeflate_deflate_decompress_ex(d, in, inlen - 8, out, outlen, &inused, &outused);
+  libdeflate_free_decompressor(d);
+  CODEC_END(f, res == LIBDEFLATE_SUCCESS ? outused : 0);
+  if (res != LIBDEFLATE_SUCCESS || inused != inlen - 8 || outused != outlen)
+    {
+      free(out);
+      return crread_gz(f, buf, len);
+    }
+  if (f->ctxup)
+    f->ctxup(f->ctx, in, inlen);
+  f->bytes += inlen;
+  /* make trailer available in f->buf */
+  memcpy(f->buf, in + inlen - 8, 8);
+  if (f->stats)
+    STAT_ADD(f, rawbytes, f->len);
+  f->fp += f->len;
+  f->len = 0;
+  f->bufN = 0;
+  f->strm.gz.avail_in = 0;
+  f->eof = 1;
+  f->membuf = out;
+  f->memlen = outlen;
+  f->memoff = 0;
+  f->read = crread_gzmem;
+  return crread_gzmem(f, buf, len);
+}
+
+#endif
+
 static int
 crclose_gz(struct cfile *f)
 {
@@ -460,6 +991,7 @@ crclose_gz(struct cfile *f)
   r = (f->len != CFILE_LEN_UNLIMITED ? f->len : 0) + f->strm.gz.avail_in;
   if (f->unreadbuf != f->buf)
     free(f->unreadbuf);
+  free(f->membuf);
   free(f);
   return r;
 }
@@ -470,7 +1002,7 @@ cropen_gz(struct cfile *f)
   int ret, flags;
 
   if (f->bufN == -1)
-    cfile_readbuf(f, f->buf, sizeof(f->buf));
+    cfile_readbuf(f, f->buf, f->bufsize);
   if (f->bufN < 10)
     {
       free(f);
@@ -503,7 +1035,7 @@ cropen_gz(struct cfile *f)
 	    }
 	  if (f->strm.gz.avail_in == 0)
 	    {
-	      if (cfile_readbuf(f, f->buf, sizeof(f->buf)) == -1)
+	      if (cfile_readbuf(f, f->buf, f->bufsize) == -1)
 		{
 		  free(f);
 		  return 0;
@@ -534,6 +1066,10 @@ cropen_gz(struct cfile *f)
       free(f);
       return 0;
     }
+#ifdef WITH_LIBDEFLATE
+  if ((f->fd == CFILE_IO_BUFFER || f->fd == CFILE_IO_MMAP) && f->len != CFILE_LEN_UNLIMITED)
+    f->read = crread_gzfirst;
+#endif
   return f;
 }
 
@@ -548,12 +1084,15 @@ cwwrite_gz(struct cfile *f, void *buf, int len)
   f->strm.gz.next_in = buf;
   for (;;)
     {
-      f->strm.gz.avail_out = sizeof(f->buf);
+      f->strm.gz.avail_out = f->bufsize;
       f->strm.gz.next_out = f->buf;
+      n = f->strm.gz.avail_in;
+      CODEC_START(f);
       ret = deflate(&f->strm.gz, Z_NO_FLUSH);
+      CODEC_END(f, n - f->strm.gz.avail_in);
       if (ret != Z_OK)
 	return -1;
-      n = sizeof(f->buf) - f->strm.gz.avail_out;
+      n = f->bufsize - f->strm.gz.avail_out;
       if (n > 0)
 	if (cfile_writebuf(f, f->buf, n) != n)
 	  return -1;
@@ -572,12 +1111,14 @@ cwclose_gz(struct cfile *f)
   int bytes, ret, n;
   for (;;)
     {
-      f->strm.gz.avail_out = sizeof(f->buf);
+      f->strm.gz.avail_out = f->bufsize;
       f->strm.gz.next_out = f->buf;
+      CODEC_START(f);
       ret = deflate(&f->strm.gz, Z_FINISH);
+      CODEC_END(f, 0);
       if (ret != Z_OK && ret != Z_STREAM_END)
 	return -1;
-      n = sizeof(f->buf) - f->strm.gz.avail_out;
+      n = f->bufsize - f->strm.gz.avail_out;
       if (n > 0)
 	if (cfile_writebuf(f, f->buf, n) != n)
 	  return -1;
@@ -658,7 +1199,7 @@ cropen_lz(struct cfile *f)
 {
   lzma_stream tmp = LZMA_STREAM_INIT;
   f->strm.lz = tmp;
-  if (lzma_auto_decoder(&f->strm.lz, 1 << 25, 0) != LZMA_OK)
+  if (lzma_auto_decoder(&f->strm.lz, 1 << 28, 0) != LZMA_OK)
     {
       free(f);
       return 0;
@@ -672,7 +1213,7 @@ cropen_lz(struct cfile *f)
 static int
 crread_lz(struct cfile *f, void *buf, int len)
 {
-  int ret, used;
+  int ret, used, n;
   if (f->eof)
     return 0;
   f->strm.lz.avail_out = len;
@@ -681,13 +1222,17 @@ crread_lz(struct cfile *f, void *buf, int len)
     {
       if (f->strm.lz.avail_in == 0 && f->bufN)
 	{
-	  if (cfile_readbuf(f, f->buf, sizeof(f->buf)) == -1)
+	  unsigned char *p = cfile_readin(f);
+	  if (!p)
 	    return -1;
 	  f->strm.lz.avail_in = f->bufN;
-	  f->strm.lz.next_in = (unsigned char *)f->buf;
+	  f->strm.lz.next_in = p;
 	}
       used = f->strm.lz.avail_in;
+      n = f->strm.lz.avail_out;
+      CODEC_START(f);
       ret = lzma_code(&f->strm.lz, LZMA_RUN);
+      CODEC_END(f, n - f->strm.lz.avail_out);
       if (ret != LZMA_OK && ret != LZMA_STREAM_END)
 	return -1;
       used -= f->strm.lz.avail_in;
@@ -751,6 +1296,28 @@ cwopen_xz(struct cfile *f)
     f->level = 3;
 
   f->strm.lz = tmp;
+  if (f->mt)
+    {
+      lzma_mt mt;
+      uint64_t physmem, limit;
+
+      memset(&mt, 0, sizeof(mt));
+      mt.threads = cfile_mtthreads();
+      mt.block_size = (uint64_t)f->mtblock << 20;
+      mt.preset = f->level;
+      mt.check = LZMA_CHECK_SHA256;
+      /* -9 needs more than 1G per thread, stay below half of the memory */
+      physmem = (uint64_t)sysconf(_SC_PHYS_PAGES) * sysconf(_SC_PAGESIZE);
+      limit = physmem / 2;
+      while (mt.threads > 1 && lzma_stream_encoder_mt_memusage(&mt) > limit)
+	mt.threads--;
+      if (lzma_stream_encoder_mt(&f->strm.lz, &mt) != LZMA_OK)
+	{
+	  free(f);
+	  return 0;
+	}
+      return f;
+    }
   if (lzma_easy_encoder(&f->strm.lz, f->level, LZMA_CHECK_SHA256) != LZMA_OK)
     {
       free(f);
@@ -767,12 +1334,14 @@ cwclose_lz(struct cfile *f)
   f->strm.lz.next_in = 0;
   for (;;)
     {
-      f->strm.lz.avail_out = sizeof(f->buf);
+      f->strm.lz.avail_out = f->bufsize;
       f->strm.lz.next_out = (unsigned char *)f->buf;
+      CODEC_START(f);
       ret = lzma_code(&f->strm.lz, LZMA_FINISH);
+      CODEC_END(f, 0);
       if (ret != LZMA_OK && ret != LZMA_STREAM_END)
         return -1;
-      n = sizeof(f->buf) - f->strm.lz.avail_out;
+      n = f->bufsize - f->strm.lz.avail_out;
       if (n > 0)
         if (cfile_writebuf(f, f->buf, n) != n)
           return -1;
@@ -798,12 +1367,15 @@ cwwrite_lz(struct cfile *f, void *buf, int len)
   f->strm.lz.next_in = buf;
   for (;;)
     {
-      f->strm.lz.avail_out = sizeof(f->buf);
+      f->strm.lz.avail_out = f->bufsize;
       f->strm.lz.next_out = (unsigned char *)f->buf;
+      n = f->strm.lz.avail_in;
+      CODEC_START(f);
       ret = lzma_code(&f->strm.lz, LZMA_RUN);
+      CODEC_END(f, n - f->strm.lz.avail_in);
       if (ret != LZMA_OK)
 	return -1;
-      n = sizeof(f->buf) - f->strm.lz.avail_out;
+      n = f->bufsize - f->strm.lz.avail_out;
       if (n > 0)
 	if (cfile_writebuf(f, f->buf, n) != n)
 	  return -1;
@@ -818,6 +1390,205 @@ crunread_lz(struct cfile *f, void *buf, int len)
   return cfile_unreadbuf(f, buf, len, 0);
 }
 
+#ifdef WITH_ZSTD
+
+/*****************************************************************
+ *  zstd io
+ */
+
+static struct cfile *
+cropen_zstd(struct cfile *f)
+{
+  if ((f->strm.zstd.ds = ZSTD_createDStream()) == 0)
+    {
+      free(f);
+      return 0;
+    }
+  if (ZSTD_isError(ZSTD_initDStream(f->strm.zstd.ds)))
+    {
+      ZSTD_freeDStream(f->strm.zstd.ds);
+      free(f);
+      return 0;
+    }
+  f->eof = 0;
+  f->strm.zstd.in.src = f->buf;
+  f->strm.zstd.in.size = f->bufN == -1 ? 0 : f->bufN;
+  f->strm.zstd.in.pos = 0;
+  return f;
+}
+
+static int
+crread_zstd(struct cfile *f, void *buf, int len)
+{
+  ZSTD_outBuffer out;
+  size_t ret, used, n;
+
+  if (f->eof)
+    return 0;
+  out.dst = buf;
+  out.size = len;
+  out.pos = 0;
+  for (;;)
+    {
+      if (f->strm.zstd.in.pos == f->strm.zstd.in.size && f->bufN)
+	{
+	  unsigned char *p = cfile_readin(f);
+	  if (!p)
+	    return -1;
+	  f->strm.zstd.in.src = p;
+	  f->strm.zstd.in.size = f->bufN;
+	  f->strm.zstd.in.pos = 0;
+	}
+      used = f->strm.zstd.in.pos;
+      n = out.pos;
+      CODEC_START(f);
+      ret = ZSTD_decompressStream(f->strm.zstd.ds, &out, &f->strm.zstd.in);
+      CODEC_END(f, out.pos - n);
+      if (ZSTD_isError(ret))
+	return -1;
+      used = f->strm.zstd.in.pos - used;
+      if (used && f->ctxup)
+	f->ctxup(f->ctx, (unsigned char *)f->strm.zstd.in.src + f->strm.zstd.in.pos - used, used);
+      f->bytes += used;
+      if (ret == 0)
+	{
+	  /* end of frame */
+	  f->eof = 1;
+	  return out.pos;
+	}
+      if (out.pos == out.size)
+	return len;
+      if (f->bufN == 0 && f->strm.zstd.in.pos == f->strm.zstd.in.size)
+	return -1;
+    }
+}
+
+static int
+crclose_zstd(struct cfile *f)
+{
+  int r;
+  size_t left;
+
+  ZSTD_freeDStream(f->strm.zstd.ds);
+  left = f->strm.zstd.in.size - f->strm.zstd.in.pos;
+  if (f->fd == CFILE_IO_CFILE && left)
+    {
+      struct cfile *cf = (struct cfile *)f->fp;
+      if (cf->unread(cf, (unsigned char *)f->strm.zstd.in.src + f->strm.zstd.in.pos, left) != -1)
+	left = 0;
+    }
+  r = (f->len != CFILE_LEN_UNLIMITED ? f->len : 0) + left;
+  if (f->unreadbuf != f->buf)
+    free(f->unreadbuf);
+  free(f);
+  return r;
+}
+
+static struct cfile *
+cwopen_zstd(struct cfile *f)
+{
+  if (!f->level)
+    f->level = 3;
+  if ((f->strm.zstd.cs = ZSTD_createCCtx()) == 0)
+    {
+      free(f);
+      return 0;
+    }
+  if (ZSTD_isError(ZSTD_CCtx_setParameter(f->strm.zstd.cs, ZSTD_c_compressionLevel, f->level)))
+    {
+      ZSTD_freeCCtx(f->strm.zstd.cs);
+      free(f);
+      return 0;
+    }
+  if (f->mt)
+    {
+      if (ZSTD_isError(ZSTD_CCtx_setParameter(f->strm.zstd.cs, ZSTD_c_nbWorkers, cfile_mtthreads())))
+	{
+	  ZSTD_freeCCtx(f->strm.zstd.cs);
+	  free(f);
+	  return 0;
+	}
+    }
+  return f;
+}
+
+static int
+cwwrite_zstd(struct cfile *f, void *buf, int len)
+{
+  ZSTD_inBuffer in;
+  ZSTD_outBuffer out;
+  size_t ret;
+  int n;
+
+  if (len <= 0)
+    return len < 0 ? -1 : 0;
+  in.src = buf;
+  in.size = len;
+  in.pos = 0;
+  for (;;)
+    {
+      out.dst = f->buf;
+      out.size = f->bufsize;
+      out.pos = 0;
+      n = in.pos;
+      CODEC_START(f);
+      ret = ZSTD_compressStream2(f->strm.zstd.cs, &out, &in, ZSTD_e_continue);
+      CODEC_END(f, in.pos - n);
+      if (ZSTD_isError(ret))
+	return -1;
+      n = out.pos;
+      if (n > 0)
+	if (cfile_writebuf(f, f->buf, n) != n)
+	  return -1;
+      if (in.pos == in.size)
+	return len;
+    }
+}
+
+static int
+cwclose_zstd(struct cfile *f)
+{
+  ZSTD_inBuffer in;
+  ZSTD_outBuffer out;
+  size_t ret;
+  int bytes, n;
+
+  in.src = 0;
+  in.size = 0;
+  in.pos = 0;
+  for (;;)
+    {
+      out.dst = f->buf;
+      out.size = f->bufsize;
+      out.pos = 0;
+      CODEC_START(f);
+      ret = ZSTD_compressStream2(f->strm.zstd.cs, &out, &in, ZSTD_e_end);
+      CODEC_END(f, 0);
+      if (ZSTD_isError(ret))
+	return -1;
+      n = out.pos;
+      if (n > 0)
+	if (cfile_writebuf(f, f->buf, n) != n)
+	  return -1;
+      if (ret == 0)
+	break;
+    }
+  ZSTD_freeCCtx(f->strm.zstd.cs);
+  if (f->fd == CFILE_IO_ALLOC)
+    cwclose_fixupalloc(f);
+  bytes = f->bytes;
+  free(f);
+  return bytes;
+}
+
+static int
+crunread_zstd(struct cfile *f, void *buf, int len)
+{
+  return cfile_unreadbuf(f, buf, len, 0);
+}
+
+#endif /* WITH_ZSTD */
+
 /*****************************************************************
  *  uncompressed io
  */
@@ -832,6 +1603,8 @@ crread_un(struct cfile *f, void *buf, int len)
   if (f->ctxup && r)
     f->ctxup(f->ctx, buf, r);
   f->bytes += r;
+  if (f->stats)
+    STAT_ADD(f, bytes, r);
   return r;
 }
 
@@ -862,7 +1635,10 @@ cropen_un(struct cfile *f)
 static int
 cwwrite_un(struct cfile *f, void *buf, int len)
 {
-  return cfile_writebuf(f, buf, len);
+  int r = cfile_writebuf(f, buf, len);
+  if (f->stats && r > 0)
+    STAT_ADD(f, bytes, r);
+  return r;
 }
 
 static int
@@ -888,188 +1664,179 @@ crunread_un(struct cfile *f, void *buf, int len)
 }
 
 
+/* Find out if a gzip stream was compressed with the rsync friendly
+ * zlib by compressing the data again and comparing the result with
+ * the stream. The rsync friendly zlib only differs at the positions
+ * where the sum of the last RSYNC_WIN bytes is a multiple of
+ * RSYNC_WIN, it ends the block there. So we compress with it and
+ * stop at the first difference (the stream is COMP_GZ) or after the
+ * ended block matched (it is COMP_GZ_RSYNC). Without such positions
+ * both are the same and we stay with COMP_GZ. Data that is
+ * completely in memory is compared in place, otherwise the read
+ * data is pushed back. */
+
+#define DETECT_READSIZE 65536
+#define DETECT_RSYNC_WIN 4096		/* RSYNC_WIN of the rsync friendly zlib */
+#define DETECT_LOOKAHEAD (258 + 3 + 1)	/* MIN_LOOKAHEAD of deflate */
+
 int
 cfile_detect_rsync(struct cfile *f)
 {
-  unsigned char *b, *b2;
-  int i, len, l, eof, p[2];
+  unsigned char *b = 0, *b2, *ref;
+  size_t reflen, n, p, dpos, trigger;
+  unsigned long sum;
+  int i, l, inplace, eof, done, bad, ret, dret;
   int comp = CFILE_COMP_GZ;
-  z_stream dstrm, cstrm[2];
-  int done, ret, dret;
-  unsigned char dbuf[4096], cbuf[4096];
+  z_stream dstrm, cstrm;
+  unsigned char dbuf[4096], cbuf[4096], win[DETECT_RSYNC_WIN];
 
   if (f->comp != CFILE_COMP_GZ)
     return 0;
-  b = malloc(4096 + f->strm.gz.avail_in);
-  if (!b)
-    return -1;
-  len = 0;
-
-  p[0] = p[1] = 0;
-
   dstrm.zalloc = 0;
   dstrm.zfree = 0;
   dstrm.opaque = 0;
   if (inflateInit2(&dstrm, -MAX_WBITS) != Z_OK)
+    return -1;
+  cstrm.zalloc = 0;
+  cstrm.zfree = 0;
+  cstrm.opaque = 0;
+#ifdef Z_RSYNCABLE
+  ret = deflateInit2(&cstrm, Z_BEST_COMPRESSION, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY | Z_RSYNCABLE);
+#else
+  /* Rsync friendly zlib not available, compress with the normal one
+   * and assume COMP_GZ_RSYNC if it does not match. */
+  ret = deflateInit2(&cstrm, Z_BEST_COMPRESSION, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY);
+#endif
+  if (ret != Z_OK)
     {
-      free(b);
+      inflateEnd(&dstrm);
       return -1;
     }
-  for (i = 0; i < 2; i++)
+
+  inplace = (f->fd == CFILE_IO_BUFFER || f->fd == CFILE_IO_MMAP) && f->len != CFILE_LEN_UNLIMITED;
+  if (inplace)
+    {
+      /* the already read part is also still in front of fp */
+      ref = (unsigned char *)f->fp - f->strm.gz.avail_in;
+      reflen = f->strm.gz.avail_in + f->len;
+    }
+  else
+    {
+      if ((b = malloc(f->strm.gz.avail_in + DETECT_READSIZE)) == 0)
+	comp = -1;
+      else if (f->strm.gz.avail_in)
+	memcpy(b, f->strm.gz.next_in, f->strm.gz.avail_in);
+      ref = b;
+      reflen = f->strm.gz.avail_in;
+    }
+  dstrm.next_in = ref;
+  dstrm.avail_in = inplace ? 0 : reflen;
+  p = dpos = 0;
+  sum = 0;
+  trigger = (size_t)-1;
+  eof = 0;
+  done = comp == -1;
+  while (!done)
     {
-#ifndef Z_RSYNCABLE
-      /* Rsync friendly zlib not available, don't set up a compressor for it
-       * */
-      if (i)
+      if (dstrm.avail_in == 0 && inplace)
 	{
-	  break;
+	  /* avail_in is just an uInt */
+	  n = dstrm.next_in - ref;
+	  if (n == reflen)
+	    break;
+	  dstrm.avail_in = reflen - n > 0x40000000 ? 0x40000000 : reflen - n;
 	}
-#endif
-      cstrm[i].zalloc = 0;
-      cstrm[i].zfree = 0;
-      cstrm[i].opaque = 0;
-#ifdef Z_RSYNCABLE
-      if (deflateInit2(&cstrm[i], Z_BEST_COMPRESSION, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY | (i == 1 ? Z_RSYNCABLE : 0)) != Z_OK)
-#else
-      if (deflateInit2(&cstrm[i], Z_BEST_COMPRESSION, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK)
-#endif
+      else if (dstrm.avail_in == 0)
 	{
-	  if (i)
-	    deflateEnd(&cstrm[0]);
-	  inflateEnd(&dstrm);
-	  free(b);
-          return -1;
+	  if (eof)
+	    break;
+	  if ((b2 = realloc(b, reflen + DETECT_READSIZE)) == 0)
+	    {
+	      comp = -1;
+	      break;
+	    }
+	  ref = b = b2;
+	  l = cfile_readbuf(f, b + reflen, DETECT_READSIZE);
+	  if (l < DETECT_READSIZE)
+	    eof = 1;
+	  if (l <= 0)
+	    break;
+	  dstrm.next_in = b + reflen;
+	  dstrm.avail_in = l;
+	  reflen += l;
 	}
-    }
-
-  done = eof = 0;
-  dstrm.avail_in = f->strm.gz.avail_in;
-  if (f->strm.gz.avail_in)
-    memcpy(b, f->strm.gz.next_in, f->strm.gz.avail_in);
-  for (;;)
-    {
-      if (dstrm.avail_in == 0)
+      dstrm.next_out = dbuf;
+      dstrm.avail_out = sizeof(dbuf);
+      dret = inflate(&dstrm, Z_NO_FLUSH);
+      if (dret != Z_OK && dret != Z_STREAM_END)
+	break;
+      if (dret == Z_STREAM_END)
+	done = 1;
+      else if (dstrm.avail_out == sizeof(dbuf))
+	continue;
+      /* look for the first position where the block gets ended */
+      for (i = 0; trigger == (size_t)-1 && i < sizeof(dbuf) - dstrm.avail_out; i++, dpos++)
 	{
-          l = cfile_readbuf(f, b + len, 4096);
-	  if (l < 4096)
-	    eof = 1;
+	  sum += dbuf[i];
+	  if (dpos >= DETECT_RSYNC_WIN)
+	    {
+	      sum -= win[dpos % DETECT_RSYNC_WIN];
+	      if (sum % DETECT_RSYNC_WIN == 0)
+		trigger = dpos;
+	    }
+	  win[dpos % DETECT_RSYNC_WIN] = dbuf[i];
 	}
-      else
-	l = dstrm.avail_in;
-      if (l >= 0)
+      dpos += sizeof(dbuf) - dstrm.avail_out - i;
+      cstrm.next_in = dbuf;
+      cstrm.avail_in = sizeof(dbuf) - dstrm.avail_out;
+      bad = 0;
+      do
 	{
-	  dstrm.avail_in = l;
-	  dstrm.next_in = b + len;
-	  while (dstrm.avail_in && !done)
+	  cstrm.next_out = cbuf;
+	  cstrm.avail_out = sizeof(cbuf);
+	  ret = deflate(&cstrm, done ? Z_FINISH : Z_NO_FLUSH);
+	  n = sizeof(cbuf) - cstrm.avail_out;
+	  if ((ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR) || p + n > reflen || memcmp(ref + p, cbuf, n))
 	    {
-	      dstrm.avail_out = sizeof(dbuf);
-	      dstrm.next_out = dbuf;
-	      dret = inflate(&dstrm, Z_NO_FLUSH);
-	      if (dret != Z_OK && dret != Z_STREAM_END)
-		{
-		  done = 1;
-		  break;
-		}
-	      if (dstrm.avail_out != sizeof(dbuf))
-		{
-		  for (i = 0; i < 2 && !done; i++)
-		    {
-#ifndef Z_RSYNCABLE
-		      /* No rsync friendly zlib so we can only test against
-		       * COMP_GZ.  This is suboptimal as it's only when we
-		       * run into an error that we can cut to the end.  So
-		       * we're forced to uncompress and recompress the whole
-		       * output.  Need to determine if we can determine that
-		       * we used the other algorithm is being used after
-		       * decompressing a certain amount of blocks.  Perhaps
-		       * after RSYNC_WIN or MAX_DIST blocks have been
-		       * decompressed we can know whether COMP_GZ_RSYNC was
-		       * used?
-		       */
-		      if (i)
-			{
-			    break;
-			}
-#endif
-		      cstrm[i].avail_in = sizeof(dbuf) - dstrm.avail_out;
-		      cstrm[i].next_in = dbuf;
-		      while (cstrm[i].avail_in)
-			{
-			  cstrm[i].avail_out = sizeof(cbuf);
-			  cstrm[i].next_out = cbuf;
-			  ret = deflate(&cstrm[i], dret == Z_STREAM_END ? Z_FINISH : Z_NO_FLUSH);
-			  /* Any errors in compressing, set to the other
-			   * compression algorithm
-			   */
-			  if (ret != Z_OK && ret != Z_STREAM_END)
-			    {
-			      comp = i ? CFILE_COMP_GZ: CFILE_COMP_GZ_RSYNC;
-			      done = 1;
-			      break;
-			    }
-			  /* if compression yielded something
-			   */
-			  if (cstrm[i].avail_out != sizeof(cbuf))
-			    {
-			      /* If the newly compressed block is not equal to
-			       * the original compressed payload, set to the
-			       * opposite compression algorithm
-			       */
-			      if (memcmp(b + p[i], cbuf, sizeof(cbuf) - cstrm[i].avail_out))
-				{
-				  comp = i ? CFILE_COMP_GZ: CFILE_COMP_GZ_RSYNC;
-				  done = 1;
-				  break;
-				}
-			      p[i] += sizeof(cbuf) - cstrm[i].avail_out;
-			    }
-			  /* If the input stream is not empty but the
-			   * compressor says that the stream is empty we have
-			   * an error.  Set to the opposite compression
-			   * algorithm.
-			   *
-			   * Note -- This code looks wrong:
-			   * Should be Z_STREAM_END, not BZ_STREAM_END
-			   */
-			  if (cstrm[i].avail_in && ret == BZ_STREAM_END)
-			    {
-			      comp = i ? CFILE_COMP_GZ: CFILE_COMP_GZ_RSYNC;
-			      break;
-			    }
-			}
-		    }
-		}
-	      if (dret == Z_STREAM_END)
-		done = 1;
+	      bad = 1;
+	      break;
 	    }
-	  len += l;
+	  p += n;
 	}
-      if (done || eof)
+      while (cstrm.avail_in || cstrm.avail_out == 0 || (done && ret != Z_STREAM_END));
+#ifdef Z_RSYNCABLE
+      if (bad)
 	break;
-      b2 = realloc(b, len + 4096);
-      if (!b2)
+      /* deflate has written the ended block once it is past the
+       * trigger position plus its lookahead */
+      if (trigger != (size_t)-1 && (done || dpos > trigger + DETECT_LOOKAHEAD))
 	{
-	  comp = -1;
+	  comp = CFILE_COMP_GZ_RSYNC;
+	  break;
+	}
+#else
+      if (bad)
+	{
+	  comp = CFILE_COMP_GZ_RSYNC;
 	  break;
 	}
-      b = b2;
-    }
-  deflateEnd(&cstrm[0]);
-#ifdef Z_RSYNCABLE
-  deflateEnd(&cstrm[1]);
 #endif
+    }
+  deflateEnd(&cstrm);
   inflateEnd(&dstrm);
-  f->bufN = -1;
-  f->strm.gz.avail_in = 0;
   if (comp != -1)
     f->comp = comp;
-  if (len)
+  if (inplace)
+    return comp == -1 ? -1 : 0;
+  f->bufN = -1;
+  f->strm.gz.avail_in = 0;
+  if (reflen)
     {
       struct cfile *cf;
       if (f->fd == CFILE_IO_CFILE || f->fd == CFILE_IO_PUSHBACK)
 	{
 	  cf = (struct cfile *)f->fp;
-	  if (!cf->unread(cf, b, len))
+	  if (cf->unread(cf, b, reflen) == -1)
 	    {
 	      free(b);
 	      return -1;
@@ -1084,33 +1851,149 @@ cfile_detect_rsync(struct cfile *f)
 	      free(b);
 	      return -1;
 	    }
+	  cf->stats = 0;
 	  f->fp = cf;
 	  f->fd = CFILE_IO_PUSHBACK;
 	  cf->unreadbuf = b;
-	  cf->nunread = len;
+	  cf->nunread = reflen;
 	  cf->oldread = cf->read;
 	  cf->read = crread_ur;
 	}
       if (f->len != CFILE_LEN_UNLIMITED)
-	f->len += len;
+	f->len += reflen;
+      /* it gets read again */
+      if (f->stats)
+	STAT_ADD(f, rawbytes, -(unsigned long long)reflen);
     }
   else
     free(b);
   return comp == -1 ? -1 : 0;
 }
 
+/*****************************************************************
+ *  mmap input
+ */
+
+struct cfile_map {
+  unsigned char *base;
+  size_t maplen;
+  unsigned char *start;		/* data at the fd offset */
+  int fd;
+  off_t off;
+  int unlimited;
+  int (*close)(struct cfile *f);
+};
+
+/* map the rest of the file, falls back to reading the fd if that
+ * is not possible */
+static void
+cfile_mmap(struct cfile *f)
+{
+  struct cfile_map *map;
+  struct stat st;
+  off_t off, pgoff;
+  size_t len;
+  int fd = *(int *)f->fp;
+
+  f->fd = fd;
+  f->fp = 0;
+  if (fstat(fd, &st) || !S_ISREG(st.st_mode))
+    return;
+  off = lseek(fd, 0, SEEK_CUR);
+  if (off == (off_t)-1 || off >= st.st_size)
+    return;
+  len = st.st_size - off;
+  if (f->len != CFILE_LEN_UNLIMITED && f->len < len)
+    len = f->len;
+  if ((map = calloc(1, sizeof(*map))) == 0)
+    return;
+  pgoff = off & ~((off_t)sysconf(_SC_PAGESIZE) - 1);
+  map->maplen = len + (off - pgoff);
+  map->base = mmap(0, map->maplen, PROT_READ, MAP_PRIVATE, fd, pgoff);
+  if (map->base == MAP_FAILED)
+    {
+      free(map);
+      return;
+    }
+  madvise(map->base, map->maplen, MADV_SEQUENTIAL);
+  map->start = map->base + (off - pgoff);
+  map->fd = fd;
+  map->off = off;
+  map->unlimited = f->len == CFILE_LEN_UNLIMITED;
+  f->fd = CFILE_IO_MMAP;
+  f->fp = map->start;
+  f->len = len;
+  f->map = map;
+}
+
+static int
+crclose_mmap(struct cfile *f)
+{
+  struct cfile_map *map = f->map;
+  size_t used = (unsigned char *)f->fp - map->start;
+  size_t lenleft = f->len;
+  int r;
+
+  r = map->close(f);
+  if (r != -1)
+    {
+      /* r also counts the mapped bytes the decompressor did not use */
+      used -= r - lenleft;
+      lseek(map->fd, map->off + used, SEEK_SET);
+      if (map->unlimited)
+	r -= lenleft;
+    }
+  munmap(map->base, map->maplen);
+  free(map);
+  return r;
+}
+
+
 /*****************************************************************
  *  our open function
  */
 
+/* The multi threaded xz encoder stores both sizes in the block
+ * headers, the single threaded one doesn't. The block size is the
+ * uncompressed size of the first block. Returns it in bytes or 0 */
+static unsigned long long
+detect_xzmt(unsigned char *p, int l)
+{
+  unsigned long long v = 0;
+  int i, j, shift;
+
+  if (l < 2 || p[0] == 0 || (p[1] & 0xc0) != 0xc0)
+    return 0;
+  if (l > (p[0] + 1) * 4)
+    l = (p[0] + 1) * 4;
+  for (i = 2, j = 0; j < 2; j++)
+    {
+      /* compressed size, then uncompressed size */
+      v = 0;
+      for (shift = 0; ; shift += 7)
+	{
+	  if (i >= l || shift > 56)
+	    return 0;
+	  v |= (unsigned long long)(p[i] & 0x7f) << shift;
+	  if (!(p[i++] & 0x80))
+	    break;
+	}
+    }
+  return v > 0 && (v + 0xfffff) >> 20 <= 0x3fff ? v : 0;
+}
+
 struct cfile *
 cfile_open(int mode, int fd, void *fp, int comp, size_t len, void (*ctxup)(void *, unsigned char *, unsigned int), void *ctx)
 {
   struct cfile *f;
+  struct cfile_map *map;
+  struct cfile_stats dstats;
   if (comp == CFILE_COMP_XX && mode == CFILE_OPEN_WR)
     return 0;
   if (mode != CFILE_OPEN_RD && mode != CFILE_OPEN_WR)
     return 0;
+  if (fd == CFILE_IO_MMAP && mode != CFILE_OPEN_RD)
+    return 0;
   if (fd == CFILE_IO_REOPEN)
     {
       f = fp;
@@ -1118,7 +2001,14 @@ cfile_open(int mode, int fd, void *fp, int comp, size_t len, void (*ctxup)(void
       fp = f->fp;
     }
   else
-    f = malloc(sizeof(*f));
+    {
+      f = malloc(sizeof(*f) + cfile_bufsize);
+      if (f)
+	{
+	  f->buf = (unsigned char *)(f + 1);
+	  f->bufsize = cfile_bufsize;
+	}
+    }
   if (!f)
     return 0;
   f->fd = fd;
@@ -1131,6 +2021,17 @@ cfile_open(int mode, int fd, void *fp, int comp, size_t len, void (*ctxup)(void
   f->nunread = 0;
   f->unreadbuf = 0;
   f->oldread = 0;
+  f->borrowbuf = 0;
+  f->nborrow = 0;
+  f->map = 0;
+  f->membuf = 0;
+  f->xzblock = 0;
+  /* collect into dstats until we know the compression */
+  memset(&dstats, 0, sizeof(dstats));
+  f->stats = cfile_statsp ? &dstats : 0;
+  if (fd == CFILE_IO_MMAP)
+    cfile_mmap(f);
+  map = f->map;
   if (mode == CFILE_OPEN_WR && fd == CFILE_IO_ALLOC)
     {
       unsigned char **bp = (unsigned char **)f->fp;
@@ -1141,7 +2042,7 @@ cfile_open(int mode, int fd, void *fp, int comp, size_t len, void (*ctxup)(void
       comp = CFILE_COMP_UN;
       if (len == CFILE_LEN_UNLIMITED || len >= 2)
 	{
-	  int n = cfile_readbuf(f, f->buf, sizeof(f->buf));
+	  int n = cfile_readbuf(f, f->buf, f->bufsize);
 	  if (n == -1)
 	    {
 	      free(f);
@@ -1156,11 +2057,26 @@ cfile_open(int mode, int fd, void *fp, int comp, size_t len, void (*ctxup)(void
 	  else if (f->buf[0] == 0135 && f->buf[1] == 0 && f->buf[2] == 0)
 	    comp = CFILE_COMP_LZMA;
 	  else if (f->buf[0] == 0xfd && f->buf[1] == '7' && f->buf[2] == 'z' && f->buf[3] == 'X' && f->buf[4] == 'Z')
-	    comp = CFILE_COMP_XZ;
+	    {
+	      f->xzblock = n > 12 ? detect_xzmt(f->buf + 12, n - 12) : 0;
+	      /* rounding up does not matter for a single block stream */
+	      comp = f->xzblock ? CFILE_MKMTBLOCK(CFILE_COMP_XZ, (int)((f->xzblock + 0xfffff) >> 20)) : CFILE_COMP_XZ;
+	    }
+	  else if (f->buf[0] == 0x28 && f->buf[1] == 0xb5 && f->buf[2] == 0x2f && f->buf[3] == 0xfd)
+	    comp = CFILE_COMP_ZSTD;
 	}
     }
   f->comp = CFILE_COMPALGO(comp);
   f->level = CFILE_COMPLEVEL(comp);
+  f->mt = (comp & CFILE_COMP_MT) != 0;
+  f->mtblock = CFILE_MTBLOCK(comp);
+  if (f->stats)
+    {
+      f->stats = cfile_statsp + CFILE_STATS_IDX(mode, f->comp);
+      STAT_ADD(f, rawbytes, dstats.rawbytes);
+      STAT_ADD(f, iocalls, dstats.iocalls);
+      STAT_ADD(f, iousecs, dstats.iousecs);
+    }
   switch (f->comp)
     {
     case CFILE_COMP_UN:
@@ -1168,7 +2084,8 @@ cfile_open(int mode, int fd, void *fp, int comp, size_t len, void (*ctxup)(void
       f->unread = mode == CFILE_OPEN_RD ? crunread_un : 0;
       f->write  = mode == CFILE_OPEN_WR ? cwwrite_un : 0;
       f->close  = mode == CFILE_OPEN_RD ? crclose_un : cwclose_un;
-      return mode == CFILE_OPEN_RD ? cropen_un(f) : cwopen_un(f);
+      f = mode == CFILE_OPEN_RD ? cropen_un(f) : cwopen_un(f);
+      break;
     case CFILE_COMP_GZ:
     case CFILE_COMP_GZ_RSYNC:
       f->strm.gz.zalloc = 0;
@@ -1178,7 +2095,8 @@ cfile_open(int mode, int fd, void *fp, int comp, size_t len, void (*ctxup)(void
       f->unread = mode == CFILE_OPEN_RD ? crunread_gz : 0;
       f->write  = mode == CFILE_OPEN_WR ? cwwrite_gz : 0;
       f->close  = mode == CFILE_OPEN_RD ? crclose_gz : cwclose_gz;
-      return mode == CFILE_OPEN_RD ? cropen_gz(f) : cwopen_gz(f);
+      f = mode == CFILE_OPEN_RD ? cropen_gz(f) : cwopen_gz(f);
+      break;
     case CFILE_COMP_BZ:
       f->strm.bz.bzalloc = 0;
       f->strm.bz.bzfree = 0;
@@ -1187,7 +2105,8 @@ cfile_open(int mode, int fd, void *fp, int comp, size_t len, void (*ctxup)(void
       f->unread = mode == CFILE_OPEN_RD ? crunread_bz : 0;
       f->write  = mode == CFILE_OPEN_WR ? cwwrite_bz : 0;
       f->close  = mode == CFILE_OPEN_RD ? crclose_bz : cwclose_bz;
-      return mode == CFILE_OPEN_RD ? cropen_bz(f) : cwopen_bz(f);
+      f = mode == CFILE_OPEN_RD ? cropen_bz(f) : cwopen_bz(f);
+      break;
     case CFILE_COMP_LZMA:
       f->strm.lz.allocator = 0;
       f->strm.lz.internal = 0;
@@ -1195,7 +2114,8 @@ cfile_open(int mode, int fd, void *fp, int comp, size_t len, void (*ctxup)(void
       f->unread = mode == CFILE_OPEN_RD ? crunread_lz : 0;
       f->write  = mode == CFILE_OPEN_WR ? cwwrite_lz : 0;
       f->close  = mode == CFILE_OPEN_RD ? crclose_lz : cwclose_lz;
-      return mode == CFILE_OPEN_RD ? cropen_lz(f) : cwopen_lz(f);
+      f = mode == CFILE_OPEN_RD ? cropen_lz(f) : cwopen_lz(f);
+      break;
     case CFILE_COMP_XZ:
       f->strm.lz.allocator = 0;
       f->strm.lz.internal = 0;
@@ -1203,13 +2123,141 @@ cfile_open(int mode, int fd, void *fp, int comp, size_t len, void (*ctxup)(void
       f->unread = mode == CFILE_OPEN_RD ? crunread_lz : 0;
       f->write  = mode == CFILE_OPEN_WR ? cwwrite_lz : 0;
       f->close  = mode == CFILE_OPEN_RD ? crclose_lz : cwclose_lz;
-      return mode == CFILE_OPEN_RD ? cropen_lz(f) : cwopen_xz(f);
+      f = mode == CFILE_OPEN_RD ? cropen_lz(f) : cwopen_xz(f);
+      break;
+#ifdef WITH_ZSTD
+    case CFILE_COMP_ZSTD:
+      f->read   = mode == CFILE_OPEN_RD ? crread_zstd : 0;
+      f->unread = mode == CFILE_OPEN_RD ? crunread_zstd : 0;
+      f->write  = mode == CFILE_OPEN_WR ? cwwrite_zstd : 0;
+      f->close  = mode == CFILE_OPEN_RD ? crclose_zstd : cwclose_zstd;
+      f = mode == CFILE_OPEN_RD ? cropen_zstd(f) : cwopen_zstd(f);
+      break;
+#endif
     default:
       free(f);
-      return 0;
+      f = 0;
+      break;
+    }
+  if (map)
+    {
+      if (!f)
+	{
+	  munmap(map->base, map->maplen);
+	  free(map);
+	}
+      else
+	{
+	  map->close = f->close;
+	  f->close = crclose_mmap;
+	}
     }
+  return f;
 }
 
+/*****************************************************************
+ *  borrow data from a cfile
+ *
+ *  cfile_borrow returns a pointer to up to len bytes of the read data
+ *  instead of copying it to a caller supplied buffer. The data is
+ *  decompressed bufsize bytes at a time, for uncompressed memory
+ *  buffers the pointer points right into the buffer. The pointer is
+ *  valid until the next read, borrow or close. Reads can be mixed with
+ *  borrows, they first return the rest of the borrow buffer.
+ */
+
+static int
+crread_borrow(struct cfile *f, void *buf, int len)
+{
+  int l2;
+
+  l2 = len > f->nborrow ? f->nborrow : len;
+  memcpy(buf, f->borrowbuf + f->borrowoff, l2);
+  f->borrowoff += l2;
+  f->nborrow -= l2;
+  if (!f->nborrow)
+    f->read = f->borrowread;
+  if (l2 == len)
+    return l2;
+  len = f->read(f, buf + l2, len - l2);
+  return len == -1 ? -1 : l2 + len;
+}
+
+static int
+crclose_borrow(struct cfile *f)
+{
+  free(f->borrowbuf);
+  f->borrowbuf = 0;
+  f->close = f->borrowclose;
+  return f->close(f);
+}
+
+int
+cfile_borrow(struct cfile *f, unsigned char **bp, int len)
+{
+  int l;
+
+  if (len <= 0)
+    return len < 0 ? -1 : 0;
+  if (f->nborrow)
+    {
+      if (len > f->nborrow)
+	len = f->nborrow;
+      *bp = f->borrowbuf + f->borrowoff;
+      f->borrowoff += len;
+      f->nborrow -= len;
+      if (!f->nborrow)
+	f->read = f->borrowread;
+      return len;
+    }
+  if (f->read == crread_un && (f->fd == CFILE_IO_BUFFER || f->fd == CFILE_IO_MMAP))
+    {
+      /* no need to copy anything */
+      if (f->len != CFILE_LEN_UNLIMITED && len > f->len)
+	len = f->len;
+      *bp = f->fp;
+      f->fp += len;
+      if (f->len != CFILE_LEN_UNLIMITED)
+	f->len -= len;
+      if (len && f->ctxup)
+	f->ctxup(f->ctx, *bp, len);
+      f->bytes += len;
+      return len;
+    }
+#ifdef WITH_LIBDEFLATE
+  if (f->read == crread_gzmem)
+    {
+      if (len > f->memlen - f->memoff)
+	len = f->memlen - f->memoff;
+      *bp = f->membuf + f->memoff;
+      f->memoff += len;
+      return len;
+    }
+#endif
+  if (!f->borrowbuf)
+    {
+      if ((f->borrowbuf = malloc(f->bufsize)) == 0)
+	return -1;
+      f->borrowclose = f->close;
+      f->close = crclose_borrow;
+    }
+  l = f->read(f, f->borrowbuf, f->bufsize);
+  if (l <= 0)
+    return l;
+  if (len > l)
+    len = l;
+  *bp = f->borrowbuf;
+  f->borrowoff = len;
+  f->nborrow = l - len;
+  if (f->nborrow)
+    {
+      f->borrowread = f->read;
+      f->read = crread_borrow;
+    }
+  return len;
+}
+
+
 /*****************************************************************
  *  copy data from one cfile to another
  */
@@ -1217,11 +2265,11 @@ cfile_open(int mode, int fd, void *fp, int comp, size_t len, void (*ctxup)(void
 int
 cfile_copy(struct cfile *in, struct cfile *out, int flags)
 {
-  unsigned char buf[8192];
+  unsigned char *buf;
   int l, r;
   if (!in || !out)
     return -1;
-  while((l = in->read(in, buf, sizeof(buf))) > 0)
+  while((l = cfile_borrow(in, &buf, in->bufsize)) > 0)
     if (out->write(out, buf, l) != l)
       {
 	l = -1;
@@ -1246,9 +2294,188 @@ cfile_copy(struct cfile *in, struct cfile *out, int flags)
   return l;
 }
 
+
+/*****************************************************************
+ *  threaded writing
+ *
+ *  The data written to the cfile is collected in a ring of
+ *  buffers, a worker thread empties them into the target cfile.
+ *  Chaining two of them gives a pipeline of three threads.
+ */
+
+#define WT_NBUF 8
+
+struct cfile_wt {
+  struct cfile *out;
+  pthread_t tid;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;		/* signaled on every change of n and done */
+  unsigned char *bufs[WT_NBUF];
+  int lens[WT_NBUF];
+  int first;			/* oldest queued buffer */
+  int n;			/* number of queued buffers */
+  int cur;			/* buffer being filled, -1 if none */
+  int done;
+  int error;
+};
+
+static void *
+wt_worker(void *arg)
+{
+  struct cfile_wt *wt = arg;
+  int i, r;
+
+  pthread_mutex_lock(&wt->lock);
+  for (;;)
+    {
+      while (!wt->n && !wt->done)
+	pthread_cond_wait(&wt->cond, &wt->lock);
+      if (!wt->n)
+	break;
+      i = wt->first;
+      pthread_mutex_unlock(&wt->lock);
+      r = wt->error ? -1 : wt->out->write(wt->out, wt->bufs[i], wt->lens[i]);
+      pthread_mutex_lock(&wt->lock);
+      if (r != wt->lens[i])
+	wt->error = 1;
+      wt->first = (wt->first + 1) % WT_NBUF;
+      wt->n--;
+      pthread_cond_broadcast(&wt->cond);
+    }
+  pthread_mutex_unlock(&wt->lock);
+  return 0;
+}
+
+static void
+wt_submit(struct cfile *f)
+{
+  struct cfile_wt *wt = f->fp;
+
+  pthread_mutex_lock(&wt->lock);
+  wt->lens[wt->cur] = f->bufN;
+  wt->n++;
+  wt->cur = -1;
+  pthread_cond_broadcast(&wt->cond);
+  pthread_mutex_unlock(&wt->lock);
+}
+
+static int
+cwwrite_wt(struct cfile *f, void *buf, int len)
+{
+  struct cfile_wt *wt = f->fp;
+  unsigned char *p = buf;
+  int l, left = len;
+
+  if (len <= 0)
+    return len < 0 ? -1 : 0;
+  while (left)
+    {
+      if (wt->cur == -1)
+	{
+	  pthread_mutex_lock(&wt->lock);
+	  while (wt->n == WT_NBUF)
+	    pthread_cond_wait(&wt->cond, &wt->lock);
+	  if (wt->error)
+	    {
+	      pthread_mutex_unlock(&wt->lock);
+	      return -1;
+	    }
+	  wt->cur = (wt->first + wt->n) % WT_NBUF;
+	  pthread_mutex_unlock(&wt->lock);
+	  f->bufN = 0;
+	}
+      l = f->bufsize - f->bufN;
+      if (l > left)
+	l = left;
+      memcpy(wt->bufs[wt->cur] + f->bufN, p, l);
+      f->bufN += l;
+      p += l;
+      left -= l;
+      if (f->bufN == f->bufsize)
+	wt_submit(f);
+    }
+  f->bytes += len;
+  return len;
+}
+
+static int
+cwclose_wt(struct cfile *f)
+{
+  struct cfile_wt *wt = f->fp;
+  int i, r;
+
+  if (wt->cur != -1 && f->bufN)
+    wt_submit(f);
+  pthread_mutex_lock(&wt->lock);
+  wt->done = 1;
+  pthread_cond_broadcast(&wt->cond);
+  pthread_mutex_unlock(&wt->lock);
+  pthread_join(wt->tid, 0);
+  r = wt->out->close(wt->out);
+  if (wt->error)
+    r = -1;
+  pthread_mutex_destroy(&wt->lock);
+  pthread_cond_destroy(&wt->cond);
+  for (i = 0; i < WT_NBUF; i++)
+    free(wt->bufs[i]);
+  free(wt);
+  free(f);
+  return r;
+}
+
+struct cfile *
+cfile_writethread(struct cfile *out)
+{
+  struct cfile *f;
+  struct cfile_wt *wt;
+  int i;
+
+  if (!out)
+    return 0;
+  f = calloc(1, sizeof(*f));
+  wt = calloc(1, sizeof(*wt));
+  if (!f || !wt)
+    {
+      free(f);
+      free(wt);
+      return 0;
+    }
+  f->fd = CFILE_IO_CFILE;
+  f->fp = wt;
+  f->comp = out->comp;
+  f->len = CFILE_LEN_UNLIMITED;
+  f->bufsize = cfile_bufsize;
+  f->write = cwwrite_wt;
+  f->close = cwclose_wt;
+  wt->out = out;
+  wt->cur = -1;
+  for (i = 0; i < WT_NBUF; i++)
+    if ((wt->bufs[i] = malloc(f->bufsize)) == 0)
+      break;
+  pthread_mutex_init(&wt->lock, 0);
+  pthread_cond_init(&wt->cond, 0);
+  if (i < WT_NBUF || pthread_create(&wt->tid, 0, wt_worker, wt) != 0)
+    {
+      pthread_mutex_destroy(&wt->lock);
+      pthread_cond_destroy(&wt->cond);
+      while (i > 0)
+	free(wt->bufs[--i]);
+      free(wt);
+      free(f);
+      return 0;
+    }
+  return f;
+}
+
 char *
 cfile_comp2str(int comp)
 {
+  if ((comp & CFILE_COMP_MT) != 0)
+    {
+      static char buf[64];
+      sprintf(buf, "%s mt", cfile_comp2str(comp & ~CFILE_COMP_MT));
+      return buf;
+    }
   if (CFILE_COMPLEVEL(comp))
     {
       static char buf[64];
@@ -1269,10 +2496,48 @@ cfile_comp2str(int comp)
       return "lzma";
     case CFILE_COMP_XZ:
       return "xz";
+    case CFILE_COMP_ZSTD:
+      return "zstd";
     }
   return "???";
 }
 
+int
+cfile_str2comp(char *str)
+{
+  static struct {
+    char *name;
+    int comp;
+  } names[] = {
+    { "bzip2", CFILE_COMP_BZ },
+    { "gzip", CFILE_COMP_GZ },
+    { "gzip rsyncable", CFILE_COMP_GZ_RSYNC },
+    { "lzma", CFILE_COMP_LZMA },
+    { "xz", CFILE_COMP_XZ },
+#ifdef WITH_ZSTD
+    { "zstd", CFILE_COMP_ZSTD },
+#endif
+    { "uncompressed", CFILE_COMP_UN },
+  };
+  int i, n = strlen(str), level = 0;
+
+  /* optional level, e.g. "xz.6" or "zstd.19" */
+  if (n > 2 && str[n - 2] == '.' && str[n - 1] >= '0' && str[n - 1] <= '9')
+    {
+      level = str[n - 1] - '0';
+      n -= 2;
+    }
+  else if (n > 3 && str[n - 3] == '.' && str[n - 2] >= '1' && str[n - 2] <= '9' && str[n - 1] >= '0' && str[n - 1] <= '9')
+    {
+      level = atoi(str + n - 2);
+      n -= 3;
+    }
+  for (i = 0; i < sizeof(names) / sizeof(*names); i++)
+    if (!strncmp(str, names[i].name, n) && names[i].name[n] == 0)
+      return cfile_setlevel(names[i].comp, level);
+  return -1;
+}
+
 int
 cfile_setlevel(int comp, int level)
 {
@@ -1285,6 +2550,9 @@ cfile_setlevel(int comp, int level)
     case CFILE_COMP_BZ:
       deflevel = 9;
       break;
+    case CFILE_COMP_ZSTD:
+      deflevel = 3;
+      break;
     default:
       break;
     }
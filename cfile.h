@@ -5,17 +5,37 @@
  * for further information
  */
 
+#include <stdio.h>
 #include <zlib.h>
 #include <bzlib.h>
 #include <lzma.h>
+#ifdef WITH_ZSTD
+#include <zstd.h>
+#endif
+
+struct cfile_pbz;
+struct cfile_map;
+
+struct cfile_stats {
+  unsigned long long bytes;		/* uncompressed bytes */
+  unsigned long long rawbytes;		/* bytes read from/written to the io */
+  unsigned long long iocalls;		/* reads/writes on a fd or FILE */
+  unsigned long long iousecs;
+  unsigned long long codecusecs;	/* wall time spent (de)compressing */
+  unsigned long long codeccpuusecs;	/* cpu time of the calling thread */
+};
 
 struct cfile {
   int fd;
   void *fp;
   int comp;
   int level;
+  int mt;
+  int mtblock;
+  unsigned long long xzblock;	/* read: first block size of a multi threaded xz stream */
   size_t len;
-  unsigned char buf[4096];
+  unsigned char *buf;
+  int bufsize;
   int bufN;
   int eof;
   void *ctx;
@@ -29,12 +49,32 @@ struct cfile {
     bz_stream bz;
     z_stream gz;
     lzma_stream lz;
+    struct cfile_pbz *pbz;
+#ifdef WITH_ZSTD
+    struct {
+      ZSTD_CCtx *cs;
+      ZSTD_DStream *ds;
+      ZSTD_inBuffer in;
+    } zstd;
+#endif
   } strm;
   int (*read)(struct cfile *f, void *buf, int len);
   int (*write)(struct cfile *f, void *buf, int len);
   int (*close)(struct cfile *f);
   int (*unread)(struct cfile *f, void *buf, int len);
   int (*oldread)(struct cfile *f, void *buf, int len);
+  unsigned char *borrowbuf;	/* see cfile_borrow */
+  int nborrow;
+  int borrowoff;
+  int (*borrowread)(struct cfile *f, void *buf, int len);
+  int (*borrowclose)(struct cfile *f);
+  struct cfile_map *map;	/* CFILE_IO_MMAP */
+  unsigned char *membuf;	/* data decompressed in one go */
+  size_t memlen;
+  size_t memoff;
+  struct cfile_stats *stats;	/* see cfile_stats */
+  unsigned long long statwall;
+  unsigned long long statcpu;
 };
 
 typedef void (*cfile_ctxup)(void *, unsigned char *, unsigned int);
@@ -44,6 +84,9 @@ typedef void (*cfile_ctxup)(void *, unsigned char *, unsigned int);
 #define CFILE_IO_BUFFER (-4)
 #define CFILE_IO_ALLOC  (-5)
 #define CFILE_IO_NULL   (-6)
+#define CFILE_IO_MMAP   (-7)	/* fp points to a fd, read only. Regular files
+				 * are mapped from the current offset, which
+				 * is set behind the used data on close */
 
 #define CFILE_IO_REOPEN     (-99)
 #define CFILE_IO_PUSHBACK   (-100)	/* internal */
@@ -56,6 +99,7 @@ typedef void (*cfile_ctxup)(void *, unsigned char *, unsigned int);
 #define CFILE_COMP_BZ_17 (4)
 #define CFILE_COMP_LZMA (5)
 #define CFILE_COMP_XZ (6)
+#define CFILE_COMP_ZSTD (7)
 
 #define CFILE_COMP_BZ CFILE_COMP_BZ_20
 
@@ -63,11 +107,21 @@ typedef void (*cfile_ctxup)(void *, unsigned char *, unsigned int);
 #define CFILE_COMPALGO(comp) ((comp) & 255)
 #define CFILE_COMPLEVEL(comp) ((comp) >> 8 & 255)
 
+/* compress with worker threads. The output does not depend on the
+ * number of threads. For bzip2 it is the same as the single threaded
+ * one, for xz and zstd it differs. xz also needs the block size in
+ * megabytes, 0 means the liblzma default for the level */
+#define CFILE_COMP_MT (1 << 16)
+#define CFILE_MKMTBLOCK(comp, mbytes) ((comp) | CFILE_COMP_MT | (mbytes) << 17)
+#define CFILE_MTBLOCK(comp) ((comp) >> 17 & 0x3fff)
+
 #define CFILE_OPEN_RD ('r')
 #define CFILE_OPEN_WR ('w')
 
 #define CFILE_LEN_UNLIMITED ((size_t)-1)
 
+#define CFILE_BUFSIZE_DEFAULT (128 * 1024)
+
 #define CFILE_UNREAD_GET_LEN (-2)
 
 #define CFILE_COPY_CLOSE_IN    (1 << 0)
@@ -76,8 +130,20 @@ typedef void (*cfile_ctxup)(void *, unsigned char *, unsigned int);
 
 #define CFILE_UNREAD_GETBYTES  (-2)
 
+/* one entry per compression for reading, then one per compression
+ * for writing */
+#define CFILE_STATS_N 16
+#define CFILE_STATS_IDX(mode, comp) (((mode) == CFILE_OPEN_WR ? 8 : 0) + CFILE_COMPALGO(comp))
+
 struct cfile *cfile_open(int mode, int fd, void *fp, int comp, size_t len, void (*ctxup)(void *, unsigned char *, unsigned int), void *ctx);
 int cfile_copy(struct cfile *in, struct cfile *out, int flags);
 int cfile_detect_rsync(struct cfile *f);
 char *cfile_comp2str(int comp);
+int cfile_str2comp(char *str);	/* "xz", "zstd.19", ..., -1 if unknown */
 int cfile_setlevel(int comp, int level);
+void cfile_setthreads(int threads);	/* for CFILE_COMP_MT, default: number of cpus (max 8) */
+void cfile_setbufsize(int bufsize);	/* io buffer of the cfiles opened from now on */
+int cfile_borrow(struct cfile *f, unsigned char **bp, int len);
+struct cfile *cfile_writethread(struct cfile *out);	/* write to out in a separate thread, closing closes out */
+void cfile_stats(struct cfile_stats *stats);	/* CFILE_STATS_N entries, add up the cfiles opened from now on */
+void cfile_printstats(FILE *fp, struct cfile_stats *stats);
@@ -373,20 +373,13 @@ expandaddblk(struct deltarpm *d)
 int
 str2comp(char *comp)
 {
-  if (!strcmp(comp, "bzip2"))
-    return CFILE_COMP_BZ;
-  if (!strcmp(comp, "gzip"))
-    return CFILE_COMP_GZ;
-#ifdef CFILE_COMP_GZ_RSYNC
-  if (!strcmp(comp, "gzip rsyncable"))
-    return CFILE_COMP_GZ_RSYNC;
-#endif
-  if (!strcmp(comp, "lzma"))
-    return CFILE_COMP_LZMA;
-  if (!strcmp(comp, "uncompressed"))
-    return CFILE_COMP_UN;
-  fprintf(stderr, "unknown compression type: %s\n", comp);
-  exit(1);
+  int c = cfile_str2comp(comp);
+  if (c == -1)
+    {
+      fprintf(stderr, "unknown compression type: %s\n", comp);
+      exit(1);
+    }
+  return c;
 }
 
 int
@@ -580,6 +573,7 @@ main(int argc, char **argv)
   int version = 0;
   int isexpanded = 0;
   unsigned int sizemb = 0;
+  struct cfile_stats cfstats[CFILE_STATS_N];
   
   while ((c = getopt(argc, argv, "xvS:z:V:")) != -1)
     {
@@ -625,6 +619,11 @@ main(int argc, char **argv)
     }
 
   vfp = !strcmp(argv[argc - 1], "-") ? stderr : stdout;
+  if (verbose > 1)
+    {
+      memset(cfstats, 0, sizeof(cfstats));
+      cfile_stats(cfstats);
+    }
   d = 0;
   for (j = optind; j < argc - 1; j++)
     {
@@ -781,5 +780,7 @@ main(int argc, char **argv)
   if (verbose)
     fprintf(vfp, "writing %s\n", name);
   writedeltarpm(d, 0);
+  if (verbose > 1)
+    cfile_printstats(vfp, cfstats);
   exit(0);
 }
@@ -37,117 +37,351 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
-#include <bzlib.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#ifndef BSDIFF_NO_THREADS
+#include <pthread.h>
+#endif
 
 #include "delta.h"
+#include "md5.h"
+#include "cfile.h"
+
+/*
+ * The instr, add and extra blocks are compressed with cfile, the
+ * compression of each block can be set with mkdiff_blockcomp.
+ */
+
+static int instrblkcomp = CFILE_COMP_BZ;
+static int addblkcomp = CFILE_COMP_BZ;
+static int extrablkcomp = CFILE_COMP_BZ;
+
+void mkdiff_blockcomp(int instrcomp, int addcomp, int extracomp)
+{
+  instrblkcomp = instrcomp;
+  addblkcomp = addcomp;
+  extrablkcomp = extracomp;
+}
 
-struct bzblock {
+struct block {
   unsigned char *data;
-  unsigned int len;
-  bz_stream strm;
+  struct cfile *cf;
 };
 
-static struct bzblock *blockopen()
+static struct block *blockopen(int comp)
 {
-  struct bzblock *bzf;
-  int ret;
-  bzf = malloc(sizeof(*bzf));
-  if (!bzf)
+  struct block *blk;
+
+  blk = malloc(sizeof(*blk));
+  if (!blk)
     return 0;
-  bzf->strm.bzalloc = 0;
-  bzf->strm.bzfree = 0;
-  bzf->strm.opaque = 0;
-  bzf->len = 0;
-  ret = BZ2_bzCompressInit(&bzf->strm, 9, 0, 30);
-  if (ret != BZ_OK)
-    {
-      free(bzf);
+  blk->data = 0;
+  blk->cf = cfile_open(CFILE_OPEN_WR, CFILE_IO_ALLOC, &blk->data, comp, CFILE_LEN_UNLIMITED, 0, 0);
+  if (!blk->cf)
+    {
+      free(blk);
       return 0;
     }
-  bzf->data = 0;
-  bzf->strm.avail_in = 0;
-  bzf->strm.next_in  = 0;
-  bzf->strm.avail_out = 0;
-  bzf->strm.next_out  = 0;
-  return bzf;
+  return blk;
 }
 
-static int blockwrite(struct bzblock *bzf, void *buf, int len)
+static int blockwrite(struct block *blk, void *buf, int len)
 {
-  int ret;
-
   if (len <= 0)
     return len < 0 ? -1 : 0;
-  bzf->strm.avail_in = len;
-  bzf->strm.next_in = buf;
-  for (;;)
+  return blk->cf->write(blk->cf, buf, len);
+}
+
+static int blockclose(struct block *blk, unsigned char **datap, unsigned int *lenp)
+{
+  int len;
+
+  len = blk->cf->close(blk->cf);
+  if (len < 0)
     {
-      if (bzf->strm.avail_out < 4096)
-	{
-	  if (bzf->len + 8192 < bzf->len)
-	    return -1;
-	  if (bzf->data)
-	    bzf->data = realloc(bzf->data, bzf->len + 8192);
-	  else
-	    bzf->data = malloc(bzf->len + 8192);
-	  if (!bzf->data)
-	    return -1;
-	  bzf->strm.avail_out = 8192;
-	}
-      bzf->strm.next_out = (char *)bzf->data + bzf->len;
-      ret = BZ2_bzCompress(&bzf->strm, BZ_RUN);
-      if (ret != BZ_RUN_OK)
-	return -1;
-      bzf->len = (unsigned char *)bzf->strm.next_out - bzf->data;
-      if (bzf->strm.avail_in == 0)
-	return len;
+      free(blk->data);
+      free(blk);
+      return -1;
     }
+  *datap = blk->data;
+  *lenp = len;
+  free(blk);
+  return 0;
 }
 
-static int blockclose(struct bzblock *bzf, unsigned char **datap, unsigned int *lenp)
+/******************************************************************/
+/*                                                                */
+/*         byte run scanning                                      */
+/*                                                                */
+/******************************************************************/
+
+/*
+ * bytesrun_fwd returns the number of leading positions where a and b
+ * are equal (eq = 1) or different (eq = 0), bytesrun_bwd does the
+ * same going down from a[-1] and b[-1]. The vector versions are
+ * selected at runtime by initbytesrun().
+ */
+
+static bsuint bytesrun_fwd_byte(unsigned char *a, unsigned char *b, bsuint n, int eq)
 {
-  int ret;
-  bzf->strm.avail_in = 0;
-  bzf->strm.next_in = 0;
-  for (;;)
+  bsuint i;
+  for (i = 0; i < n; i++)
+    if ((a[i] == b[i]) != eq)
+      break;
+  return i;
+}
+
+static bsuint bytesrun_bwd_byte(unsigned char *a, unsigned char *b, bsuint n, int eq)
+{
+  bsuint i;
+  for (i = 0; i < n; i++)
+    if ((*(a - 1 - i) == *(b - 1 - i)) != eq)
+      break;
+  return i;
+}
+
+#if defined(__GNUC__) && !defined(BSDIFF_NO_SIMD)
+
+/* 8 bytes at a time, works everywhere */
+
+static inline unsigned long long bytesrun_word(unsigned char *a, unsigned char *b, int eq)
+{
+  unsigned long long x, y, z;
+  memcpy(&x, a, 8);
+  memcpy(&y, b, 8);
+  x ^= y;
+  /* set the high bit of every byte that differs */
+  z = ((x & 0x7f7f7f7f7f7f7f7fULL) + 0x7f7f7f7f7f7f7f7fULL) | x;
+  z &= 0x8080808080808080ULL;
+  return eq ? z : z ^ 0x8080808080808080ULL;
+}
+
+static bsuint bytesrun_fwd_word(unsigned char *a, unsigned char *b, bsuint n, int eq)
+{
+  unsigned long long z;
+  bsuint i;
+  for (i = 0; i + 8 <= n; i += 8)
+    if ((z = bytesrun_word(a + i, b + i, eq)) != 0)
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+      return i + (__builtin_ctzll(z) >> 3);
+#else
+      return i + (__builtin_clzll(z) >> 3);
+#endif
+  return i + bytesrun_fwd_byte(a + i, b + i, n - i, eq);
+}
+
+static bsuint bytesrun_bwd_word(unsigned char *a, unsigned char *b, bsuint n, int eq)
+{
+  unsigned long long z;
+  bsuint i;
+  for (i = 0; i + 8 <= n; i += 8)
+    if ((z = bytesrun_word(a - i - 8, b - i - 8, eq)) != 0)
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+      return i + (__builtin_clzll(z) >> 3);
+#else
+      return i + (__builtin_ctzll(z) >> 3);
+#endif
+  return i + bytesrun_bwd_byte(a - i, b - i, n - i, eq);
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+
+#include <immintrin.h>
+
+__attribute__((target("sse2")))
+static bsuint bytesrun_fwd_sse2(unsigned char *a, unsigned char *b, bsuint n, int eq)
+{
+  unsigned int m, x = eq ? 0xffff : 0;
+  bsuint i;
+  for (i = 0; i + 16 <= n; i += 16)
     {
-      if (bzf->strm.avail_out < 4096)
-	{
-	  if (bzf->len + 8192 < bzf->len)
-	    return -1;
-	  if (bzf->data)
-	    bzf->data = realloc(bzf->data, bzf->len + 8192);
-	  else
-	    bzf->data = malloc(bzf->len + 8192);
-	  if (!bzf->data)
-	    return -1;
-	  bzf->strm.avail_out = 8192;
-	}
-      bzf->strm.next_out = (char *)bzf->data + bzf->len;
-      ret = BZ2_bzCompress(&bzf->strm, BZ_FINISH);
-      if (ret != BZ_FINISH_OK && ret != BZ_STREAM_END)
-        return -1;
-      bzf->len = (unsigned char *)bzf->strm.next_out - bzf->data;
-      if (ret == BZ_STREAM_END)
-        break;
-    }
-  BZ2_bzCompressEnd (&bzf->strm);
-  *datap = bzf->data;
-  *lenp = bzf->len;
-  free(bzf);
-  return 0;
+      m = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((__m128i *)(a + i)), _mm_loadu_si128((__m128i *)(b + i)))) ^ x;
+      if (m)
+	return i + __builtin_ctz(m);
+    }
+  return i + bytesrun_fwd_byte(a + i, b + i, n - i, eq);
+}
+
+__attribute__((target("sse2")))
+static bsuint bytesrun_bwd_sse2(unsigned char *a, unsigned char *b, bsuint n, int eq)
+{
+  unsigned int m, x = eq ? 0xffff : 0;
+  bsuint i;
+  for (i = 0; i + 16 <= n; i += 16)
+    {
+      m = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((__m128i *)(a - i - 16)), _mm_loadu_si128((__m128i *)(b - i - 16)))) ^ x;
+      if (m)
+	return i + __builtin_clz(m) - 16;
+    }
+  return i + bytesrun_bwd_byte(a - i, b - i, n - i, eq);
+}
+
+__attribute__((target("avx2")))
+static bsuint bytesrun_fwd_avx2(unsigned char *a, unsigned char *b, bsuint n, int eq)
+{
+  unsigned int m, x = eq ? 0xffffffff : 0;
+  bsuint i;
+  for (i = 0; i + 32 <= n; i += 32)
+    {
+      m = (unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((__m256i *)(a + i)), _mm256_loadu_si256((__m256i *)(b + i)))) ^ x;
+      if (m)
+	return i + __builtin_ctz(m);
+    }
+  return i + bytesrun_fwd_byte(a + i, b + i, n - i, eq);
+}
+
+__attribute__((target("avx2")))
+static bsuint bytesrun_bwd_avx2(unsigned char *a, unsigned char *b, bsuint n, int eq)
+{
+  unsigned int m, x = eq ? 0xffffffff : 0;
+  bsuint i;
+  for (i = 0; i + 32 <= n; i += 32)
+    {
+      m = (unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((__m256i *)(a - i - 32)), _mm256_loadu_si256((__m256i *)(b - i - 32)))) ^ x;
+      if (m)
+	return i + __builtin_clz(m);
+    }
+  return i + bytesrun_bwd_byte(a - i, b - i, n - i, eq);
+}
+
+#endif
+#endif
+
+static bsuint (*bytesrun_fwd)(unsigned char *a, unsigned char *b, bsuint n, int eq) = bytesrun_fwd_byte;
+static bsuint (*bytesrun_bwd)(unsigned char *a, unsigned char *b, bsuint n, int eq) = bytesrun_bwd_byte;
+
+static void initbytesrun()
+{
+#if defined(__GNUC__) && !defined(BSDIFF_NO_SIMD)
+  bytesrun_fwd = bytesrun_fwd_word;
+  bytesrun_bwd = bytesrun_bwd_word;
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2"))
+    {
+      bytesrun_fwd = bytesrun_fwd_avx2;
+      bytesrun_bwd = bytesrun_bwd_avx2;
+    }
+  else if (__builtin_cpu_supports("sse2"))
+    {
+      bytesrun_fwd = bytesrun_fwd_sse2;
+      bytesrun_bwd = bytesrun_bwd_sse2;
+    }
+#endif
+#endif
 }
 
 static inline bsuint matchlen(unsigned char *old, bsuint oldlen, unsigned char *new, bsuint newlen)
 {
-  unsigned char *oldsave;
-  bsuint max;
-  oldsave = old;
-  max = oldlen > newlen ? newlen : oldlen;
-  while (max-- > 0)
-    if (*old++ != *new++)
-      return old - oldsave - 1;
-  return old - oldsave;
+  return bytesrun_fwd(old, new, oldlen > newlen ? newlen : oldlen, 1);
+}
+
+/******************************************************************/
+/*                                                                */
+/*         offset arrays                                          */
+/*                                                                */
+/******************************************************************/
+
+/*
+ * The indices keep offsets into the old data in 32 bits, bits 32-39
+ * go into an extra byte array if the old data is 4GB or bigger.
+ * So a 64 bit bsuint does not double the index size.
+ */
+
+struct offarray {
+  unsigned int *lo;
+  unsigned char *hi;
+};
+
+#define OFFARRAY_MAX (sizeof(bsuint) > 4 ? (bsuint)((1ULL << 40) - 1) : (bsuint)0xffffffff)
+#define OFFARRAY_NEEDHI(max) ((unsigned long long)(max) > 0xffffffffULL)
+#define OFFARRAY_ENTSIZE(max) (sizeof(unsigned int) + (OFFARRAY_NEEDHI(max) ? 1 : 0))
+
+static inline bsuint offget(struct offarray *oa, bsuint i)
+{
+  if (oa->hi)
+    return oa->lo[i] | (bsuint)oa->hi[i] << 16 << 16;
+  return oa->lo[i];
+}
+
+static inline void offput(struct offarray *oa, bsuint i, bsuint v)
+{
+  oa->lo[i] = v;
+  if (oa->hi)
+    oa->hi[i] = v >> 16 >> 16;
+}
+
+/* allocate a cleared array of n offsets up to max */
+static int offalloc(struct offarray *oa, bsuint n, bsuint max)
+{
+  oa->hi = 0;
+  if (max > OFFARRAY_MAX)
+    return 0;
+  oa->lo = calloc(n, sizeof(unsigned int));
+  if (!oa->lo)
+    return 0;
+  if (OFFARRAY_NEEDHI(max) && (oa->hi = calloc(n, 1)) == 0)
+    {
+      free(oa->lo);
+      return 0;
+    }
+  return 1;
+}
+
+/* convert n bsints in [0, max] to offsets, reusing the memory of a */
+static int offpack(struct offarray *oa, bsint *a, bsuint n, bsuint max)
+{
+  bsuint i;
+  unsigned int lo;
+  bsint v;
+
+  oa->hi = 0;
+  if (max > OFFARRAY_MAX)
+    return 0;
+  if (sizeof(bsint) == sizeof(unsigned int))
+    {
+      oa->lo = (unsigned int *)a;
+      return 1;
+    }
+  if (OFFARRAY_NEEDHI(max))
+    {
+      if ((oa->hi = malloc(n)) == 0)
+	return 0;
+      for (i = 0; i < n; i++)
+	oa->hi[i] = (bsuint)a[i] >> 16 >> 16;
+    }
+  for (i = 0; i < n; i++)
+    {
+      memcpy(&v, (unsigned char *)a + i * sizeof(bsint), sizeof(bsint));
+      lo = v;
+      memcpy((unsigned char *)a + i * sizeof(unsigned int), &lo, sizeof(unsigned int));
+    }
+  oa->lo = realloc(a, n * sizeof(unsigned int));
+  if (!oa->lo)
+    oa->lo = (unsigned int *)a;
+  return 1;
+}
+
+static void offfree(struct offarray *oa)
+{
+  free(oa->lo);
+  free(oa->hi);
+}
+
+static int offwrite(struct offarray *oa, bsuint n, FILE *fp)
+{
+  if (fwrite(oa->lo, sizeof(unsigned int), n, fp) != n)
+    return 0;
+  return !oa->hi || fwrite(oa->hi, 1, n, fp) == n;
+}
+
+/* use the data written by offwrite */
+static void offmap(struct offarray *oa, void *p, bsuint n, bsuint max)
+{
+  oa->lo = p;
+  oa->hi = OFFARRAY_NEEDHI(max) ? (unsigned char *)p + n * sizeof(unsigned int) : 0;
 }
 
 #ifndef BSDIFF_NO_HASH
@@ -158,8 +392,13 @@ static inline bsuint matchlen(unsigned char *old, bsuint oldlen, unsigned char *
 /*                                                                */
 /******************************************************************/
 
+/*
+ * The old data is split into blocks of 1 << HSIZESHIFT bytes, the hash table
+ * has about HDENSITY slots per block. Both can be changed with the
+ * DELTAMODE_MKHASH mode bits.
+ */
 #define HSIZESHIFT      4
-#define HSIZE           (1 << HSIZESHIFT)
+#define HDENSITY        4
 
 /* 256 random numbers generated by a quantum source */
 static unsigned int noise[256] =
@@ -222,15 +461,38 @@ static unsigned int noise[256] =
 /* General hash functions. Technical Report TR-92-01, The University
    of Hong Kong, 1993 */
 
-static unsigned int buzhash(unsigned char *buf)
+#define BUZHASH_INIT 0x83d31df4U
+
+static unsigned int buzhash(unsigned char *buf, bsuint hsize)
 {
-  unsigned int x = 0x83d31df4U;
-  int i;
-  for (i = HSIZE; i != 0; i--)
+  unsigned int x = BUZHASH_INIT;
+  bsuint i;
+  for (i = hsize; i != 0; i--)
     x = (x << 1) ^ (x & (1 << 31) ? 1 : 0) ^ noise[*buf++];
   return x;
 }
 
+/*
+ * rolling update: remove the byte that leaves the window. As the
+ * hash gets rotated once per byte, the noise of the leaving byte
+ * (and of the start value) is rotated by hsize % 32 bits.
+ */
+static void buzhash_mkroll(unsigned int *roll, bsuint hsize)
+{
+  unsigned int x;
+  int i, r = hsize % 32;
+  for (i = 0; i < 256; i++)
+    {
+      x = noise[i] ^ BUZHASH_INIT ^ (BUZHASH_INIT << 1 | BUZHASH_INIT >> 31);
+      roll[i] = r ? x << r | x >> (32 - r) : x;
+    }
+}
+
+static inline unsigned int buzhash_roll(unsigned int x, unsigned int *roll, unsigned char in, unsigned char out)
+{
+  return ((x << 1) ^ (x & (1 << 31) ? 1 : 0) ^ noise[in]) ^ roll[out];
+}
+
 static unsigned int primes[] =
 {
   65537, 98317, 147481, 221227, 331841, 497771, 746659, 1120001,
@@ -240,66 +502,163 @@ static unsigned int primes[] =
   0xffffffff
 };
 
+/*
+ * In stream mode the old window slides. The entries are offsets + 1
+ * plus base, so discarding data just raises base; entries not above
+ * base point into discarded data and count as empty.
+ */
 struct hash_data {
-  bsuint *hash;
+  struct offarray hash;
   unsigned int prime;
+  bsuint hsize;
+  bsuint base;
+  bsuint maxlen;
+  unsigned int roll[256];
+  void *map;
+  size_t maplen;
 };
 
-static void *hash_create(unsigned char *buf, bsuint len)
+static inline bsuint hash_get(struct hash_data *hd, bsuint s)
+{
+  bsuint pos = offget(&hd->hash, s);
+  return pos > hd->base ? pos - hd->base : 0;
+}
+
+static int hash_shift(int mode)
+{
+  return DELTAMODE_HASHSHIFT(mode) ? DELTAMODE_HASHSHIFT(mode) : HSIZESHIFT;
+}
+
+static int hash_density(int mode)
+{
+  return DELTAMODE_HASHDENSITY(mode) ? DELTAMODE_HASHDENSITY(mode) : HDENSITY;
+}
+
+/* create an empty table for up to maxlen bytes */
+static void *hash_alloc(bsuint maxlen, int mode)
 {
   struct hash_data *hd;
-  bsuint *hash;
-  unsigned char *bp = buf;
-  bsuint off;
+  bsuint hsize, num;
   unsigned int s;
-  unsigned int prime;
-  unsigned int num;
 
-  hd = malloc(sizeof(*hd));
+  hd = calloc(1, sizeof(*hd));
   if (!hd)
     return 0;
-#ifdef BSDIFF_64BIT
-  /* this is a 16GB limit for HSIZESHIFT == 4 */
-  if (len >= (bsuint)(0xffffffff / 4) << HSIZESHIFT)
-    return 0;
-#endif
-  num = (len + HSIZE - 1) >> HSIZESHIFT;
-  prime = num * 4;
+  hsize = (bsuint)1 << hash_shift(mode);
+  num = ((maxlen + hsize - 1) >> hash_shift(mode)) * hash_density(mode);
   for (s = 0; s < sizeof(primes)/sizeof(*primes) - 1; s++)
-    if (prime < primes[s])
+    if (num < primes[s])
       break;
-  prime = primes[s];
-  hash = calloc(prime, sizeof(*hash));
-  if (!hash)
+  hd->prime = primes[s];
+  if (!offalloc(&hd->hash, hd->prime, maxlen))
     {
       free(hd);
       return 0;
     }
-  for (off = 0; len >= HSIZE; off += HSIZE, buf += HSIZE, len -= HSIZE)
+  hd->hsize = hsize;
+  hd->maxlen = maxlen;
+  buzhash_mkroll(hd->roll, hsize);
+  return hd;
+}
+
+/* add the blocks of buf from off to len, returns the end of the last block */
+static bsuint hash_append(void *data, unsigned char *bp, bsuint off, bsuint len)
+{
+  struct hash_data *hd = data;
+  unsigned int prime = hd->prime;
+  bsuint hsize = hd->hsize;
+  unsigned char *buf;
+  bsuint pos;
+  unsigned int s;
+
+  for (buf = bp + off; off < len && len - off >= hsize; off += hsize, buf += hsize)
     {
-      s = buzhash(buf) % prime;
-      if (hash[s])
+      s = buzhash(buf, hsize) % prime;
+      if ((pos = hash_get(hd, s)) != 0)
         {
-          if (hash[(s == prime - 1) ? 0 : s + 1])
+          if (hash_get(hd, (s == prime - 1) ? 0 : s + 1))
             continue;
-          if (!memcmp(buf, bp + hash[s], HSIZE))
+          if (!memcmp(buf, bp + pos, hsize))
             continue;
           s = (s == prime - 1) ? 0 : s + 1;
         }
-      hash[s] = off + 1;
+      offput(&hd->hash, s, hd->base + off + 1);
+    }
+  return off;
+}
+
+/*
+ * the first move bytes got removed from the data. The table only gets
+ * rewritten when base + maxlen would no longer fit into an entry.
+ */
+static void hash_discard(void *data, bsuint move)
+{
+  struct hash_data *hd = data;
+  bsuint limit = hd->hash.hi ? OFFARRAY_MAX : (bsuint)0xffffffff;
+  bsuint pos;
+  unsigned int s;
+
+  if (move <= limit - hd->maxlen - hd->base)
+    {
+      hd->base += move;
+      return;
     }
-  hd->hash = hash;
-  hd->prime = prime;
+  move += hd->base;
+  for (s = 0; s < hd->prime; s++)
+    if ((pos = offget(&hd->hash, s)) != 0)
+      offput(&hd->hash, s, pos > move ? pos - move : 0);
+  hd->base = 0;
+}
+
+static void *hash_create(unsigned char *buf, bsuint len, int mode)
+{
+  struct hash_data *hd;
+
+  if ((hd = hash_alloc(len, mode)) != 0)
+    hash_append(hd, buf, 0, len);
   return hd;
 }
 
 static void hash_free(void *data)
 {
   struct hash_data *hd = data;
-  free(hd->hash);
+  if (hd->map)
+    munmap(hd->map, hd->maplen);
+  else
+    offfree(&hd->hash);
   free(hd);
 }
 
+static int hash_save(void *data, bsuint len, FILE *fp)
+{
+  struct hash_data *hd = data;
+  bsuint prime = hd->prime;
+
+  if (fwrite(&prime, sizeof(prime), 1, fp) != 1)
+    return 0;
+  return offwrite(&hd->hash, hd->prime, fp);
+}
+
+static void *hash_load(void *map, size_t maplen, size_t off, bsuint len, int mode)
+{
+  struct hash_data *hd;
+  bsuint *p = (bsuint *)((unsigned char *)map + off);
+
+  if (maplen - off < sizeof(bsuint) || maplen - off - sizeof(bsuint) != p[0] * OFFARRAY_ENTSIZE(len))
+    return 0;
+  hd = calloc(1, sizeof(*hd));
+  if (!hd)
+    return 0;
+  hd->prime = p[0];
+  offmap(&hd->hash, p + 1, p[0], len);
+  hd->hsize = (bsuint)1 << hash_shift(mode);
+  hd->maxlen = len;
+  buzhash_mkroll(hd->roll, hd->hsize);
+  hd->map = map;
+  hd->maplen = maplen;
+  return hd;
+}
+
 static bsuint hash_findnext(void *data, unsigned char *old, bsuint oldlen, unsigned char *new, bsuint newlen, bsuint lastoffset, bsuint scan, bsuint *posp, bsuint *lenp)
 {
   struct hash_data *hd = data;
@@ -309,70 +668,63 @@ static bsuint hash_findnext(void *data, unsigned char *old, bsuint oldlen, unsig
   bsuint i, ss, scsc;
   unsigned int ssx;
   unsigned int prime;
-  bsuint *hash;
+  bsuint hsize;
 
-  hash = hd->hash;
   prime = hd->prime;
+  hsize = hd->hsize;
   scanstart = scan;
   oldscore = oldscorenum = oldscorestart = 0;
-  ssx = scan <= newlen - HSIZE ? buzhash(new + scan) : 0;
+  ssx = scan <= newlen - hsize ? buzhash(new + scan, hsize) : 0;
   pos = 0;
   len = 0;
   lpos = lscan = llen = 0;
   for (;;)
     {
-      if (scan >= newlen - HSIZE)
+      if (scan >= newlen - hsize)
 	{
 	  if (llen >= 32)
 	    goto gotit;
 	  break;
 	}
       ss = ssx % prime;
-      pos = hash[ss];
+      pos = hash_get(hd, ss);
       if (!pos)
 	{
-	  unsigned int oldc;
 scannext:
-	  if (llen >= 32 && scan - lscan >= HSIZE)
+	  if (llen >= 32 && scan - lscan >= hsize)
 	    goto gotit;
-	  ssx = (ssx << 1) ^ (ssx & (1 << 31) ? 1 : 0) ^ noise[new[scan + HSIZE]];
-	  oldc = noise[new[scan]] ^ (0x83d31df4U ^ 0x07a63be9U);
-#if HSIZE % 32 != 0
-	  ssx ^= (oldc << (HSIZE % 32)) ^ (oldc >> (32 - (HSIZE % 32)));
-#else
-	  ssx ^= oldc;
-#endif
+	  ssx = buzhash_roll(ssx, hd->roll, new[scan + hsize], new[scan]);
 	  scan++;
 	  continue;
 	}
       pos--;
-      if (memcmp(old + pos, new + scan, HSIZE))
+      if (memcmp(old + pos, new + scan, hsize))
 	{
-	  pos = hash[ss == prime - 1 ? 0 : ss + 1];
+	  pos = hash_get(hd, ss == prime - 1 ? 0 : ss + 1);
 	  if (!pos)
 	    goto scannext;
 	  pos--;
-	  if (memcmp(old + pos, new + scan, HSIZE))
+	  if (memcmp(old + pos, new + scan, hsize))
 	    goto scannext;
 	}
-      len = matchlen(old + pos + HSIZE, oldlen - pos - HSIZE, new + scan + HSIZE, newlen - scan - HSIZE) + HSIZE;
-      if (scan + HSIZE * 4 <= newlen)
+      len = matchlen(old + pos + hsize, oldlen - pos - hsize, new + scan + hsize, newlen - scan - hsize) + hsize;
+      if (scan + hsize * 4 <= newlen)
 	{
 	  unsigned int ssx2;
 	  bsuint len2, pos2;
-	  ssx2 = buzhash(new + scan + HSIZE * 3) % prime;
-	  pos2 = hash[ssx2];
+	  ssx2 = buzhash(new + scan + hsize * 3, hsize) % prime;
+	  pos2 = hash_get(hd, ssx2);
 	  if (pos2)
 	    {
-	      if (memcmp(new + scan + HSIZE *3, old + pos2 - 1, HSIZE))
+	      if (memcmp(new + scan + hsize *3, old + pos2 - 1, hsize))
 		{
 		  ssx2 = (ssx2 == prime - 1) ? 0 : ssx2 + 1;
-		  pos2 = hash[ssx2];
+		  pos2 = hash_get(hd, ssx2);
 		}
 	    }
-	  if (pos2 > 1 + HSIZE*3)
+	  if (pos2 > 1 + hsize*3)
 	    {
-	      pos2 = pos2 - 1 - HSIZE*3;
+	      pos2 = pos2 - 1 - hsize*3;
 	      if (pos2 != pos)
 		{
 		  len2 = matchlen(old + pos2, oldlen - pos2, new + scan, newlen - scan);
@@ -399,8 +751,8 @@ gotit:
 	{
 	  scan += len;
 	  scanstart = scan;
-	  if (scan + HSIZE < newlen)
-	    ssx = buzhash(new + scan);
+	  if (scan + hsize < newlen)
+	    ssx = buzhash(new + scan, hsize);
 	  llen = 0;
 	  continue;
 	}
@@ -434,16 +786,16 @@ gotit:
 	}
       if (len - oldscore >= 32)
 	break;
-      if (len > HSIZE * 3 + 32)
-        scan += len - (HSIZE * 3 + 32);
+      if (len > hsize * 3 + 32)
+        scan += len - (hsize * 3 + 32);
       if (scan <= lscan)
 	scan = lscan + 1;
       scanstart = scan;
-      if (scan + HSIZE < newlen)
-	ssx = buzhash(new + scan);
+      if (scan + hsize < newlen)
+	ssx = buzhash(new + scan, hsize);
       llen = 0;
     }
-  if (scan >= newlen - HSIZE)
+  if (scan >= newlen - hsize)
     {
       scan = newlen;
       pos = 0;
@@ -465,8 +817,10 @@ gotit:
 /******************************************************************/
 
 struct suf_data {
-  bsint *I;
+  struct offarray I;		/* F[256] + 1 entries */
   bsint F[257];
+  void *map;
+  size_t maplen;
 };
 
 static void suf_split(bsint *I, bsint *V, bsint start, bsint len, bsint h)
@@ -596,7 +950,7 @@ static bsint suf_bucketsort(bsint *V, bsint *I, bsint n, bsint s)
   return 1;
 }
 
-static void *suf_create(unsigned char *buf, bsuint ulen)
+static void *suf_create(unsigned char *buf, bsuint ulen, int mode)
 {
   struct suf_data *sd;
   bsint *V, *I;
@@ -605,7 +959,7 @@ static void *suf_create(unsigned char *buf, bsuint ulen)
   len = ulen;
   if (len < 0)
     return 0;
-  sd = malloc(sizeof(*sd));
+  sd = calloc(1, sizeof(*sd));
   if (!sd)
     return 0;
   V = malloc(sizeof(bsint) * (len + 3));
@@ -700,33 +1054,74 @@ static void *suf_create(unsigned char *buf, bsuint ulen)
   for (i = 0; i < len + 1; i++)
     I[V[i]] = i;
   free(V);
-  sd->I = I;
+  if (!offpack(&sd->I, I, len + 1, len))
+    {
+      free(I);
+      free(sd);
+      return 0;
+    }
   return sd;
 }
 
 static void suf_free(void *data)
 {
   struct suf_data *sd = data;
-  free(sd->I);
+  if (sd->map)
+    munmap(sd->map, sd->maplen);
+  else
+    offfree(&sd->I);
   free(sd);
 }
 
-static bsuint suf_bsearch(bsint *I, unsigned char *old, bsuint oldlen, unsigned char *new, bsuint newlen, bsuint st, bsuint en, bsuint *posp)
+static int suf_save(void *data, bsuint len, FILE *fp)
+{
+  struct suf_data *sd = data;
+
+  if (fwrite(sd->F, sizeof(bsint), 257, fp) != 257)
+    return 0;
+  return offwrite(&sd->I, sd->F[256] + 1, fp);
+}
+
+static void *suf_load(void *map, size_t maplen, size_t off, bsuint len, int mode)
+{
+  struct suf_data *sd;
+  bsint *p = (bsint *)((unsigned char *)map + off);
+  bsuint n;
+
+  if (maplen - off < sizeof(bsint) * 257)
+    return 0;
+  n = p[256];	/* the sorter may have added sentinels */
+  if (n < len || n > len + 2 || maplen - off - sizeof(bsint) * 257 != (n + 1) * OFFARRAY_ENTSIZE(n))
+    return 0;
+  sd = calloc(1, sizeof(*sd));
+  if (!sd)
+    return 0;
+  memcpy(sd->F, p, sizeof(sd->F));
+  offmap(&sd->I, p + 257, n + 1, n);
+  sd->map = map;
+  sd->maplen = maplen;
+  return sd;
+}
+
+static bsuint suf_bsearch(struct offarray *I, unsigned char *old, bsuint oldlen, unsigned char *new, bsuint newlen, bsuint st, bsuint en, bsuint *posp)
 {
-  bsuint x, y;
+  bsuint x, y, ist, ien;
   if (st > en)
     return 0;
   while (en - st >= 2)
     {
       x = st + (en - st) / 2;
-      if (memcmp(old + I[x], new, oldlen - I[x] < newlen ? oldlen - I[x] : newlen) < 0)
+      y = offget(I, x);
+      if (memcmp(old + y, new, oldlen - y < newlen ? oldlen - y : newlen) < 0)
 	st = x;
       else
 	en = x;
     }
-  x = matchlen(old + I[st], oldlen - I[st], new, newlen);
-  y = matchlen(old + I[en], oldlen - I[en], new, newlen);
-  *posp = x > y ? I[st] : I[en];
+  ist = offget(I, st);
+  ien = offget(I, en);
+  x = matchlen(old + ist, oldlen - ist, new, newlen);
+  y = matchlen(old + ien, oldlen - ien, new, newlen);
+  *posp = x > y ? ist : ien;
   return x > y ? x : y;
 }
 
@@ -741,7 +1136,7 @@ static bsuint suf_findnext(void *data, unsigned char *old, bsuint oldlen, unsign
   oldscore = 0;
   while (scan < newlen)
     {
-      len = suf_bsearch(sd->I, old, oldlen, new + scan, newlen - scan, sd->F[new[scan]] + 1, sd->F[new[scan] + 1], posp);
+      len = suf_bsearch(&sd->I, old, oldlen, new + scan, newlen - scan, sd->F[new[scan]] + 1, sd->F[new[scan] + 1], posp);
       for (; scsc < scan + len; scsc++)
 	if (scsc + lastoffset < oldlen && old[scsc + lastoffset] == new[scsc])
 	  oldscore++;
@@ -758,32 +1153,285 @@ static bsuint suf_findnext(void *data, unsigned char *old, bsuint oldlen, unsign
 	oldscore--;
       scan++;
     }
-  *lenp = len;
+  /* no match at the end, the streaming diff continues from scan + len */
+  *lenp = scan < newlen ? len : 0;
   return scan;
 }
 
-#endif /* BSDIFF_NO_SUF */
-
+/******************************************************************/
+/*                                                                */
+/*         suffix list method, induced sorting (SA-IS)            */
+/*                                                                */
 /******************************************************************/
 
-struct deltamode {
-  int mode;
-  void *(*create)(unsigned char *buf, bsuint len);
-  bsuint (*findnext)(void *data, unsigned char *old, bsuint oldlen, unsigned char *new, bsuint newlen, bsuint lastoffset, bsuint scan, bsuint *posp, bsuint *lenp);
-  void (*free)(void *data);
-};
-
-struct deltamode deltamodes[] =
+/* Linear time suffix array construction, see Nong, Zhang, Chan:
+   "Two Efficient Algorithms for Linear Time Suffix Array
+   Construction", IEEE Transactions on Computers, 2011.
+   The sentinel is virtual, i.e. it is not part of the text. The
+   created I and F arrays are laid out so that suf_findnext can be
+   used on them. As suffix arrays are unique, the result is the
+   same as with suf_create.
+   The work arrays are ints if the input is smaller than 2GB, so
+   the sort needs about 4 bytes per input byte plus the bucket
+   array of the reduced problem, and the result is used as index
+   without conversion. */
+
+#define SAIS_GET(A, ss, i) ((ss) == sizeof(int) ? (bsint)((int *)(A))[i] : ((bsint *)(A))[i])
+#define SAIS_SET(A, ss, i, v) ((ss) == sizeof(int) ? (void)(((int *)(A))[i] = (v)) : (void)(((bsint *)(A))[i] = (v)))
+#define SAIS_CHR(T, cs, i) ((cs) == 1 ? (bsint)((unsigned char *)(T))[i] : SAIS_GET(T, cs, i))
+#define SAIS_ISS(t, i) ((t)[(i) >> 3] & (1 << ((i) & 7)))
+#define SAIS_ISLMS(t, i) ((i) > 0 && SAIS_ISS(t, i) && !SAIS_ISS(t, (i) - 1))
+
+static void sais_buckets(void *T, int cs, bsint n, void *B, int ss, bsint k, int end)
 {
-#ifndef BSDIFF_NO_SUF
-  {DELTAMODE_SUF, suf_create, suf_findnext, suf_free}, 
+  bsint i, c, sum;
+
+  memset(B, 0, k * ss);
+  for (i = 0; i < n; i++)
+    {
+      c = SAIS_CHR(T, cs, i);
+      SAIS_SET(B, ss, c, SAIS_GET(B, ss, c) + 1);
+    }
+  for (i = 0, sum = 0; i < k; i++)
+    {
+      c = SAIS_GET(B, ss, i);
+      sum += c;
+      SAIS_SET(B, ss, i, end ? sum : sum - c);
+    }
+}
+
+/* put j at the front/end of the bucket of c */
+static inline void sais_put(void *SA, void *B, int ss, bsint c, bsint j)
+{
+  bsint p = SAIS_GET(B, ss, c);
+  SAIS_SET(B, ss, c, p + 1);
+  SAIS_SET(SA, ss, p, j);
+}
+
+static inline void sais_putend(void *SA, void *B, int ss, bsint c, bsint j)
+{
+  bsint p = SAIS_GET(B, ss, c) - 1;
+  SAIS_SET(B, ss, c, p);
+  SAIS_SET(SA, ss, p, j);
+}
+
+static void sais_induce(void *T, int cs, void *SA, int ss, bsint n, bsint k, unsigned char *t, void *B)
+{
+  bsint i, j;
+
+  /* L type suffixes, the virtual sentinel induces n - 1 */
+  sais_buckets(T, cs, n, B, ss, k, 0);
+  sais_put(SA, B, ss, SAIS_CHR(T, cs, n - 1), n - 1);
+  for (i = 0; i < n; i++)
+    {
+      j = SAIS_GET(SA, ss, i) - 1;
+      if (j >= 0 && !SAIS_ISS(t, j))
+	sais_put(SA, B, ss, SAIS_CHR(T, cs, j), j);
+    }
+  /* S type suffixes */
+  sais_buckets(T, cs, n, B, ss, k, 1);
+  for (i = n - 1; i >= 0; i--)
+    {
+      j = SAIS_GET(SA, ss, i) - 1;
+      if (j >= 0 && SAIS_ISS(t, j))
+	sais_putend(SA, B, ss, SAIS_CHR(T, cs, j), j);
+    }
+}
+
+static int sais_main(void *T, int cs, void *SA, int ss, bsint n, bsint k)
+{
+  unsigned char *t;
+  void *B, *s1;
+  bsint i, j, d, m, name, pos, prev;
+  int diff;
+
+  if (n <= 1)
+    {
+      if (n)
+	SAIS_SET(SA, ss, 0, 0);
+      return 1;
+    }
+  t = calloc(n / 8 + 1, 1);
+  if (!t)
+    return 0;
+  B = malloc(ss * k);
+  if (!B)
+    {
+      free(t);
+      return 0;
+    }
+  /* classify suffixes, n - 1 is L type because of the sentinel */
+  for (i = n - 2; i >= 0; i--)
+    {
+      bsint c0 = SAIS_CHR(T, cs, i), c1 = SAIS_CHR(T, cs, i + 1);
+      if (c0 < c1 || (c0 == c1 && SAIS_ISS(t, i + 1)))
+	t[i >> 3] |= 1 << (i & 7);
+    }
+
+  /* stage 1: sort the LMS substrings */
+  sais_buckets(T, cs, n, B, ss, k, 1);
+  for (i = 0; i < n; i++)
+    SAIS_SET(SA, ss, i, -1);
+  for (i = 1; i < n; i++)
+    if (SAIS_ISLMS(t, i))
+      sais_putend(SA, B, ss, SAIS_CHR(T, cs, i), i);
+  sais_induce(T, cs, SA, ss, n, k, t, B);
+
+  /* compact the sorted LMS substrings and name them */
+  for (i = 0, m = 0; i < n; i++)
+    {
+      j = SAIS_GET(SA, ss, i);
+      if (SAIS_ISLMS(t, j))
+	SAIS_SET(SA, ss, m++, j);
+    }
+  for (i = m; i < n; i++)
+    SAIS_SET(SA, ss, i, -1);
+  name = 0;
+  prev = -1;
+  for (i = 0; i < m; i++)
+    {
+      pos = SAIS_GET(SA, ss, i);
+      diff = prev == -1;
+      for (d = 0; !diff; d++)
+	{
+	  if (pos + d == n || prev + d == n || SAIS_CHR(T, cs, pos + d) != SAIS_CHR(T, cs, prev + d) || !SAIS_ISS(t, pos + d) != !SAIS_ISS(t, prev + d))
+	    diff = 1;
+	  else if (d > 0 && SAIS_ISLMS(t, pos + d))
+	    break;
+	}
+      if (diff)
+	{
+	  name++;
+	  prev = pos;
+	}
+      SAIS_SET(SA, ss, m + pos / 2, name - 1);
+    }
+  for (i = j = n - 1; i >= m; i--)
+    if (SAIS_GET(SA, ss, i) >= 0)
+      {
+	SAIS_SET(SA, ss, j, SAIS_GET(SA, ss, i));
+	j--;
+      }
+
+  /* stage 2: sort the reduced problem */
+  s1 = (unsigned char *)SA + (n - m) * ss;
+  if (name < m)
+    {
+      free(B);
+      B = 0;
+      if (!sais_main(s1, ss, SA, ss, m, name))
+	{
+	  free(t);
+	  return 0;
+	}
+      if ((B = malloc(ss * k)) == 0)
+	{
+	  free(t);
+	  return 0;
+	}
+    }
+  else
+    for (i = 0; i < m; i++)
+      SAIS_SET(SA, ss, SAIS_GET(s1, ss, i), i);
+
+  /* stage 3: induce the result from the sorted LMS suffixes */
+  for (i = 1, j = 0; i < n; i++)
+    if (SAIS_ISLMS(t, i))
+      SAIS_SET(s1, ss, j++, i);
+  for (i = 0; i < m; i++)
+    SAIS_SET(SA, ss, i, SAIS_GET(s1, ss, SAIS_GET(SA, ss, i)));
+  for (i = m; i < n; i++)
+    SAIS_SET(SA, ss, i, -1);
+  sais_buckets(T, cs, n, B, ss, k, 1);
+  for (i = m - 1; i >= 0; i--)
+    {
+      j = SAIS_GET(SA, ss, i);
+      SAIS_SET(SA, ss, i, -1);
+      sais_putend(SA, B, ss, SAIS_CHR(T, cs, j), j);
+    }
+  sais_induce(T, cs, SA, ss, n, k, t, B);
+  free(B);
+  free(t);
+  return 1;
+}
+
+static void *sais_create(unsigned char *buf, bsuint ulen, int mode)
+{
+  struct suf_data *sd;
+  bsint i, len;
+  void *I;
+  int ss;
+
+  len = ulen;
+  if (len < 0)
+    return 0;
+  sd = calloc(1, sizeof(*sd));
+  if (!sd)
+    return 0;
+  ss = ulen < 0x7fffffff ? sizeof(int) : sizeof(bsint);
+  I = malloc(ss * ((size_t)len + 1));
+  if (!I)
+    {
+      free(sd);
+      return 0;
+    }
+  /* I[0] is the empty suffix, F[c] + 1 is the first suffix starting with c */
+  SAIS_SET(I, ss, 0, len);
+  if (!sais_main(buf, 1, (unsigned char *)I + ss, ss, len, 256))
+    {
+      free(I);
+      free(sd);
+      return 0;
+    }
+  if (ss == sizeof(int))
+    {
+      sd->I.lo = I;
+      sd->I.hi = 0;
+    }
+  else if (!offpack(&sd->I, I, len + 1, len))
+    {
+      free(I);
+      free(sd);
+      return 0;
+    }
+  memset(sd->F, 0, sizeof(sd->F));
+  for (i = 0; i < len; i++)
+    sd->F[buf[i] + 1]++;
+  for (i = 1; i < 257; i++)
+    sd->F[i] += sd->F[i - 1];
+  return sd;
+}
+
+#endif /* BSDIFF_NO_SUF */
+
+/******************************************************************/
+
+struct deltamode {
+  int mode;
+  void *(*create)(unsigned char *buf, bsuint len, int mode);
+  bsuint (*findnext)(void *data, unsigned char *old, bsuint oldlen, unsigned char *new, bsuint newlen, bsuint lastoffset, bsuint scan, bsuint *posp, bsuint *lenp);
+  void (*free)(void *data);
+  char *indexname;	/* modes with the same index share the cache */
+  int (*save)(void *data, bsuint len, FILE *fp);
+  void *(*load)(void *map, size_t maplen, size_t off, bsuint len, int mode);
+  /* sliding window support, optional */
+  void *(*alloc)(bsuint maxlen, int mode);
+  bsuint (*append)(void *data, unsigned char *buf, bsuint off, bsuint len);
+  void (*discard)(void *data, bsuint move);
+};
+
+struct deltamode deltamodes[] =
+{
+#ifndef BSDIFF_NO_SUF
+  {DELTAMODE_SUF, suf_create, suf_findnext, suf_free, "suf", suf_save, suf_load}, 
+  {DELTAMODE_SAIS, sais_create, suf_findnext, suf_free, "suf", suf_save, suf_load},
 #endif
 #ifndef BSDIFF_NO_HASH
-  {DELTAMODE_HASH, hash_create, hash_findnext, hash_free},
+  {DELTAMODE_HASH, hash_create, hash_findnext, hash_free, "hash", hash_save, hash_load, hash_alloc, hash_append, hash_discard},
 #endif
 };
 
-static void addoff(struct bzblock *bzi, bsint off)
+static void addoff(struct block *blk, bsint off)
 {
   int i, sign = 0;
   unsigned char b[8];
@@ -799,88 +1447,313 @@ static void addoff(struct bzblock *bzi, bsint off)
       off >>= 8;
     }
   b[7] = sign | (off & 0xff);
-  blockwrite(bzi, b, 8);
+  blockwrite(blk, b, 8);
 }
 
-void mkdiff(int mode,
-            unsigned char *old, bsuint oldlen,
-            unsigned char *new, bsuint newlen,
-            struct instr **instrp, int *instrlenp,
-            unsigned char **instrblkp, unsigned int *instrblklenp,
-            unsigned char **addblkp, unsigned int *addblklenp,
-            unsigned char **extrablkp, unsigned int *extrablklenp)
+static struct deltamode *finddeltamode(int mode)
 {
-  struct instr *instr = 0;
-  int instrlen = 0;
-  bsuint i, scan, pos, len;
-  bsuint lastscan, lastpos, lastoffset;
-  bsuint s, Sf, lenf, Sb, lenb;
-  bsuint overlap, Ss, lens;
-  struct bzblock *bza = 0;
-  struct bzblock *bze = 0;
-  struct bzblock *bzi = 0;
-  void *data;
-  struct deltamode *dm;
-  int noaddblk = 0;
+  int i;
 
-  if ((mode & DELTAMODE_NOADDBLK) != 0)
-    {
-      mode ^= DELTAMODE_NOADDBLK;
-      noaddblk = 1;
-    }
-  dm = 0;
   for (i = 0; i < sizeof(deltamodes)/sizeof(*deltamodes); i++)
+    if (deltamodes[i].mode == mode)
+      return deltamodes + i;
+  fprintf(stderr, "mkdiff: no mode installed\n");
+  exit(1);
+}
+
+/******************************************************************/
+/*                                                                */
+/*         index cache                                            */
+/*                                                                */
+/******************************************************************/
+
+/*
+ * The index of an old payload can be saved to a cache directory
+ * and mapped in again by later runs. The cache files are named
+ * after the md5 of the old data and the index type.
+ */
+
+struct indexhead {
+  char magic[4];
+  unsigned int version;
+  unsigned int wordsize;
+  unsigned int param;
+  unsigned long long len;
+  unsigned char md5[16];
+};
+
+#define INDEXCACHE_VERSION 2
+
+static char *indexcachedir;
+
+void mkdiff_indexcache(char *dir)
+{
+  indexcachedir = dir;
+}
+
+static void *loadindex(struct deltamode *dm, char *fn, struct indexhead *ih, int mode)
+{
+  struct stat st;
+  void *map, *data;
+  int fd;
+
+  if ((fd = open(fn, O_RDONLY)) == -1)
+    return 0;
+  if (fstat(fd, &st) || st.st_size < sizeof(*ih) || (size_t)st.st_size != st.st_size)
     {
-      dm = deltamodes + i;
-      if (deltamodes[i].mode == mode)
-	break;
+      close(fd);
+      return 0;
     }
-  if (!dm)
+  map = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED)
+    return 0;
+  if (memcmp(map, ih, sizeof(*ih)) || (data = dm->load(map, st.st_size, sizeof(*ih), ih->len, mode)) == 0)
     {
-      fprintf(stderr, "mkdiff: no mode installed\n");
-      exit(1);
+      munmap(map, st.st_size);
+      return 0;
     }
-  if (addblkp)
+  return data;
+}
+
+static void saveindex(struct deltamode *dm, void *data, char *fn, struct indexhead *ih)
+{
+  char *tmp;
+  FILE *fp;
+  int fd;
+
+  if ((tmp = malloc(strlen(fn) + 8)) == 0)
+    return;
+  sprintf(tmp, "%s.XXXXXX", fn);
+  if ((fd = mkstemp(tmp)) == -1)
     {
-      *addblkp = 0;
-      *addblklenp = 0;
+      free(tmp);
+      return;
     }
-  if (extrablkp)
+  if ((fp = fdopen(fd, "w")) == 0)
     {
-      *extrablkp = 0;
-      *extrablklenp = 0;
+      close(fd);
+      unlink(tmp);
+      free(tmp);
+      return;
     }
-  if (instrblkp)
+  fchmod(fd, 0644);
+  if (fwrite(ih, sizeof(*ih), 1, fp) != 1 || !dm->save(data, ih->len, fp) || fclose(fp))
+    unlink(tmp);
+  else if (rename(tmp, fn))
+    unlink(tmp);
+  free(tmp);
+}
+
+static void *createindex(struct deltamode *dm, unsigned char *old, bsuint oldlen, int mode)
+{
+  struct indexhead ih;
+  MD5_CTX md5;
+  bsuint off;
+  char *fn;
+  void *data;
+  int i;
+
+  if (!indexcachedir)
+    return dm->create(old, oldlen, mode);
+  memset(&ih, 0, sizeof(ih));
+  memcpy(ih.magic, "DRIX", 4);
+  ih.version = INDEXCACHE_VERSION;
+  ih.wordsize = sizeof(bsint);
+#ifndef BSDIFF_NO_HASH
+  if (DELTAMODE_METHOD(mode) == DELTAMODE_HASH)
+    ih.param = hash_shift(mode) | hash_density(mode) << 8;
+#endif
+  ih.len = oldlen;
+  rpmMD5Init(&md5);
+  for (off = 0; off < oldlen; off += 0x40000000)
+    rpmMD5Update(&md5, old + off, oldlen - off > 0x40000000 ? 0x40000000 : oldlen - off);
+  rpmMD5Final(ih.md5, &md5);
+  if ((fn = malloc(strlen(indexcachedir) + 32 + strlen(dm->indexname) + 3)) == 0)
+    return dm->create(old, oldlen, mode);
+  sprintf(fn, "%s/", indexcachedir);
+  for (i = 0; i < 16; i++)
+    sprintf(fn + strlen(fn), "%02x", ih.md5[i]);
+  sprintf(fn + strlen(fn), ".%s", dm->indexname);
+  if ((data = loadindex(dm, fn, &ih, mode)) == 0)
     {
-      *instrblkp = 0;
-      *instrblklenp = 0;
+      data = dm->create(old, oldlen, mode);
+      if (data)
+	saveindex(dm, data, fn, &ih);
     }
-  if (!noaddblk && addblkp && (bza = blockopen()) == 0)
+  free(fn);
+  return data;
+}
+
+int mkdiff_str2mode(char *name)
+{
+  int i, mode = -1;
+
+  if (!strcmp(name, "suf"))
+    mode = DELTAMODE_SUF;
+  else if (!strcmp(name, "hash"))
+    mode = DELTAMODE_HASH;
+  else if (!strcmp(name, "sais"))
+    mode = DELTAMODE_SAIS;
+  for (i = 0; i < sizeof(deltamodes)/sizeof(*deltamodes); i++)
+    if (deltamodes[i].mode == mode)
+      return mode;
+  return -1;
+}
+
+/* parse "window[,density]" for the hash method */
+int mkdiff_str2hashparams(char *str)
+{
+  char *p;
+  long window, density = 0;
+  int shift;
+
+  window = strtol(str, &p, 10);
+  if (*p == ',')
     {
-      fprintf(stderr, "mkdiff: could not create compression stream\n");
-      exit(1);
+      density = strtol(p + 1, &p, 10);
+      if (density < 1 || density > 15)
+	return -1;
     }
-  if (extrablkp && (bze = blockopen()) == 0)
+  if (*p)
+    return -1;
+  for (shift = 2; shift < 8; shift++)
+    if (window == 1 << shift)
+      return DELTAMODE_MKHASH(shift, density);
+  return -1;
+}
+
+/******************************************************************/
+/*                                                                */
+/*         scanning                                               */
+/*                                                                */
+/******************************************************************/
+
+static struct mkdiff_stats *mkdiffstats;
+
+void mkdiff_stats(struct mkdiff_stats *stats)
+{
+  mkdiffstats = stats;
+}
+
+static unsigned long long usecs()
+{
+  struct timeval tv;
+
+  gettimeofday(&tv, 0);
+  return (unsigned long long)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+struct scanstate {
+  struct instr *instr;
+  bsuint instrlen;
+  bsuint lastscan;
+  bsuint lastpos;
+};
+
+static void addinstr(struct scanstate *st, bsuint copyout, bsuint copyin, bsuint copyinoff, bsuint copyoutoff)
+{
+  if ((st->instrlen & 31) == 0)
     {
-      fprintf(stderr, "mkdiff: could not create compression stream\n");
-      exit(1);
+      if (st->instr)
+	st->instr = realloc(st->instr, sizeof(*st->instr) * (st->instrlen + 32));
+      else
+	st->instr = malloc(sizeof(*st->instr) * (st->instrlen + 32));
+      if (!st->instr)
+	{
+	  fprintf(stderr, "out of memory\n");
+	  exit(1);
+	}
     }
-  if (instrblkp && (bzi = blockopen()) == 0)
+  st->instr[st->instrlen].copyout = copyout;
+  st->instr[st->instrlen].copyin = copyin;
+  st->instr[st->instrlen].copyinoff = copyinoff;
+  st->instr[st->instrlen].copyoutoff = copyoutoff;
+  st->instrlen++;
+}
+
+/* extend old match forward */
+static bsuint extendforward(unsigned char *old, bsuint oldlen, unsigned char *new, bsuint lastscan, bsuint lastpos, bsuint scan, int noaddblk)
+{
+  bsuint i, n, r, s, Sf, lenf;
+
+  n = lastpos < oldlen ? oldlen - lastpos : 0;
+  if (scan < lastscan)
+    n = 0;
+  else if (n > scan - lastscan)
+    n = scan - lastscan;
+  if (noaddblk)
+    return bytesrun_fwd(old + lastpos, new + lastscan, n, 1);
+  /* the score only grows inside runs of matching bytes, so it is
+   * enough to check it at the end of each run */
+  s = Sf = lenf = 0;
+  for (i = 0; i < n; )
     {
-      fprintf(stderr, "mkdiff: could not create compression stream\n");
-      exit(1);
+      r = bytesrun_fwd(old + lastpos + i, new + lastscan + i, n - i, 1);
+      if (r)
+	{
+	  s += r;
+	  i += r;
+	  if (s >= Sf + i - s)
+	    {
+	      Sf = 2 * s - i;
+	      lenf = i;
+	    }
+	}
+      if (i < n)
+	i += bytesrun_fwd(old + lastpos + i, new + lastscan + i, n - i, 0);
     }
-  data = dm->create(old, oldlen);
-  if (!data)
+  return lenf;
+}
+
+/* extend new match backward */
+static bsuint extendbackward(unsigned char *old, unsigned char *new, bsuint lastscan, bsuint scan, bsuint pos)
+{
+  bsuint i, n, r, s, Sb, lenb;
+
+  n = pos;
+  if (scan < lastscan)
+    n = 0;
+  else if (n > scan - lastscan)
+    n = scan - lastscan;
+  s = Sb = lenb = 0;
+  for (i = 0; i < n; )
     {
-      fprintf(stderr, "mkdiff: could not create data\n");
-      exit(1);
+      r = bytesrun_bwd(old + pos - i, new + scan - i, n - i, 1);
+      if (r)
+	{
+	  s += r;
+	  i += r;
+	  if (s >= Sb + i - s)
+	    {
+	      Sb = 2 * s - i;
+	      lenb = i;
+	    }
+	}
+      if (i < n)
+	i += bytesrun_bwd(old + pos - i, new + scan - i, n - i, 0);
     }
+  return lenb;
+}
+
+/*
+ * create the instructions for new[start...] until lastscan
+ * reaches end. The last match may extend beyond end.
+ */
+static void scanrange(struct deltamode *dm, void *data, int noaddblk,
+                      unsigned char *old, bsuint oldlen,
+                      unsigned char *new, bsuint newlen,
+                      bsuint start, bsuint end, struct scanstate *st)
+{
+  bsuint i, scan, pos, len;
+  bsuint lastscan, lastpos, lastoffset;
+  bsuint s, lenf, Sb, lenb;
+  bsuint overlap, Ss, lens;
 
-  scan = 0; len = 0; lenf = 0;
-  lastscan = 0; lastpos = 0;
+  scan = start; len = 0;
+  lastscan = start; lastpos = st->lastpos;
 
-  while (lastscan < newlen)
+  while (lastscan < end)
     {
       /* search for data matching something in new[scan...]
        * input:
@@ -895,52 +1768,10 @@ void mkdiff(int mode,
       lastoffset = noaddblk ? oldlen : lastpos - lastscan;
       scan = dm->findnext(data, old, oldlen, new, newlen, lastoffset, scan, &pos, &len);
 
-      /* extand old match forward */
-      if (!noaddblk)
-	{
-	  s = Sf = lenf = 0;
-	  for (i = 0; lastscan + i < scan && lastpos + i < oldlen; )
-	    {
-	      if (old[lastpos+i] == new[lastscan+i])
-		{
-		  s++;
-		  i++;
-		  if (s >= Sf + i - s)
-		    {
-		      Sf = 2 * s - i;
-		      lenf = i;
-		    }
-		}
-	      else
-	        i++;
-	    }
-	}
-      else
-	{
-	  for (i = 0; lastscan + i < scan && lastpos + i < oldlen; i++)
-	    if (old[lastpos+i] != new[lastscan+i])
-	      break;
-	  lenf = i;
-	}
+      lenf = extendforward(old, oldlen, new, lastscan, lastpos, scan, noaddblk);
 
-      lenb = 0;
-      /* extand new match backward, scan == newlen means we're going to finish */
-      if (!noaddblk && scan < newlen)
-	{
-	  s = Sb = 0;
-	  for(i = 1; scan >= lastscan + i && pos >= i; i++)
-	    {
-	      if (old[pos-i] == new[scan-i])
-		{
-		  s++;
-		  if(s >= Sb + i - s)
-		    {
-		      Sb = 2 * s - i;
-		      lenb = i;
-		    }
-		}
-	    }
-	}
+      /* scan == newlen means we're going to finish */
+      lenb = !noaddblk && scan < newlen ? extendbackward(old, new, lastscan, scan, pos) : 0;
 
       /* if there is an overlap find good place to split */
       if (lastscan + lenf > scan - lenb)
@@ -975,96 +1806,574 @@ void mkdiff(int mode,
        *      lastpos                          pos
        */
 
-      if (instrp)
+      addinstr(st, lenf, (scan - lenb) - (lastscan + lenf), lastscan + lenf, lastpos);
+
+      /* advance */
+      lastscan = scan - lenb;
+      lastpos = pos - lenb;
+      scan += len;
+    }
+  st->lastscan = lastscan;
+  st->lastpos = lastpos;
+}
+
+/*
+ * chunked scanning: every chunk of new is scanned independently,
+ * starting at the chunk border. The instructions of a chunk are
+ * used from the first one that starts after the data covered by
+ * the previous chunks, the gap is filled with a bridge
+ * instruction. The result only depends on the chunk size, not on
+ * the number of threads.
+ */
+
+struct scanjob {
+  struct deltamode *dm;
+  void *data;
+  int noaddblk;
+  unsigned char *old, *new;
+  bsuint oldlen, newlen;
+  bsuint chunk;
+  struct scanstate *st;
+  int nchunks;
+  int first, step;
+#ifndef BSDIFF_NO_THREADS
+  pthread_t tid;
+  int started;
+#endif
+};
+
+static void *scanjob_run(void *arg)
+{
+  struct scanjob *job = arg;
+  bsuint start, end;
+  int c;
+
+  for (c = job->first; c < job->nchunks; c += job->step)
+    {
+      start = c * job->chunk;
+      end = start + job->chunk < job->newlen ? start + job->chunk : job->newlen;
+      job->st[c].lastpos = start < job->oldlen ? start : 0;
+      scanrange(job->dm, job->data, job->noaddblk, job->old, job->oldlen, job->new, job->newlen, start, end, job->st + c);
+    }
+  return 0;
+}
+
+static void scanchunked(struct deltamode *dm, void *data, int noaddblk,
+                        unsigned char *old, bsuint oldlen,
+                        unsigned char *new, bsuint newlen,
+                        bsuint chunk, int threads, struct scanstate *res)
+{
+  struct scanstate *st;
+  struct scanjob *jobs;
+  bsuint k, lastscan, lastpos, start, lenf;
+  int c, nchunks;
+
+  nchunks = (newlen + chunk - 1) / chunk;
+  if (threads > nchunks)
+    threads = nchunks;
+  st = calloc(nchunks, sizeof(*st));
+  jobs = calloc(threads, sizeof(*jobs));
+  if (!st || !jobs)
+    {
+      fprintf(stderr, "out of memory\n");
+      exit(1);
+    }
+  for (c = 0; c < threads; c++)
+    {
+      jobs[c].dm = dm;
+      jobs[c].data = data;
+      jobs[c].noaddblk = noaddblk;
+      jobs[c].old = old;
+      jobs[c].oldlen = oldlen;
+      jobs[c].new = new;
+      jobs[c].newlen = newlen;
+      jobs[c].chunk = chunk;
+      jobs[c].st = st;
+      jobs[c].nchunks = nchunks;
+      jobs[c].first = c;
+      jobs[c].step = threads;
+    }
+#ifndef BSDIFF_NO_THREADS
+  for (c = 1; c < threads; c++)
+    jobs[c].started = pthread_create(&jobs[c].tid, 0, scanjob_run, jobs + c) == 0;
+  scanjob_run(jobs);
+  for (c = 1; c < threads; c++)
+    {
+      if (jobs[c].started)
+	pthread_join(jobs[c].tid, 0);
+      else
+	scanjob_run(jobs + c);
+    }
+#else
+  for (c = 0; c < threads; c++)
+    scanjob_run(jobs + c);
+#endif
+
+  /* stitch */
+  *res = st[0];
+  lastscan = st[0].lastscan;
+  lastpos = st[0].lastpos;
+  for (c = 1; c < nchunks && lastscan < newlen; c++)
+    {
+      for (k = 0; k < st[c].instrlen; k++)
+	if (st[c].instr[k].copyinoff - st[c].instr[k].copyout >= lastscan)
+	  break;
+      if (mkdiffstats)
+	mkdiffstats->stitchdropped += k;
+      if (k < st[c].instrlen)
+	{
+	  start = st[c].instr[k].copyinoff - st[c].instr[k].copyout;
+	  if (start > lastscan)
+	    {
+	      lenf = extendforward(old, oldlen, new, lastscan, lastpos, start, noaddblk);
+	      addinstr(res, lenf, start - (lastscan + lenf), lastscan + lenf, lastpos);
+	      if (mkdiffstats)
+		{
+		  mkdiffstats->stitched += start - lastscan;
+		  mkdiffstats->stitchin += start - (lastscan + lenf);
+		}
+	    }
+	  for (; k < st[c].instrlen; k++)
+	    addinstr(res, st[c].instr[k].copyout, st[c].instr[k].copyin, st[c].instr[k].copyinoff, st[c].instr[k].copyoutoff);
+	  lastscan = st[c].lastscan;
+	  lastpos = st[c].lastpos;
+	}
+      free(st[c].instr);
+    }
+  for (; c < nchunks; c++)
+    free(st[c].instr);
+  if (lastscan < newlen)
+    {
+      lenf = extendforward(old, oldlen, new, lastscan, lastpos, newlen, noaddblk);
+      addinstr(res, lenf, newlen - (lastscan + lenf), lastscan + lenf, lastpos);
+      if (mkdiffstats)
+	{
+	  mkdiffstats->stitched += newlen - lastscan;
+	  mkdiffstats->stitchin += newlen - (lastscan + lenf);
+	}
+      lastpos += lenf;
+      lastscan = newlen;
+    }
+  res->lastscan = lastscan;
+  res->lastpos = lastpos;
+  if (mkdiffstats)
+    mkdiffstats->chunks += nchunks;
+  free(st);
+  free(jobs);
+}
+
+/******************************************************************/
+/*                                                                */
+/*         cost model                                             */
+/*                                                                */
+/******************************************************************/
+
+/*
+ * DELTAMODE_OPTIMIZE: move the borders between the copies and the
+ * copied in data and drop copies that do not pay, so that the
+ * estimated size of the compressed delta gets minimal. The cost of
+ * a byte is its order-0 entropy in the add data or the copied in
+ * data, plus a fixed cost for each instruction. Costs are in 1/16 bit.
+ * The estimate ignores the context the compressors see, so mkdiff
+ * compresses the blocks the caller asks for with both instruction
+ * lists and keeps the smaller result. Callers that store the new data
+ * elsewhere should ask for the extra block with the compression that
+ * data really gets.
+ */
+
+#define COST_INSTR (48 * 16)
+
+struct costmodel {
+  unsigned int lit[256];
+  unsigned int add[256];
+};
+
+/* 16 * log2(x) for x > 0 */
+static unsigned int log2q4(unsigned long long x)
+{
+  unsigned int r, i;
+  unsigned long long y;
+
+  for (r = 0, y = x; y > 1; y >>= 1)
+    r += 16;
+  y = r >= 16 * 16 ? x >> (r / 16 - 16) : x << (16 - r / 16);
+  for (i = 8; i; i >>= 1)
+    {
+      y = y * y >> 16;
+      if (y >= 2 << 16)
+	{
+	  y >>= 1;
+	  r += i;
+	}
+    }
+  return r;
+}
+
+static void costmodel_init(struct costmodel *cm, unsigned char *old, unsigned char *new, bsuint newlen, struct scanstate *st)
+{
+  unsigned long long lit[256], add[256], nlit = 0, nadd = 0;
+  struct instr *ip;
+  bsuint k, i;
+  int c;
+
+  memset(lit, 0, sizeof(lit));
+  memset(add, 0, sizeof(add));
+  for (k = 0, ip = st->instr; k < st->instrlen; k++, ip++)
+    {
+      unsigned char *np = new + ip->copyinoff - ip->copyout;
+      unsigned char *op = old + ip->copyoutoff;
+      for (i = 0; i < ip->copyout; i++)
+	add[(unsigned char)(np[i] - op[i])]++;
+      for (i = 0; i < ip->copyin; i++)
+	lit[new[ip->copyinoff + i]]++;
+      nadd += ip->copyout;
+      nlit += ip->copyin;
+    }
+  if (nlit < 4096)
+    {
+      /* not enough unmatched data for statistics, use all */
+      for (i = 0; i < newlen; i++)
+	lit[new[i]]++;
+      nlit += newlen;
+    }
+  for (c = 0; c < 256; c++)
+    {
+      cm->lit[c] = log2q4(nlit + 256) - log2q4(lit[c] + 1);
+      cm->add[c] = log2q4(nadd + 256) - log2q4(add[c] + 1);
+    }
+}
+
+/*
+ * Find the cheapest split of the data from the start of the copy of
+ * instruction k to the end of the copy of the next instruction into
+ * a copy with the offset of k, copied in data and a copy with the
+ * offset of the next instruction.
+ */
+static void optimizesplit(struct costmodel *cm, unsigned char *old, bsuint oldlen, unsigned char *new, bsuint newlen, struct instr *ip, struct instr *in, int first)
+{
+  bsuint s, e, b0, x, amax, bmin, mina, besta, bestb;
+  bsuint olda, oldb = 0;
+  long long f, lp, bp, btotal, m, c, best;
+
+  s = ip->copyinoff - ip->copyout;
+  e = in ? in->copyinoff : ip->copyinoff + ip->copyin;
+  b0 = in ? in->copyinoff - in->copyout : e;
+  olda = ip->copyoutoff - s;	/* new pos + olda is the old pos, mod 2^n */
+  amax = oldlen - ip->copyoutoff < e - s ? s + (oldlen - ip->copyoutoff) : e;
+  bmin = e;
+  btotal = 0;
+  if (in)
+    {
+      oldb = in->copyoutoff - b0;
+      bmin = b0 - s > in->copyoutoff ? b0 - in->copyoutoff : s;
+      for (x = bmin; x < e; x++)
+	btotal += cm->add[(unsigned char)(new[x] - old[x + oldb])];
+    }
+  f = lp = bp = 0;
+  m = best = 0;
+  mina = besta = s;
+  bestb = e;
+  for (x = s; ; x++)
+    {
+      if (x <= amax)
+	{
+	  c = f - lp;
+	  if (x == s && ip->copyout && !first)
+	    c -= COST_INSTR;	/* merged into the previous instruction */
+	  if (x == s || c < m)
+	    {
+	      m = c;
+	      mina = x;
+	    }
+	}
+      if (x >= bmin)
+	{
+	  c = m + lp + btotal - bp;
+	  if (in && x == e && in->copyout)
+	    c -= COST_INSTR;
+	  if (x == bmin || c < best)
+	    {
+	      best = c;
+	      besta = mina;
+	      bestb = x;
+	    }
+	}
+      if (x == e)
+	break;
+      if (x < amax)
+	f += cm->add[(unsigned char)(new[x] - old[x + olda])];
+      lp += cm->lit[new[x]];
+      if (x >= bmin)
+	bp += cm->add[(unsigned char)(new[x] - old[x + oldb])];
+    }
+  ip->copyout = besta - s;
+  ip->copyinoff = besta;
+  ip->copyin = bestb - besta;
+  if (in)
+    {
+      in->copyoutoff = bestb + oldb;
+      in->copyout = e - bestb;
+    }
+}
+
+static void optimizeinstr(unsigned char *old, bsuint oldlen, unsigned char *new, bsuint newlen, struct scanstate *st)
+{
+  struct costmodel cm;
+  struct instr *ip;
+  bsuint k, n;
+  int round;
+
+  costmodel_init(&cm, old, new, newlen, st);
+  for (round = 0; round < 2; round++)
+    {
+      for (k = 0; k < st->instrlen; k++)
+	optimizesplit(&cm, old, oldlen, new, newlen, st->instr + k, k + 1 < st->instrlen ? st->instr + k + 1 : 0, k == 0);
+      /* join instructions without copy with the previous one */
+      for (k = n = 0, ip = st->instr; k < st->instrlen; k++, ip++)
+	{
+	  if (!ip->copyout && n)
+	    st->instr[n - 1].copyin += ip->copyin;
+	  else if (ip->copyout || ip->copyin)
+	    st->instr[n++] = *ip;
+	}
+      st->instrlen = n;
+    }
+}
+
+/*
+ * Write the instruction, add and extra blocks of the instructions in
+ * st. Only the blocks with a result pointer are created.
+ */
+static void mkblocks(struct scanstate *st, unsigned char *old, unsigned char *new,
+                     unsigned char **instrblkp, unsigned int *instrblklenp,
+                     unsigned char **addblkp, unsigned int *addblklenp,
+                     unsigned char **extrablkp, unsigned int *extrablklenp)
+{
+  struct instr *ip;
+  bsuint i, k, s, lastscan, lastpos, lenf, nextpos;
+  struct block *blka = 0;
+  struct block *blke = 0;
+  struct block *blki = 0;
+
+  if (addblkp && (blka = blockopen(addblkcomp)) == 0)
+    {
+      fprintf(stderr, "mkdiff: could not create compression stream\n");
+      exit(1);
+    }
+  if (extrablkp && (blke = blockopen(extrablkcomp)) == 0)
+    {
+      fprintf(stderr, "mkdiff: could not create compression stream\n");
+      exit(1);
+    }
+  if (instrblkp && (blki = blockopen(instrblkcomp)) == 0)
+    {
+      fprintf(stderr, "mkdiff: could not create compression stream\n");
+      exit(1);
+    }
+  for (k = 0; k < st->instrlen; k++)
+    {
+      ip = st->instr + k;
+      lenf = ip->copyout;
+      lastscan = ip->copyinoff - lenf;
+      lastpos = ip->copyoutoff;
+      nextpos = k + 1 < st->instrlen ? ip[1].copyoutoff : st->lastpos;
+      if (blki)
+	{
+	  addoff(blki, lenf);
+	  addoff(blki, ip->copyin);
+	  addoff(blki, nextpos - (lastpos + lenf));
+	}
+      if (blke)
+	{
+	  i = ip->copyinoff;
+	  s = ip->copyin;
+	  while (s > 0)
+	    {
+	      int len2 = s > 0x40000000 ? 0x40000000 : s;
+	      blockwrite(blke, new + i, len2);
+	      i += len2;
+	      s -= len2;
+	    }
+	}
+      if (blka)
+	{
+	  while (lenf > 0)
+	    {
+	      unsigned char addblk[4096];
+	      int len2;
+	      len2 = lenf > 4096 ? 4096 : lenf;
+	      for (i = 0; i < len2; i++)
+		addblk[i] = new[lastscan + i] - old[lastpos + i];
+	      if (blockwrite(blka, addblk, len2) != len2)
+		{
+		  fprintf(stderr, "could not append to data block\n");
+		  exit(1);
+		}
+	      lastscan += len2;
+	      lastpos += len2;
+	      lenf -= len2;
+	    }
+	}
+    }
+  if (blka && blockclose(blka, addblkp, addblklenp))
+    {
+      fprintf(stderr, "could not close data block\n");
+      exit(1);
+    }
+  if (blke && blockclose(blke, extrablkp, extrablklenp))
+    {
+      fprintf(stderr, "could not close extra block\n");
+      exit(1);
+    }
+  if (blki && blockclose(blki, instrblkp, instrblklenp))
+    {
+      fprintf(stderr, "could not close instr block\n");
+      exit(1);
+    }
+}
+
+void mkdiff(int mode,
+            unsigned char *old, bsuint oldlen,
+            unsigned char *new, bsuint newlen,
+            struct instr **instrp, int *instrlenp,
+            unsigned char **instrblkp, unsigned int *instrblklenp,
+            unsigned char **addblkp, unsigned int *addblklenp,
+            unsigned char **extrablkp, unsigned int *extrablklenp)
+{
+  struct scanstate st, ost;
+  unsigned char *blk[6];
+  unsigned int blklen[6];
+  bsuint k, chunk;
+  void *data;
+  struct deltamode *dm;
+  int noaddblk = 0;
+  int optimize = 0;
+  int w;
+  unsigned long long t = 0;
+
+  if ((mode & DELTAMODE_NOADDBLK) != 0)
+    {
+      mode ^= DELTAMODE_NOADDBLK;
+      noaddblk = 1;
+    }
+  if ((mode & DELTAMODE_OPTIMIZE) != 0)
+    {
+      mode ^= DELTAMODE_OPTIMIZE;
+      optimize = 1;
+    }
+  dm = finddeltamode(DELTAMODE_METHOD(mode));
+  initbytesrun();
+  if (addblkp)
+    {
+      *addblkp = 0;
+      *addblklenp = 0;
+    }
+  if (extrablkp)
+    {
+      *extrablkp = 0;
+      *extrablklenp = 0;
+    }
+  if (instrblkp)
+    {
+      *instrblkp = 0;
+      *instrblklenp = 0;
+    }
+  if (mkdiffstats)
+    t = usecs();
+  data = createindex(dm, old, oldlen, mode);
+  if (!data)
+    {
+      fprintf(stderr, "mkdiff: could not create data\n");
+      exit(1);
+    }
+  if (mkdiffstats)
+    {
+      mkdiffstats->indexusecs += usecs() - t;
+      t = usecs();
+    }
+
+  memset(&st, 0, sizeof(st));
+  chunk = (bsuint)DELTAMODE_CHUNK(mode) << 20;
+  if (chunk && newlen > chunk)
+    scanchunked(dm, data, noaddblk, old, oldlen, new, newlen, chunk, DELTAMODE_THREADS(mode) ? DELTAMODE_THREADS(mode) : 1, &st);
+  else
+    scanrange(dm, data, noaddblk, old, oldlen, new, newlen, 0, newlen, &st);
+  dm->free(data);
+  ost.instr = 0;
+  if (optimize && !noaddblk)
+    {
+      ost = st;
+      ost.instr = malloc(sizeof(*st.instr) * (st.instrlen ? st.instrlen : 1));
+      if (!ost.instr)
 	{
-	  if ((instrlen & 31) == 0)
-	    {
-	      if (instr)
-	        instr = realloc(instr, sizeof(*instr) * (instrlen + 32));
-	      else
-	        instr = malloc(sizeof(*instr) * (instrlen + 32));
-	      if (!instr)
-		{
-		  fprintf(stderr, "out of memory\n");
-		  exit(1);
-		}
-	    }
-	  instr[instrlen].copyout = lenf;
-	  instr[instrlen].copyin = (scan - lenb) - (lastscan + lenf);
-	  instr[instrlen].copyinoff = lastscan + lenf;
-	  instr[instrlen].copyoutoff = lastpos;
-	  instrlen++;
+	  fprintf(stderr, "out of memory\n");
+	  exit(1);
 	}
-      if (bzi)
+      memcpy(ost.instr, st.instr, sizeof(*st.instr) * st.instrlen);
+      optimizeinstr(old, oldlen, new, newlen, &ost);
+    }
+  if (mkdiffstats)
+    mkdiffstats->scanusecs += usecs() - t;
+
+  if (ost.instr)
+    {
+      /* the cost model is only an estimate, keep the new split only
+         if the requested compressed blocks really get smaller */
+      memset(blk, 0, sizeof(blk));
+      memset(blklen, 0, sizeof(blklen));
+      for (w = 0; w < 6; w += 3)
+	mkblocks(w ? &ost : &st, old, new, instrblkp ? blk + w : 0, blklen + w, addblkp ? blk + w + 1 : 0, blklen + w + 1, extrablkp ? blk + w + 2 : 0, blklen + w + 2);
+      w = blklen[3] + blklen[4] + blklen[5] < blklen[0] + blklen[1] + blklen[2] ? 3 : 0;
+      if (w)
 	{
-	  addoff(bzi, lenf);
-	  addoff(bzi, (scan - lenb) - (lastscan + lenf));
-	  addoff(bzi, (pos - lenb) - (lastpos + lenf));
+	  free(st.instr);
+	  st = ost;
 	}
-      if (bze)
+      else
+	free(ost.instr);
+      if (instrblkp)
 	{
-	  i = lastscan + lenf;
-	  s = (scan - lenb) - i;
-	  while (s > 0)
-	    {
-	      int len2 = s > 0x40000000 ? 0x40000000 : s;
-	      blockwrite(bze, new + i, len2);
-	      i += len2;
-	      s -= len2;
-	    }
+	  *instrblkp = blk[w];
+	  *instrblklenp = blklen[w];
+	  blk[w] = 0;
 	}
-      if (bza)
+      if (addblkp)
 	{
-	  while (lenf > 0)
-	    {
-	      unsigned char addblk[4096];
-	      int len2;
-	      len2 = lenf > 4096 ? 4096 : lenf;
-	      for (i = 0; i < len2; i++)
-		addblk[i] = new[lastscan + i] - old[lastpos + i];
-	      if (blockwrite(bza, addblk, len2) != len2)
-		{
-		  fprintf(stderr, "could not append to data block\n");
-		  exit(1);
-		}
-	      lastscan += len2;
-	      lastpos += len2;
-	      lenf -= len2;
-	    }
+	  *addblkp = blk[w + 1];
+	  *addblklenp = blklen[w + 1];
+	  blk[w + 1] = 0;
 	}
-
-      /* advance */
-      lastscan = scan - lenb;
-      lastpos = pos - lenb;
-      scan += len;
-    }
-  if (bza && blockclose(bza, addblkp, addblklenp))
-    {
-      fprintf(stderr, "could not close data block\n");
-      exit(1);
-    }
-  if (bze && blockclose(bze, extrablkp, extrablklenp))
-    {
-      fprintf(stderr, "could not close extra block\n");
-      exit(1);
+      if (extrablkp)
+	{
+	  *extrablkp = blk[w + 2];
+	  *extrablklenp = blklen[w + 2];
+	  blk[w + 2] = 0;
+	}
+      for (w = 0; w < 6; w++)
+	free(blk[w]);
     }
-  if (bzi && blockclose(bzi, instrblkp, instrblklenp))
+  else
+    mkblocks(&st, old, new, instrblkp, instrblklenp, noaddblk ? 0 : addblkp, addblklenp, extrablkp, extrablklenp);
+  if (mkdiffstats)
     {
-      fprintf(stderr, "could not close instr block\n");
-      exit(1);
+      for (k = 0; k < st.instrlen; k++)
+	mkdiffstats->copyin += st.instr[k].copyin;
+      mkdiffstats->instrs += st.instrlen;
     }
   if (instrp)
     {
-      *instrp = instr;
-      *instrlenp = instrlen;
+      *instrp = st.instr;
+      *instrlenp = st.instrlen;
     }
-  dm->free(data);
+  else
+    free(st.instr);
 }
 
 struct stepdata {
   struct deltamode *dm;
   void *data;
   int noaddblk;
+  int mode;
 };
 
 void *
@@ -1073,110 +2382,46 @@ mkdiff_step_setup(int mode)
   int noaddblk = 0;
   struct stepdata *sd;
   struct deltamode *dm;
-  int i;
 
   if ((mode & DELTAMODE_NOADDBLK) != 0)
     {
       mode ^= DELTAMODE_NOADDBLK;
       noaddblk = 1;
     }
-  dm = 0;
-  for (i = 0; i < sizeof(deltamodes)/sizeof(*deltamodes); i++)
-    {
-      dm = deltamodes + i;
-      if (deltamodes[i].mode == mode)
-	break;
-    }
-  if (!dm)
-    {
-      fprintf(stderr, "mkdiff: no mode installed\n");
-      exit(1);
-    }
+  dm = finddeltamode(DELTAMODE_METHOD(mode));
+  initbytesrun();
   sd = calloc(1, sizeof(*sd));
   if (!sd)
     return 0;
   sd->dm = dm;
   sd->data = 0;
   sd->noaddblk = noaddblk;
+  sd->mode = mode;
   return sd;
 }
 
-void
-mkdiff_step(void *sdata,
-            unsigned char *old, bsuint oldlen,
-            unsigned char *new, bsuint newlen,
-            struct instr *instr,
-	    bsuint *scanp, bsuint *lastposp, bsuint *lastscanp)
-  
+static void
+stepinstr(struct deltamode *dm, void *data, int noaddblk,
+          unsigned char *old, bsuint oldlen,
+          unsigned char *new, bsuint newlen,
+          struct instr *instr,
+          bsuint *scanp, bsuint *lastposp, bsuint *lastscanp)
 {
-  struct stepdata *sd = sdata;
-  struct deltamode *dm = sd->dm;
   bsuint scan, lastpos, lastscan;
   bsuint pos, len, lastoffset;
-  bsuint s, Sf, lenf, Sb, lenb;
+  bsuint s, lenf, Sb, lenb;
   bsuint overlap, Ss, lens;
   bsuint i;
 
-  if (!sd->data)
-    {
-      sd->data = dm->create(old, oldlen);
-      if (!sd->data)
-	{
-	  fprintf(stderr, "mkdiff: could not create data\n");
-	  exit(1);
-	}
-    }
   scan = *scanp;
   lastscan = *lastscanp;
   lastpos = *lastposp;
 
-  lastoffset = sd->noaddblk ? oldlen : lastpos - lastscan;
-  scan = dm->findnext(sd->data, old, oldlen, new, newlen, lastoffset, scan, &pos, &len);
-  if (!sd->noaddblk)
-    {
-      s = Sf = lenf = 0;
-      for (i = 0; lastscan + i < scan && lastpos + i < oldlen; )
-	{
-	  if (old[lastpos+i] == new[lastscan+i])
-	    {
-	      s++;
-	      i++;
-	      if (s >= Sf + i - s)
-		{
-		  Sf = 2 * s - i;
-		  lenf = i;
-		}
-	    }
-	  else
-	    i++;
-	}
-    }
-  else
-    {
-      for (i = 0; lastscan + i < scan && lastpos + i < oldlen; i++)
-	if (old[lastpos+i] != new[lastscan+i])
-	  break;
-      lenf = i;
-    }
-
-  lenb = 0;
-  /* extand new match backward, scan == newlen means we're going to finish */
-  if (!sd->noaddblk && scan < newlen)
-    {
-      s = Sb = 0;
-      for(i = 1; scan >= lastscan + i && pos >= i; i++)
-	{
-	  if (old[pos-i] == new[scan-i])
-	    {
-	      s++;
-	      if(s >= Sb + i - s)
-		{
-		  Sb = 2 * s - i;
-		  lenb = i;
-		}
-	    }
-	}
-    }
+  lastoffset = noaddblk ? oldlen : lastpos - lastscan;
+  scan = dm->findnext(data, old, oldlen, new, newlen, lastoffset, scan, &pos, &len);
+  lenf = extendforward(old, oldlen, new, lastscan, lastpos, scan, noaddblk);
+  /* scan == newlen means we're going to finish */
+  lenb = !noaddblk && scan < newlen ? extendbackward(old, new, lastscan, scan, pos) : 0;
 
   /* if there is an overlap find good place to split */
   if (lastscan + lenf > scan - lenb)
@@ -1213,6 +2458,28 @@ mkdiff_step(void *sdata,
     *lastposp = lastpos + lenf;
 }
 
+void
+mkdiff_step(void *sdata,
+            unsigned char *old, bsuint oldlen,
+            unsigned char *new, bsuint newlen,
+            struct instr *instr,
+	    bsuint *scanp, bsuint *lastposp, bsuint *lastscanp)
+  
+{
+  struct stepdata *sd = sdata;
+
+  if (!sd->data)
+    {
+      sd->data = createindex(sd->dm, old, oldlen, sd->mode);
+      if (!sd->data)
+	{
+	  fprintf(stderr, "mkdiff: could not create data\n");
+	  exit(1);
+	}
+    }
+  stepinstr(sd->dm, sd->data, sd->noaddblk, old, oldlen, new, newlen, instr, scanp, lastposp, lastscanp);
+}
+
 void
 mkdiff_step_freedata(void *sdata)
 {
@@ -1232,3 +2499,386 @@ mkdiff_step_free(void *sdata)
     dm->free(sd->data);
   free(sd);
 }
+
+/******************************************************************/
+/*                                                                */
+/*         streaming support                                      */
+/*                                                                */
+/******************************************************************/
+
+/*
+ * Diffs data that does not fit into memory: the old data is pushed
+ * with mkdiff_stream_old(), the new data is pulled with the readnew
+ * callback. Both are kept in windows that slide along, the old window
+ * keeps some data behind the current copy position, so that moved
+ * data can still be found. Index methods with sliding support update
+ * their index, the others rebuild it after every slide.
+ */
+
+#define STREAM_RECENT 16
+#define STREAM_LONGCOPY 512
+
+struct mkdiff_stream {
+  struct deltamode *dm;
+  void *data;
+  int mode;
+  int noaddblk;
+
+  unsigned char *old;
+  bsuint oldsize;
+  bsuint oldl;
+  bsuint oldskip;		/* bytes dropped in front of the window */
+  bsuint oldindexed;
+  int oldeof;
+
+  unsigned char *new;
+  bsuint newsize;
+  bsuint newl;
+  bsuint newskip;
+  int neweof;
+
+  bsuint scan;
+  bsuint lastpos;
+  bsuint lastscan;
+  bsint drift[STREAM_RECENT];	/* old - new offsets of the last long copies */
+  bsuint driftlen[STREAM_RECENT];
+  int ndrift;
+
+  mkdiff_stream_io readnew;
+  mkdiff_stream_io writein;
+  mkdiff_stream_io writeadd;
+  void *cookie;
+
+  struct instr *instr;
+  int instrlen;
+  struct mkdiff_stats *stats;	/* per stream, mkdiff_stats() is for mkdiff() */
+};
+
+#define STREAM_MINWINDOW 65536
+
+/* index memory per 16 bytes of old data, including the transient */
+static bsuint stream_indexcost(int mode)
+{
+#ifndef BSDIFF_NO_HASH
+  if (DELTAMODE_METHOD(mode) == DELTAMODE_HASH)
+    return (16 * sizeof(unsigned int) * hash_density(mode)) >> hash_shift(mode);
+#endif
+  return 16 * 2 * sizeof(bsint);
+}
+
+struct mkdiff_stream *
+mkdiff_stream_open(int mode, size_t memory, mkdiff_stream_io readnew, mkdiff_stream_io writein, mkdiff_stream_io writeadd, void *cookie)
+{
+  struct mkdiff_stream *ms;
+  size_t oldsize;
+
+  ms = calloc(1, sizeof(*ms));
+  if (!ms)
+    return 0;
+  if ((mode & DELTAMODE_NOADDBLK) != 0)
+    {
+      mode ^= DELTAMODE_NOADDBLK;
+      ms->noaddblk = 1;
+    }
+  ms->dm = finddeltamode(DELTAMODE_METHOD(mode));
+  ms->mode = mode;
+  initbytesrun();
+  /* old window + index + a new window of a quarter of the old one */
+  oldsize = memory / (16 + 4 + stream_indexcost(mode)) * 16;
+  if (oldsize > OFFARRAY_MAX)
+    oldsize = OFFARRAY_MAX;
+  /* the new window must not outgrow a quarter of the old one, see stream_run */
+  if (oldsize < 4 * STREAM_MINWINDOW)
+    oldsize = 4 * STREAM_MINWINDOW;
+  ms->oldsize = oldsize;
+  ms->newsize = oldsize / 4;
+  ms->old = malloc(ms->oldsize);
+  ms->new = malloc(ms->newsize);
+  if (!ms->old || !ms->new)
+    {
+      free(ms->old);
+      free(ms->new);
+      free(ms);
+      return 0;
+    }
+  ms->readnew = readnew;
+  ms->writein = writein;
+  ms->writeadd = writeadd;
+  ms->cookie = cookie;
+  return ms;
+}
+
+static void stream_freeindex(struct mkdiff_stream *ms)
+{
+  if (ms->data)
+    ms->dm->free(ms->data);
+  ms->data = 0;
+  ms->oldindexed = 0;
+}
+
+static void stream_index(struct mkdiff_stream *ms)
+{
+  struct deltamode *dm = ms->dm;
+
+  if (ms->data && ms->oldindexed < ms->oldl && !dm->append)
+    stream_freeindex(ms);
+  if (!ms->data)
+    {
+      if (dm->alloc)
+	ms->data = dm->alloc(ms->oldsize, ms->mode);
+      else
+	ms->data = dm->create(ms->old, ms->oldl, ms->mode);
+      if (!ms->data)
+	{
+	  fprintf(stderr, "mkdiff: could not create data\n");
+	  exit(1);
+	}
+      ms->oldindexed = dm->alloc ? 0 : ms->oldl;
+    }
+  if (ms->oldindexed < ms->oldl)
+    ms->oldindexed = dm->append(ms->data, ms->old, ms->oldindexed, ms->oldl);
+}
+
+static void stream_write(struct mkdiff_stream *ms, mkdiff_stream_io io, unsigned char *buf, bsuint len)
+{
+  int l;
+
+  for (; len; len -= l, buf += l)
+    {
+      l = len > 65536 ? 65536 : len;
+      if (io(ms->cookie, buf, l) != l)
+	{
+	  fprintf(stderr, "mkdiff: write error\n");
+	  exit(1);
+	}
+    }
+}
+
+static void stream_addinstr(struct mkdiff_stream *ms, struct instr *instr)
+{
+  struct instr *last = ms->instrlen ? ms->instr + ms->instrlen - 1 : 0;
+
+  if (last && last->copyin == 0 && last->copyoutoff + last->copyout == instr->copyoutoff)
+    {
+      /* just add to last instruction */
+      last->copyin = instr->copyin;
+      last->copyinoff = instr->copyinoff;
+      last->copyout += instr->copyout;
+      return;
+    }
+  if (!instr->copyin && !instr->copyout)
+    return;
+  if ((ms->instrlen & 31) == 0)
+    {
+      ms->instr = realloc(ms->instr, sizeof(*ms->instr) * (ms->instrlen + 32));
+      if (!ms->instr)
+	{
+	  fprintf(stderr, "out of memory\n");
+	  exit(1);
+	}
+    }
+  ms->instr[ms->instrlen++] = *instr;
+}
+
+static void stream_step(struct mkdiff_stream *ms)
+{
+  struct instr instr;
+  unsigned char addblk[4096];
+  bsuint lenf, lastpos, lastscan;
+  bsuint i, l;
+
+  stream_index(ms);
+  stepinstr(ms->dm, ms->data, ms->noaddblk, ms->old, ms->oldl, ms->new, ms->newl, &instr, &ms->scan, &ms->lastpos, &ms->lastscan);
+  if (instr.copyout && !ms->oldeof && (ms->lastscan == ms->newl || instr.copyoutoff + instr.copyout == ms->oldl))
+    {
+      /* incomplete match, ignore indata part */
+      instr.copyin = 0;
+      ms->scan = ms->lastscan = instr.copyinoff;
+      ms->lastpos = instr.copyoutoff + instr.copyout;
+    }
+  else if (!instr.copyout && ms->lastscan == ms->newl)
+    {
+      /* no match found in old data, advance if we're behind */
+      if (ms->lastpos + ms->oldskip < ms->lastscan + ms->newskip)
+	ms->lastpos = ms->oldl;
+    }
+  if (instr.copyin)
+    stream_write(ms, ms->writein, ms->new + instr.copyinoff, instr.copyin);
+  if (instr.copyout && ms->writeadd)
+    {
+      lastpos = instr.copyoutoff;
+      lastscan = instr.copyinoff - instr.copyout;
+      for (lenf = instr.copyout; lenf; lenf -= l)
+	{
+	  l = lenf > sizeof(addblk) ? sizeof(addblk) : lenf;
+	  for (i = 0; i < l; i++)
+	    addblk[i] = ms->new[lastscan + i] - ms->old[lastpos + i];
+	  stream_write(ms, ms->writeadd, addblk, l);
+	  lastscan += l;
+	  lastpos += l;
+	}
+    }
+  if (ms->stats)
+    ms->stats->copyin += instr.copyin;
+  instr.copyinoff += ms->newskip;
+  instr.copyoutoff += ms->oldskip;
+  if (instr.copyout >= STREAM_LONGCOPY)
+    {
+      i = ms->ndrift++ % STREAM_RECENT;
+      ms->drift[i] = (bsint)(instr.copyoutoff - (instr.copyinoff - instr.copyout));
+      ms->driftlen[i] = instr.copyout;
+    }
+  stream_addinstr(ms, &instr);
+}
+
+/*
+ * The old window position that corresponds to the current new data.
+ * Short copies are mostly noise and moved data makes the copy position
+ * jump back and forth, so follow the new data with the median offset
+ * of the last long copies, weighted by their length.
+ */
+static bsuint stream_anchor(struct mkdiff_stream *ms)
+{
+  bsint drift[STREAM_RECENT], d, anchor;
+  bsuint len[STREAM_RECENT], l, total = 0;
+  int i, j, n;
+
+  n = ms->ndrift < STREAM_RECENT ? ms->ndrift : STREAM_RECENT;
+  for (i = 0; i < n; i++)
+    {
+      d = ms->drift[i];
+      l = ms->driftlen[i];
+      for (j = i; j > 0 && drift[j - 1] > d; j--)
+	{
+	  drift[j] = drift[j - 1];
+	  len[j] = len[j - 1];
+	}
+      drift[j] = d;
+      len[j] = l;
+      total += l;
+    }
+  d = 0;
+  for (i = 0, l = 0; i < n; i++)
+    if ((l += len[i]) >= total / 2)
+      {
+	d = drift[i];
+	break;
+      }
+  anchor = (bsint)(ms->lastscan + ms->newskip) + d - (bsint)ms->oldskip;
+  return anchor > 0 ? anchor : 0;
+}
+
+static void stream_run(struct mkdiff_stream *ms, unsigned char *d, bsuint l)
+{
+  bsuint l2, move, anchor;
+  int r;
+
+  if (ms->lastscan == ms->newl && ms->neweof)
+    {
+      ms->oldskip += ms->oldl + l;
+      ms->oldl = 0;
+      return;
+    }
+  for (;;)
+    {
+      if (ms->oldl < ms->oldsize && !ms->oldeof)
+	{
+	  l2 = ms->oldsize - ms->oldl;
+	  if (l2 > l)
+	    l2 = l;
+	  memcpy(ms->old + ms->oldl, d, l2);
+	  ms->oldl += l2;
+	  l -= l2;
+	  d += l2;
+	  if (ms->oldl < ms->oldsize)
+	    return;
+	}
+      while (ms->newl < ms->newsize && !ms->neweof)
+	{
+	  l2 = ms->newsize - ms->newl;
+	  r = ms->readnew(ms->cookie, ms->new + ms->newl, l2 > 65536 ? 65536 : l2);
+	  if (r < 0)
+	    {
+	      fprintf(stderr, "mkdiff: read error\n");
+	      exit(1);
+	    }
+	  if (r == 0)
+	    ms->neweof = 1;
+	  ms->newl += r;
+	}
+      if (ms->lastscan != ms->newl)
+	stream_step(ms);
+      if (ms->lastscan > ms->newsize / 4 && !ms->neweof)
+	{
+	  if (ms->newl > ms->lastscan)
+	    memmove(ms->new, ms->new + ms->lastscan, ms->newl - ms->lastscan);
+	  ms->newl -= ms->lastscan;
+	  ms->newskip += ms->lastscan;
+	  ms->scan -= ms->lastscan;
+	  ms->lastscan = 0;
+	}
+      anchor = stream_anchor(ms);
+      if (!ms->oldeof && (anchor > ms->oldsize / 2 || ms->lastpos == ms->oldl))
+	{
+	  /* slide, keep a quarter of the window behind the copy position */
+	  move = anchor > ms->oldsize / 4 ? anchor - ms->oldsize / 4 : ms->oldsize / 4;
+	  if (ms->lastpos + ms->oldskip + ms->oldsize < ms->lastscan + ms->newskip)
+	    move = ms->lastpos;
+	  if (move > ms->lastpos)
+	    move = ms->lastpos;
+	  if (move > ms->oldl)
+	    move = ms->oldl;
+	  if (ms->oldl > move)
+	    memmove(ms->old, ms->old + move, ms->oldl - move);
+	  ms->oldl -= move;
+	  ms->oldskip += move;
+	  ms->lastpos -= move;
+	  if (ms->data && ms->dm->discard && ms->oldindexed >= move)
+	    {
+	      ms->dm->discard(ms->data, move);
+	      ms->oldindexed -= move;
+	    }
+	  else
+	    stream_freeindex(ms);
+	}
+      if (ms->lastscan == ms->newl && ms->neweof)
+	{
+	  ms->oldskip += ms->oldl + l;
+	  ms->oldl = 0;
+	  stream_freeindex(ms);
+	  return;
+	}
+    }
+}
+
+void
+mkdiff_stream_stats(struct mkdiff_stream *ms, struct mkdiff_stats *stats)
+{
+  ms->stats = stats;
+}
+
+void
+mkdiff_stream_old(struct mkdiff_stream *ms, unsigned char *d, bsuint l)
+{
+  stream_run(ms, d, l);
+}
+
+void
+mkdiff_stream_close(struct mkdiff_stream *ms, struct instr **instrp, int *instrlenp)
+{
+  ms->oldeof = 1;
+  stream_run(ms, 0, 0);
+  stream_freeindex(ms);
+  if (ms->stats)
+    ms->stats->instrs += ms->instrlen;
+  if (instrp)
+    {
+      *instrp = ms->instr;
+      *instrlenp = ms->instrlen;
+    }
+  else
+    free(ms->instr);
+  free(ms->old);
+  free(ms->new);
+  free(ms);
+}
@@ -22,8 +22,50 @@ void mkdiff_step(void *sdata, unsigned char *old, bsuint oldlen, unsigned char *
 void mkdiff_step_freedata(void *sdata);
 void mkdiff_step_free(void *sdata);
 
+/* streaming support */
+typedef int (*mkdiff_stream_io)(void *cookie, unsigned char *buf, int len);
+
+struct mkdiff_stream;
+struct mkdiff_stream *mkdiff_stream_open(int mode, size_t memory, mkdiff_stream_io readnew, mkdiff_stream_io writein, mkdiff_stream_io writeadd, void *cookie);
+void mkdiff_stream_old(struct mkdiff_stream *ms, unsigned char *d, bsuint l);
+void mkdiff_stream_close(struct mkdiff_stream *ms, struct instr **instrp, int *instrlenp);
+
+int mkdiff_str2mode(char *name);
+int mkdiff_str2hashparams(char *str);
+/* the following settings are for mkdiff(), streams do not use an
+ * index cache or block compression and keep their own statistics */
+void mkdiff_indexcache(char *dir);
+void mkdiff_blockcomp(int instrcomp, int addcomp, int extracomp);	/* CFILE_COMP_xxx, default bzip2 */
+
+struct mkdiff_stats {
+  unsigned long long instrs;
+  unsigned long long copyin;		/* bytes not found in old */
+  unsigned long long chunks;
+  unsigned long long stitched;		/* bytes rescanned at chunk borders */
+  unsigned long long stitchin;		/* copyin bytes of the rescanned data */
+  unsigned long long stitchdropped;	/* chunk instructions replaced */
+  unsigned long long indexusecs;	/* time spent creating/loading the index */
+  unsigned long long scanusecs;		/* time spent scanning the new data */
+};
+
+void mkdiff_stats(struct mkdiff_stats *stats);
+void mkdiff_stream_stats(struct mkdiff_stream *ms, struct mkdiff_stats *stats);
+
 
 #define DELTAMODE_SUF  0
 #define DELTAMODE_HASH 1
+#define DELTAMODE_SAIS 2
 
+#define DELTAMODE_OPTIMIZE 0x80	/* minimize the estimated delta size */
 #define DELTAMODE_NOADDBLK 0x100
+
+/* hash method: block size 1 << shift (2-7), table slots per block (1-15) */
+#define DELTAMODE_MKHASH(shift, density) ((shift) << 9 | (density) << 12)
+#define DELTAMODE_HASHSHIFT(mode) ((mode) >> 9 & 7)
+#define DELTAMODE_HASHDENSITY(mode) ((mode) >> 12 & 15)
+
+#define DELTAMODE_METHOD(mode) ((mode) & 127)
+#define DELTAMODE_MKTHREADS(threads) ((threads) << 16)
+#define DELTAMODE_THREADS(mode) ((mode) >> 16 & 255)
+#define DELTAMODE_MKCHUNK(mbytes) ((mbytes) << 24)
+#define DELTAMODE_CHUNK(mode) ((mode) >> 24 & 127)
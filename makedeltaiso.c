@@ -11,6 +11,7 @@
 #include <string.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <unistd.h>
 
 #include <zlib.h>
 #include <bzlib.h>
@@ -24,6 +25,10 @@
 
 double targetsize;
 double writtensize;
+int deltamode = DELTAMODE_HASH;
+int verbose;
+struct mkdiff_stats mkdiffstats;
+struct cfile_stats cfstats[CFILE_STATS_N];
 
 unsigned int readiso(FILE *fp, struct rpmpay *pay, int payn, unsigned char **isop)
 {
@@ -263,6 +268,18 @@ bzput4(struct cfile *fp, unsigned int d)
     }
 }
 
+int
+str2comp(char *comp)
+{
+  int c = cfile_str2comp(comp);
+  if (c == -1)
+    {
+      fprintf(stderr, "unknown compression type: %s\n", comp);
+      exit(1);
+    }
+  return c;
+}
+
 void
 put4(FILE *fp, unsigned int d)
 {
@@ -476,10 +493,14 @@ void diffit(struct cfile *fpout, FILE *fpold, FILE *fpnew, unsigned char *old, u
   int instrlen = 0;
   unsigned char *addblk = 0;
   unsigned int addblklen = 0;
+  unsigned char *extrablk = 0;
+  unsigned int extrablklen = 0;
   int i, j, b2i;
   unsigned int off;
 
-  mkdiff(DELTAMODE_HASH, old, oldl, new, newl, &instr, &instrlen, 0, 0, &addblk, &addblklen, 0, 0);
+  /* with -O let the new data count, it is written with the delta compression */
+  mkdiff(deltamode, old, oldl, new, newl, &instr, &instrlen, 0, 0, &addblk, &addblklen, deltamode & DELTAMODE_OPTIMIZE ? &extrablk : 0, &extrablklen);
+  free(extrablk);
   free(old);
   old = 0;
   recode_instr(instr, instrlen, &b1, &nb1, &b2, &nb2, newpays, newpayn);
@@ -566,12 +587,81 @@ main(int argc, char **argv)
   struct cfile *bf;
   MD5_CTX targetmd5;
   unsigned char targetmd5res[16];
+  int c, threads = 1, chunk = 0;
+  int hashparams = 0, optimize = 0;
+  int comp = CFILE_COMP_BZ, addblkcomp = CFILE_COMP_BZ;
+  char *c2;
 
-  if (argc != 4)
+  while ((c = getopt(argc, argv, "vM:t:c:j:H:Oz:")) != -1)
     {
-      fprintf(stderr, "usage: makedeltaiso <oldiso> <newiso> <deltaiso>\n");
+      switch (c)
+	{
+	case 'z':
+	  if ((c2 = strchr(optarg, ',')) != 0)
+	    *c2++ = 0;
+	  if (*optarg)
+	    comp = str2comp(optarg);
+	  if (c2)
+	    addblkcomp = str2comp(c2);
+	  break;
+	case 'M':
+	  if ((deltamode = mkdiff_str2mode(optarg)) == -1)
+	    {
+	      fprintf(stderr, "unknown delta mode: %s\n", optarg);
+	      exit(1);
+	    }
+	  break;
+	case 'H':
+	  if ((hashparams = mkdiff_str2hashparams(optarg)) == -1)
+	    {
+	      fprintf(stderr, "illegal hash parameters: %s\n", optarg);
+	      exit(1);
+	    }
+	  break;
+	case 'O':
+	  optimize = DELTAMODE_OPTIMIZE;
+	  break;
+	case 'c':
+	  mkdiff_indexcache(optarg);
+	  break;
+	case 'v':
+	  verbose++;
+	  break;
+	case 'j':
+	  chunk = atoi(optarg);
+	  if (chunk < 1 || chunk > 127)
+	    {
+	      fprintf(stderr, "illegal chunk size: %s\n", optarg);
+	      exit(1);
+	    }
+	  break;
+	case 't':
+	  threads = atoi(optarg);
+	  if (threads < 1 || threads > 255)
+	    {
+	      fprintf(stderr, "illegal thread count: %s\n", optarg);
+	      exit(1);
+	    }
+	  break;
+	default:
+	  fprintf(stderr, "usage: makedeltaiso [-v] [-M mode] [-t threads] [-j mbytes] [-H window[,density]] [-O] [-z compression[,addblockcompression]] [-c cachedir] <oldiso> <newiso> <deltaiso>\n");
+	  exit(1);
+	}
+    }
+  if (argc - optind != 3)
+    {
+      fprintf(stderr, "usage: makedeltaiso [-v] [-M mode] [-t threads] [-j mbytes] [-H window[,density]] [-O] [-z compression[,addblockcompression]] [-c cachedir] <oldiso> <newiso> <deltaiso>\n");
       exit(1);
     }
+  if (threads > 1 && !chunk)
+    fprintf(stderr, "warning: -t has no effect, the diff uses threads with -j\n");
+  deltamode |= DELTAMODE_MKTHREADS(threads) | DELTAMODE_MKCHUNK(chunk) | hashparams | optimize;
+  if (verbose)
+    mkdiff_stats(&mkdiffstats);
+  if (verbose > 1)
+    cfile_stats(cfstats);
+  mkdiff_blockcomp(CFILE_COMP_BZ, addblkcomp, comp);
+  argv += optind - 1;
   if ((fpold = fopen64(argv[1], "r")) == 0)
     {
       perror(argv[1]);
@@ -603,8 +693,16 @@ main(int argc, char **argv)
   putc('I', fpout);
   putc('S', fpout);
   putc('O', fpout);
-  put4(fpout, 2);
-  if ((bf = cfile_open(CFILE_OPEN_WR, CFILE_IO_FILE, fpout, CFILE_COMP_BZ, CFILE_LEN_UNLIMITED, 0, 0)) == 0)
+  if (comp == CFILE_COMP_BZ && addblkcomp == CFILE_COMP_BZ)
+    put4(fpout, 2);
+  else
+    {
+      /* V3: compression of the delta and of the add block */
+      put4(fpout, 3);
+      put4(fpout, comp);
+      put4(fpout, addblkcomp);
+    }
+  if ((bf = cfile_open(CFILE_OPEN_WR, CFILE_IO_FILE, fpout, comp, CFILE_LEN_UNLIMITED, 0, 0)) == 0)
     {
       fprintf(stderr, "cfile wopen failed\n");
       exit(1);
@@ -635,6 +733,12 @@ main(int argc, char **argv)
   writtensize += bf->bytes;
   bf->bytes = 0;
   printf("iso diff done, final compression: %4.1f%%\n", writtensize * 100 / targetsize);
+  if (verbose)
+    {
+      printf("diff: %llu instructions, %llu bytes not found in old data\n", mkdiffstats.instrs, mkdiffstats.copyin);
+      if (mkdiffstats.chunks)
+	printf("diff: %llu chunks, %llu bytes rescanned at chunk borders, %llu of them not found\n", mkdiffstats.chunks, mkdiffstats.stitched, mkdiffstats.stitchin);
+    }
   if (bf->write(bf, targetmd5res, 16) != 16)
     {
       perror("md5sum write");
@@ -654,6 +758,8 @@ main(int argc, char **argv)
   for (i = 0; i < 16; i++)
     printf("%02x", targetmd5res[i]);
   printf("\n");
+  if (verbose > 1)
+    cfile_printstats(stdout, cfstats);
   for (i = 0; i < oldpayn; i++)
     free(oldpays[i].name);
   free(oldpays);
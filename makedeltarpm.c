@@ -219,207 +219,77 @@ is_unpatched(char *n, struct rpmlfile *files1, int nfiles1, struct rpmlfile *fil
   return 0;
 }
 
-struct streamdata {
-  bsuint bsize;
-
-  unsigned char *old;
-  bsuint oldl;
-  bsuint oldskip;
-  int oldeof;
-
-  unsigned char *new;
-  bsuint newl;
-  bsuint newskip;
-  int neweof;
-
-  struct cfile *newf;
+/* stream mode: the old cpio is fed to the diff engine instead of being stored */
+struct streamio {
   unsigned char *xnewdata;
   bsuint xnewdatal;
-
-  void *stepd;
-  bsuint scan;
-  bsuint lastpos;
-  bsuint lastscan;
-
+  struct cfile *newf;
   struct cfile *cfa;	/* add block */
   struct cfile *cfi;	/* in data */
-
-  struct instr *instr;
-  int instrlen;
 };
 
-struct streamdata sd;	/* hack: global for now */
-
-void
-addtocpio_stream(unsigned char *d, int l)
+static int
+stream_readnew(void *cookie, unsigned char *buf, int len)
 {
-  bsuint bsize = sd.bsize;
-  if (sd.lastscan == sd.newl && sd.neweof)
+  struct streamio *sio = cookie;
+  if (sio->xnewdatal)
     {
-      sd.oldskip += sd.oldl + l;
-      sd.oldl = 0;
-      return;
+      if (len > sio->xnewdatal)
+	len = sio->xnewdatal;
+      memcpy(buf, sio->xnewdata, len);
+      sio->xnewdata += len;
+      sio->xnewdatal -= len;
+      return len;
     }
-  for (;;)
+  len = sio->newf->read(sio->newf, buf, len);
+  if (len < 0)
     {
-      if (sd.oldl < bsize && !sd.oldeof)
-	{
-	  int l2 = bsize - sd.oldl;
-	  if (l2 > l)
-	    l2 = l;
-	  memcpy(sd.old + sd.oldl, d, l2);
-	  sd.oldl += l2;
-          l -= l2;
-	  d += l2;
-	  if (sd.oldl < bsize)
-	    return;
-	}
-      while (sd.newl < bsize && !sd.neweof)
-	{
-	  int l2 = bsize - sd.newl;
-	  if (sd.xnewdatal)
-	    {
-	      if (l2 > sd.xnewdatal)
-		l2 = sd.xnewdatal;
-	      memcpy(sd.new + sd.newl, sd.xnewdata, l2);
-	      sd.newl += l2;
-	      sd.xnewdata += l2;
-	      sd.xnewdatal -= l2;
-	      continue;
-	    }
-	  l2 = sd.newf->read(sd.newf, sd.new + sd.newl, l2);
-	  if (l2 < 0)
-	    {
-	      fprintf(stderr, "payload read failed\n");
-	      exit(1);
-	    }
-	  if (l2 == 0)
-	    sd.neweof = 1;
-	  sd.newl += l2;
-	}
-      if (sd.lastscan != sd.newl)
-	{
-	  struct instr instr;
-	  mkdiff_step(sd.stepd, sd.old, sd.oldl, sd.new, sd.newl, &instr, &sd.scan, &sd.lastpos, &sd.lastscan);
-	  if (instr.copyout && !sd.oldeof && (sd.lastscan == sd.newl || instr.copyoutoff + instr.copyout == sd.oldl))
-	    {
-	      /* incomplete match, ignore indata part */
-	      instr.copyin = 0;
-	      sd.scan = sd.lastscan = instr.copyinoff;
-	      sd.lastpos = instr.copyoutoff + instr.copyout;
-	    }
-	  else if (!instr.copyout && sd.lastscan == sd.newl)
-	    {
-	      /* no match found in old data, advance if we're behind */
-	      if (sd.lastpos + sd.oldskip < sd.lastscan + sd.newskip)
-	        sd.lastpos = sd.oldl;
-	    }
-	  /* printf("INSTR: %d@%d %d@%d\n", instr.copyout, instr.copyoutoff + sd.oldskip, instr.copyin, instr.copyinoff + sd.newskip); */
-	  if (instr.copyin)
-	    {
-	      if (instr.copyinoff + instr.copyin > sd.newl)
-		abort();
-	      if (sd.cfi->write(sd.cfi, sd.new + instr.copyinoff, instr.copyin) != instr.copyin)
-		{
-		  fprintf(stderr, "could not create indata block\n");
-		  exit(1);
-		}
-	    }
-	  if (instr.copyout && sd.cfa)
-	    {
-	      bsuint lenf = instr.copyout;
-	      bsuint lastpos = instr.copyoutoff;
-	      bsuint lastscan = instr.copyinoff - lenf;
-	      if (instr.copyoutoff + instr.copyout > sd.oldl)
-		abort();
-	      if (instr.copyinoff - lenf + instr.copyout > sd.newl)
-		abort();
-	      while (lenf > 0) 
-		{
-		  unsigned char addblk[4096];
-		  int len2, i;
+      fprintf(stderr, "payload read failed\n");
+      exit(1);
+    }
+  return len;
+}
 
-		  len2 = lenf > 4096 ? 4096 : lenf;
-		  for (i = 0; i < len2; i++) 
-		    addblk[i] = sd.new[lastscan + i] - sd.old[lastpos + i];
-		  if (sd.cfa->write(sd.cfa, addblk, len2) != len2)
-		    {
-		      fprintf(stderr, "could not create compressed add block\n");
-		      exit(1);
-		    }
-		  lastscan += len2;
-		  lastpos += len2;
-		  lenf -= len2;
-		}
-	    }
-	  instr.copyinoff += sd.newskip;
-	  instr.copyoutoff += sd.oldskip;
-	  if (sd.instrlen && sd.instr[sd.instrlen - 1].copyin == 0 && sd.instr[sd.instrlen - 1].copyoutoff + sd.instr[sd.instrlen - 1].copyout == instr.copyoutoff)
-	    {
-	      /* just add to last instruction */
-	      sd.instr[sd.instrlen - 1].copyin = instr.copyin;
-	      sd.instr[sd.instrlen - 1].copyinoff = instr.copyinoff;
-	      sd.instr[sd.instrlen - 1].copyout += instr.copyout;
-	    }
-	  else if (instr.copyin || instr.copyout)
-	    {
-	      if ((sd.instrlen & 31) == 0)
-		{
-		  if (sd.instr)
-		    sd.instr = realloc(sd.instr, sizeof(*sd.instr) * (sd.instrlen + 32));
-		  else
-		    sd.instr = malloc(sizeof(*sd.instr) * (sd.instrlen + 32));
-		  if (!sd.instr)
-		    {
-		      fprintf(stderr, "out of memory\n");
-		      exit(1);
-		    }
-		}
-	      sd.instr[sd.instrlen] = instr;
-	      sd.instrlen++;
-	    }
-	}
-      if (sd.lastscan > bsize / 4 && !sd.neweof)
-	{
-	  if (sd.newl > sd.lastscan)
-	    memmove(sd.new, sd.new + sd.lastscan, sd.newl - sd.lastscan);
-	  sd.newl -= sd.lastscan;
-	  sd.newskip += sd.lastscan;
-	  sd.scan -= sd.lastscan;
-	  sd.lastscan = 0;
-	}
-      if (sd.lastpos > bsize / 2 && !sd.oldeof)
-	{
-	  bsuint move = sd.lastpos - bsize / 4;
-	  if (sd.lastpos + sd.oldskip + bsize < sd.lastscan + sd.newskip)
-	    move = sd.lastpos;
-	  if (move > sd.lastpos)
-	    move = sd.lastpos;
-	  if (sd.oldl > move)
-	    memmove(sd.old, sd.old + move, sd.oldl - move);
-	  sd.oldl -= move;
-	  sd.oldskip += move;
-	  sd.lastpos -= move;
-	  mkdiff_step_freedata(sd.stepd);
-	}
-      if (sd.lastscan == sd.newl && sd.neweof)
-	{
-	  sd.oldskip += sd.oldl + l;
-	  sd.oldl = 0;
-	  mkdiff_step_freedata(sd.stepd);
-	  return;
-	}
+static int
+stream_writein(void *cookie, unsigned char *buf, int len)
+{
+  struct streamio *sio = cookie;
+  if (sio->cfi->write(sio->cfi, buf, len) != len)
+    {
+      fprintf(stderr, "could not create indata block\n");
+      exit(1);
+    }
+  return len;
+}
+
+static int
+stream_writeadd(void *cookie, unsigned char *buf, int len)
+{
+  struct streamio *sio = cookie;
+  if (sio->cfa->write(sio->cfa, buf, len) != len)
+    {
+      fprintf(stderr, "could not create compressed add block\n");
+      exit(1);
     }
+  return len;
 }
 
+/* a cpio archive under construction. If stream is set, the data is
+ * fed to the diff engine and only the length is kept */
+struct cpiodata {
+  unsigned char *data;
+  bsuint len;
+  struct mkdiff_stream *stream;
+};
+
 void
-addtocpio(unsigned char **cpiop, bsuint *cpiol, unsigned char *d, int l)
+addtocpio(struct cpiodata *cpio, unsigned char *d, int l)
 {
-  bsuint cpl = *cpiol;
-  if (*cpiop == (unsigned char *)&sd)
+  bsuint cpl = cpio->len;
+  if (cpio->stream)
     {
-      *cpiol += l;
-      addtocpio_stream(d, l);
+      cpio->len += l;
+      mkdiff_stream_old(cpio->stream, d, l);
       return;
     }
   if (cpl + l < cpl || cpl + l + 65535 < cpl + l)
@@ -428,9 +298,9 @@ addtocpio(unsigned char **cpiop, bsuint *cpiol, unsigned char *d, int l)
       exit(1);
     }
   if (cpl == 0 || ((cpl - 1) & 65535) + l >= 65536)
-    *cpiop = xrealloc(*cpiop, (cpl + l + 65535) & ~65535);
-  memcpy(*cpiop + cpl, d, l);
-  *cpiol = cpl + l;
+    cpio->data = xrealloc(cpio->data, (cpl + l + 65535) & ~65535);
+  memcpy(cpio->data + cpl, d, l);
+  cpio->len = cpl + l;
 }
 
 void
@@ -555,68 +425,13 @@ createindatalist(struct instr *instr, int instrlen, struct deltarpm *d, unsigned
 int
 str2comp(char *comp)
 {
-  int n = strlen(comp);
-  if (n > 2 && n < 20 && comp[n - 2] == '.' && comp[n - 1] >= '0' && comp[n - 1] <= '9')
-    {
-      char buf[20];
-      strcpy(buf, comp);
-      buf[n - 2] = 0;
-      return cfile_setlevel(str2comp(buf), comp[n - 1] - '0');
-    }
-  if (!strcmp(comp, "bzip2"))
-    return CFILE_COMP_BZ;
-  if (!strcmp(comp, "gzip"))
-    return CFILE_COMP_GZ;
-#ifdef CFILE_COMP_GZ_RSYNC
-  if (!strcmp(comp, "gzip rsyncable"))
-    return CFILE_COMP_GZ_RSYNC;
-#endif
-  if (!strcmp(comp, "lzma"))
-    return CFILE_COMP_LZMA;
-  if (!strcmp(comp, "xz"))
-    return CFILE_COMP_XZ;
-  if (!strcmp(comp, "uncompressed"))
-    return CFILE_COMP_UN;
-  fprintf(stderr, "unknown compression type: %s\n", comp);
-  exit(1);
-}
-
-void
-createaddblock(struct instr *instr, int instrlen, struct deltarpm *d, unsigned char *old, unsigned char *new, int comp)
-{
-  struct cfile *cfa;
-  unsigned int l, l2;
-  unsigned char blk[4096];
-  unsigned char *o;
-  int i, j;
-
-  cfa = cfile_open(CFILE_OPEN_WR, CFILE_IO_ALLOC, &d->addblk, comp, CFILE_LEN_UNLIMITED, 0, 0);
-  if (!cfa)
+  int c = cfile_str2comp(comp);
+  if (c == -1)
     {
-      fprintf(stderr, "could not create compressed add block\n");
+      fprintf(stderr, "unknown compression type: %s\n", comp);
       exit(1);
     }
-  for (i = 0; i < instrlen; i++)
-    {
-      l = instr[i].copyout;
-      o = old + instr[i].copyoutoff;
-      while (l)
-	{
-	  l2 = l > sizeof(blk) ? sizeof(blk) : l;
-	  for (j = 0; j < l2; j++)
-	    blk[j] = new[j] - o[j];
-          if (cfa->write(cfa, blk, l2) != l2)
-	    {
-	      fprintf(stderr, "could not create compressed add block\n");
-	      exit(1);
-	    }
-	  new += l2;
-	  o += l2;
-	  l -= l2;
-	}
-      new += instr[i].copyin;
-    }
-  d->addblklen = cfa->close(cfa);
+  return c;
 }
 
 void
@@ -653,6 +468,14 @@ in_multilib_dir(char *fn)
   return 0;
 }
 
+static void
+usage()
+{
+  fprintf(stderr, "usage: makedeltarpm [-v] [-V version] [-z compression[,addblockcompression]] [-m mbytes] [-M mode] [-t threads] [-c cachedir] [-j mbytes] [-H window[,density]] [-O] [-s seqfile] [-l <file>] [-r] [-u] oldrpm newrpm deltarpm\n");
+  fprintf(stderr, "       makedeltarpm [-v] [-V version] [-z compression] [-s seqfile] [-u] -p oldrpmprint oldpatchrpm oldrpm newrpm deltarpm\n");
+  exit(1);
+}
+
 int
 main(int argc, char **argv)
 {
@@ -696,10 +519,8 @@ main(int argc, char **argv)
   MD5_CTX seqmd5;
   unsigned char seqmd5res[16];
 
-  unsigned char *oldcpio = 0;
-  bsuint oldcpiolen = 0;
-  unsigned char *newcpio = 0;
-  bsuint newcpiolen = 0;
+  struct cpiodata oldcpio;
+  struct cpiodata newcpio;
 
   bsuint cpiopos, oldadjust;
   unsigned int *offadjs = 0;
@@ -714,6 +535,8 @@ main(int argc, char **argv)
 
   struct instr *instr = 0;
   int instrlen = 0;
+  unsigned char *extrablk = 0;
+  unsigned int extrablklen = 0;
 
   int verbose = 0;
   int version = 3;
@@ -729,11 +552,21 @@ main(int argc, char **argv)
   int targetcomp = CFILE_COMP_XX;
   char *payloadflags;
 
-  bsuint stream = 0;
+  size_t stream = 0;
+  struct streamio sio;
+  int deltamode = DELTAMODE_HASH;
+  int threads = 1;
+  int hashparams = 0;
+  int chunk = 0;
+  int optimize = 0;
+  struct mkdiff_stats mkdiffstats;
+  struct cfile_stats cfstats[CFILE_STATS_N];
 
   memset(&d, 0, sizeof(d));
-  memset(&sd, 0, sizeof(sd));
-  while ((c = getopt(argc, argv, "vV:prl:s:z:um:")) != -1)
+  memset(&sio, 0, sizeof(sio));
+  memset(&oldcpio, 0, sizeof(oldcpio));
+  memset(&newcpio, 0, sizeof(newcpio));
+  while ((c = getopt(argc, argv, "vV:prl:s:z:um:M:t:c:j:H:O")) != -1)
     {
       switch (c)
 	{
@@ -762,15 +595,58 @@ main(int argc, char **argv)
 	  compopt = optarg;
 	  break;
 	case 'm':
-	  stream = atoi(optarg) * (1024 * 256);
+	  stream = (size_t)atoi(optarg) * (1024 * 1024);
+	  break;
+	case 'M':
+	  if ((deltamode = mkdiff_str2mode(optarg)) == -1)
+	    {
+	      fprintf(stderr, "unknown delta mode: %s\n", optarg);
+	      exit(1);
+	    }
+	  break;
+	case 'H':
+	  if ((hashparams = mkdiff_str2hashparams(optarg)) == -1)
+	    {
+	      fprintf(stderr, "illegal hash parameters: %s\n", optarg);
+	      exit(1);
+	    }
+	  break;
+	case 'O':
+	  optimize = DELTAMODE_OPTIMIZE;
+	  break;
+	case 'c':
+	  mkdiff_indexcache(optarg);
+	  break;
+	case 'j':
+	  chunk = atoi(optarg);
+	  if (chunk < 1 || chunk > 127)
+	    {
+	      fprintf(stderr, "illegal chunk size: %s\n", optarg);
+	      exit(1);
+	    }
+	  break;
+	case 't':
+	  threads = atoi(optarg);
+	  if (threads < 1 || threads > 255)
+	    {
+	      fprintf(stderr, "illegal thread count: %s\n", optarg);
+	      exit(1);
+	    }
 	  break;
 	default:
-	  fprintf(stderr, "usage: makedeltarpm [-l <file>] [-s seq] oldrpm newrpm deltarpm\n");
-	  exit(1);
+	  usage();
 	}
     }
+  if (threads > 1 && !chunk)
+    fprintf(stderr, "warning: -t only speeds up the bzip2 compression, the diff uses threads with -j\n");
+  deltamode |= DELTAMODE_MKTHREADS(threads) | DELTAMODE_MKCHUNK(chunk) | hashparams | optimize;
   if (verbose)
     vfp = !strcmp("-", argv[argc - 1]) ? stderr : stdout;
+  if (verbose > 1)
+    {
+      memset(cfstats, 0, sizeof(cfstats));
+      cfile_stats(cfstats);
+    }
   if (compopt)
     {
       char *c2 = strchr(compopt, ',');
@@ -786,13 +662,14 @@ main(int argc, char **argv)
 	    addblkcomp = str2comp(c2);
 	}
     }
+  if (optimize && (stream || addblkcomp == -1))
+    fprintf(stderr, "warning: -O is ignored %s\n", stream ? "with -m" : "without an add data block");
   if (prunelist)
     read_prunelist(prunelist);
 
   if (argc - optind != (pinfo ? 5 : 3) - alone)
     {
-      fprintf(stderr, "usage: makedeltarpm [-l <file>] [-s seq] oldrpm newrpm deltarpm\n");
-      exit(1);
+      usage();
     }
   if (version != 1 && version != 2 && version != 3)
     {
@@ -1070,11 +947,11 @@ main(int argc, char **argv)
   if (rpmonly)
     {
       /* add new header to cpio */
-      addtocpio(&newcpio, &newcpiolen, d.h->intro, 16);
-      addtocpio(&newcpio, &newcpiolen, d.h->data, 16 * d.h->cnt + d.h->dcnt);
+      addtocpio(&newcpio, d.h->intro, 16);
+      addtocpio(&newcpio, d.h->data, 16 * d.h->cnt + d.h->dcnt);
     }
   fullsize = 96 + 16 + sigh->cnt * 16 + sigh->dcnt + 16 + d.h->cnt * 16 + d.h->dcnt;
-  newbz = cfile_open(CFILE_OPEN_RD, nfd, 0, CFILE_COMP_XX, CFILE_LEN_UNLIMITED, (cfile_ctxup)rpmMD5Update, &fullmd5);
+  newbz = cfile_open(CFILE_OPEN_RD, CFILE_IO_MMAP, &nfd, CFILE_COMP_XX, CFILE_LEN_UNLIMITED, (cfile_ctxup)rpmMD5Update, &fullmd5);
   if (!newbz)
     {
       fprintf(stderr, "payload open failed\n");
@@ -1087,33 +964,49 @@ main(int argc, char **argv)
     }
   targetcomp = newbz->comp;
   if ((payloadflags = headstring(d.h, TAG_PAYLOADFLAGS)) != 0)
-    if (*payloadflags >= '1' && *payloadflags <= '9')
-      targetcomp = cfile_setlevel(targetcomp, *payloadflags - '0');
+    {
+      if (*payloadflags >= '1' && *payloadflags <= '9')
+	targetcomp = cfile_setlevel(targetcomp, atoi(payloadflags));
+      if (CFILE_COMPALGO(targetcomp) == CFILE_COMP_ZSTD && strchr(payloadflags, 'T'))
+	targetcomp |= CFILE_COMP_MT;
+    }
+  if (newbz->mt)
+    targetcomp = CFILE_MKMTBLOCK(targetcomp, newbz->mtblock);
   if (paycomp == CFILE_COMP_XX)
     paycomp = targetcomp;
   if (addblkcomp == CFILE_COMP_XX)
     addblkcomp = targetcomp;
+  if (threads > 1)
+    {
+      /* the parallel bzip2 writer creates the same output */
+      cfile_setthreads(threads);
+      if (CFILE_COMPALGO(paycomp) == CFILE_COMP_BZ)
+	paycomp |= CFILE_COMP_MT;
+      if (addblkcomp != -1 && CFILE_COMPALGO(addblkcomp) == CFILE_COMP_BZ)
+	addblkcomp |= CFILE_COMP_MT;
+    }
 
   if (stream)
     {
-      memset(&sd, 0, sizeof(sd));
-      sd.xnewdata = newcpio;
-      sd.xnewdatal = newcpiolen;
-      sd.newf = newbz;
-      sd.bsize = stream;
-      sd.old = xmalloc(sd.bsize);
-      sd.new = xmalloc(sd.bsize);
+      sio.xnewdata = newcpio.data;
+      sio.xnewdatal = newcpio.len;
+      sio.newf = newbz;
       if (addblkcomp != -1)
-        sd.cfa = cfile_open(CFILE_OPEN_WR, CFILE_IO_ALLOC, &d.addblk, addblkcomp, CFILE_LEN_UNLIMITED, 0, 0);
-      sd.cfi = cfile_open(CFILE_OPEN_WR, CFILE_IO_ALLOC, &d.indata, CFILE_COMP_UN, CFILE_LEN_UNLIMITED, 0, 0);
-      oldcpio = (void *)&sd;
-      oldcpiolen = 0;
-      sd.stepd = mkdiff_step_setup(DELTAMODE_HASH | (addblkcomp == -1 ? DELTAMODE_NOADDBLK : 0));
+        sio.cfa = cfile_open(CFILE_OPEN_WR, CFILE_IO_ALLOC, &d.addblk, addblkcomp, CFILE_LEN_UNLIMITED, 0, 0);
+      sio.cfi = cfile_open(CFILE_OPEN_WR, CFILE_IO_ALLOC, &d.indata, CFILE_COMP_UN, CFILE_LEN_UNLIMITED, 0, 0);
+      memset(&mkdiffstats, 0, sizeof(mkdiffstats));
+      oldcpio.stream = mkdiff_stream_open(deltamode | (addblkcomp == -1 ? DELTAMODE_NOADDBLK : 0), stream, stream_readnew, stream_writein, sio.cfa ? stream_writeadd : 0, &sio);
+      if (!oldcpio.stream)
+	{
+	  fprintf(stderr, "out of memory\n");
+	  exit(1);
+	}
+      mkdiff_stream_stats(oldcpio.stream, &mkdiffstats);
     }
   else
     {
       while ((l = newbz->read(newbz, buf, sizeof(buf))) > 0)
-	addtocpio(&newcpio, &newcpiolen, (unsigned char *)buf, l);
+	addtocpio(&newcpio, (unsigned char *)buf, l);
       if (l < 0)
 	{
 	  fprintf(stderr, "payload read failed\n");
@@ -1126,16 +1019,16 @@ main(int argc, char **argv)
   if (rpmonly)
     {
       /* add old header to cpio */
-      addtocpio(&oldcpio, &oldcpiolen, h->intro, 16);
-      addtocpio(&oldcpio, &oldcpiolen, h->data, 16 * h->cnt + h->dcnt);
+      addtocpio(&oldcpio, h->intro, 16);
+      addtocpio(&oldcpio, h->data, 16 * h->cnt + h->dcnt);
       rpmMD5Update(&seqmd5, h->intro, 16);
       rpmMD5Update(&seqmd5, h->data, 16 * h->cnt + h->dcnt);
-      bfd = cfile_open(CFILE_OPEN_RD, fd, 0, CFILE_COMP_XX, CFILE_LEN_UNLIMITED, (cfile_ctxup)rpmMD5Update, &seqmd5);
+      bfd = cfile_open(CFILE_OPEN_RD, CFILE_IO_MMAP, &fd, CFILE_COMP_XX, CFILE_LEN_UNLIMITED, (cfile_ctxup)rpmMD5Update, &seqmd5);
     }
   else if (alone)
-    bfd = cfile_open(CFILE_OPEN_RD, CFILE_IO_BUFFER, newcpio, CFILE_COMP_UN, newcpiolen, 0, 0);
+    bfd = cfile_open(CFILE_OPEN_RD, CFILE_IO_BUFFER, newcpio.data, CFILE_COMP_UN, newcpio.len, 0, 0);
   else
-    bfd = cfile_open(CFILE_OPEN_RD, fd, 0, CFILE_COMP_XX, CFILE_LEN_UNLIMITED, 0, 0);
+    bfd = cfile_open(CFILE_OPEN_RD, CFILE_IO_MMAP, &fd, CFILE_COMP_XX, CFILE_LEN_UNLIMITED, 0, 0);
   if (!bfd)
     {
       fprintf(stderr, "payload open failed\n");
@@ -1146,14 +1039,14 @@ main(int argc, char **argv)
   if (rpmonly)
     {
       while ((l = bfd->read(bfd, buf, sizeof(buf))) > 0)
-	addtocpio(&oldcpio, &oldcpiolen, (unsigned char *)buf, l);
+	addtocpio(&oldcpio, (unsigned char *)buf, l);
     }
   else
     {
       namebufl = 1;
       namebuf = xmalloc(namebufl);
-      cpiopos = oldcpiolen;
-      oldadjust = oldcpiolen;
+      cpiopos = oldcpio.len;
+      oldadjust = oldcpio.len;
       for (;;)
 	{
 	  unsigned int size, nsize, lsize, nlink, rdev, hsize;
@@ -1286,12 +1179,12 @@ main(int argc, char **argv)
 	    {
 	      unsigned char cpiobuf[110 + 3];
 	      int ns = strlen(np);
-	      if (oldcpiolen != cpiopos - sizeof(cph) - nsize)
+	      if (oldcpio.len != cpiopos - sizeof(cph) - nsize)
 		{
 oaretry1:
 		  if ((offadjn & 15) == 0)
 		    offadjs = xrealloc2(offadjs, offadjn + 16, 2 * sizeof(unsigned int));
-		  if (oldcpiolen - oldadjust >= 0x80000000)
+		  if (oldcpio.len - oldadjust >= 0x80000000)
 		    {
 		      offadjs[2 * offadjn] = 0x7fffffff;
 		      offadjs[2 * offadjn + 1] = 0;
@@ -1299,11 +1192,11 @@ oaretry1:
 		      offadjn++;
 		      goto oaretry1;
 		    }
-		  offadjs[2 * offadjn] = oldcpiolen - oldadjust;
-		  oldadjust = oldcpiolen;
-		  if (cpiopos - sizeof(cph) - nsize >= oldcpiolen)
+		  offadjs[2 * offadjn] = oldcpio.len - oldadjust;
+		  oldadjust = oldcpio.len;
+		  if (cpiopos - sizeof(cph) - nsize >= oldcpio.len)
 		    {
-		      drpmuint a = cpiopos - sizeof(cph) - nsize - oldcpiolen;
+		      drpmuint a = cpiopos - sizeof(cph) - nsize - oldcpio.len;
 		      if (a >= 0x80000000)
 			{
 			  offadjs[2 * offadjn + 1] = 0x7fffffff;
@@ -1315,7 +1208,7 @@ oaretry1:
 		    }
 	          else
 		    {
-		      drpmuint a = oldcpiolen - (cpiopos - sizeof(cph) - nsize);
+		      drpmuint a = oldcpio.len - (cpiopos - sizeof(cph) - nsize);
 		      if (a >= 0x80000000)
 			{
 			  offadjs[2 * offadjn + 1] = (unsigned int)-((int)0x7fffffff);
@@ -1326,23 +1219,23 @@ oaretry1:
 		      offadjs[2 * offadjn + 1] = (unsigned int)(-(int)a);
 		    }
 		  offadjn++;
-		  cpiopos = oldcpiolen + sizeof(cph) + nsize;
+		  cpiopos = oldcpio.len + sizeof(cph) + nsize;
 		}
 	      sprintf((char *)cpiobuf, "07070100000000%08x00000000000000000000000100000000%08x0000000000000000%08x%08x%08x00000000./", filemodes[i], lsize, devmajor(rdev), devminor(rdev), ns + 3);
-	      addtocpio(&oldcpio, &oldcpiolen, cpiobuf, 112);
-	      addtocpio(&oldcpio, &oldcpiolen, (unsigned char *)np, ns + 1);
+	      addtocpio(&oldcpio, cpiobuf, 112);
+	      addtocpio(&oldcpio, (unsigned char *)np, ns + 1);
 	      ns += 3 - 2;
 	      for (; ns & 3 ; ns++)
-		addtocpio(&oldcpio, &oldcpiolen, (unsigned char *)"", 1);
+		addtocpio(&oldcpio, (unsigned char *)"", 1);
 	      rpmMD5Update(&seqmd5, (unsigned char *)np, strlen(np) + 1);
 	      rpmMD5Update32(&seqmd5, filemodes[i]);
 	      rpmMD5Update32(&seqmd5, lsize);
 	      rpmMD5Update32(&seqmd5, rdev);
 	      if (S_ISLNK(filemodes[i]))
 		{
-		  addtocpio(&oldcpio, &oldcpiolen, (unsigned char *)filelinktos[i], lsize);
+		  addtocpio(&oldcpio, (unsigned char *)filelinktos[i], lsize);
 		  for (; lsize & 3 ; lsize++)
-		    addtocpio(&oldcpio, &oldcpiolen, (unsigned char *)"", 1);
+		    addtocpio(&oldcpio, (unsigned char *)"", 1);
 		  skip = 1;
 		  rpmMD5Update(&seqmd5, (unsigned char *)filelinktos[i], strlen(filelinktos[i]) + 1);
 		}
@@ -1375,7 +1268,7 @@ oaretry1:
 		}
 	      cpiopos += l3;
 	      if (!skip)
-		addtocpio(&oldcpio, &oldcpiolen, (unsigned char *)buf, l3);
+		addtocpio(&oldcpio, (unsigned char *)buf, l3);
 	      l -= l3;
 	    }
 	  if ((l2 & 3) != 0)
@@ -1388,12 +1281,12 @@ oaretry1:
 		}
 	      cpiopos += l2;
 	      if (!skip)
-		addtocpio(&oldcpio, &oldcpiolen, (unsigned char *)"\0\0\0", l2);
+		addtocpio(&oldcpio, (unsigned char *)"\0\0\0", l2);
 	    }
 	}
       namebuf = xfree(namebuf);
       namebufl = 0;
-      addtocpio(&oldcpio, &oldcpiolen, (unsigned char *)"07070100000000000000000000000000000000000000010000000000000000000000000000000000000000000000000000000b00000000TRAILER!!!\0\0\0\0", 124);
+      addtocpio(&oldcpio, (unsigned char *)"07070100000000000000000000000000000000000000010000000000000000000000000000000000000000000000000000000b00000000TRAILER!!!\0\0\0\0", 124);
       if (verbose)
 	{
 	  fprintf(vfp, "files used:    %4d/%d = %.1f%%\n", (cpiocnt - skipped_all), cpiocnt, (cpiocnt - skipped_all) * 100. / (cpiocnt ? cpiocnt : 1));
@@ -1427,19 +1320,13 @@ oaretry1:
   if (stream)
     {
       /* finish */
-      sd.oldeof = 1;
-      addtocpio(&oldcpio, &oldcpiolen, 0, 0);
-      if (sd.cfa)
-        d.addblklen = sd.cfa->close(sd.cfa);
-      d.inlen = sd.cfi->close(sd.cfi);
-      sd.cfa = 0;
-      sd.cfi = 0;
-      instr = sd.instr;
-      sd.instr = 0;
-      instrlen = sd.instrlen;
-      sd.instrlen = 0;
-      mkdiff_step_free(sd.stepd);
-      oldcpio = 0;
+      mkdiff_stream_close(oldcpio.stream, &instr, &instrlen);
+      oldcpio.stream = 0;
+      if (sio.cfa)
+        d.addblklen = sio.cfa->close(sio.cfa);
+      d.inlen = sio.cfi->close(sio.cfi);
+      sio.cfa = 0;
+      sio.cfi = 0;
     }
 
   /* close old rpm */
@@ -1461,6 +1348,12 @@ oaretry1:
   h = xfree(h);
 
   /* close new rpm */
+  if (newbz->xzblock && (newbz->xzblock & 0xfffff) != 0 && newbz->strm.lz.total_out > newbz->xzblock)
+    {
+      /* more than one block, but the block size is stored in megabytes */
+      fprintf(stderr, "cannot recreate the payload, the xz block size %llu is not a multiple of 1MiB\n", newbz->xzblock);
+      exit(1);
+    }
   fullsize += newbz->bytes;
   if (newbz->close(newbz))
     {
@@ -1485,15 +1378,26 @@ oaretry1:
 	fprintf(vfp, "creating diff...\n");
       d.addblk = 0;
       d.addblklen = 0;
-      mkdiff(DELTAMODE_HASH | (addblkcomp == -1 ? DELTAMODE_NOADDBLK : 0), oldcpio, oldcpiolen, newcpio, newcpiolen, &instr, &instrlen, (unsigned char **)0, (unsigned int *)0, (addblkcomp == CFILE_COMP_BZ ? &d.addblk : 0), (addblkcomp == CFILE_COMP_BZ ? &d.addblklen : 0), (unsigned char **)0, (unsigned int *)0);
+      memset(&mkdiffstats, 0, sizeof(mkdiffstats));
+      mkdiff_stats(&mkdiffstats);
+      if (addblkcomp != -1)
+	mkdiff_blockcomp(CFILE_COMP_BZ, addblkcomp, paycomp);
+      /* with -O let the new data count, it goes into the payload */
+      mkdiff(deltamode | (addblkcomp == -1 ? DELTAMODE_NOADDBLK : 0), oldcpio.data, oldcpio.len, newcpio.data, newcpio.len, &instr, &instrlen, (unsigned char **)0, (unsigned int *)0, &d.addblk, &d.addblklen, optimize ? &extrablk : (unsigned char **)0, &extrablklen);
+      extrablk = xfree(extrablk);
+      mkdiff_stats(0);
+    }
+  if (verbose)
+    {
+      fprintf(vfp, "diff: %llu instructions, %llu bytes not found in old payload\n", mkdiffstats.instrs, mkdiffstats.copyin);
+      if (mkdiffstats.chunks)
+	fprintf(vfp, "diff: %llu chunks, %llu bytes rescanned at chunk borders, %llu of them not found\n", mkdiffstats.chunks, mkdiffstats.stitched, mkdiffstats.stitchin);
     }
 
 /****************************************************************/
 
   if (verbose)
     fprintf(vfp, "writing delta rpm...\n");
-  if (!stream && addblkcomp != -1 && addblkcomp != CFILE_COMP_BZ)
-    createaddblock(instr, instrlen, &d, oldcpio, newcpio, addblkcomp);
   d.name = argv[argc - 1];
   d.version = 0x444c5430 + version;
   memcpy(d.rpmlead, rpmlead, 96);
@@ -1504,7 +1408,7 @@ oaretry1:
   memcpy(d.lead + 96 + 16, sigh->data, d.leadl - 96 - 16);
   convertinstr(instr, instrlen, &d);
   if (!stream)
-    indatalist = createindatalist(instr, instrlen, &d, newcpio);
+    indatalist = createindatalist(instr, instrlen, &d, newcpio.data);
   d.nevr = nevr;
   d.seql = 16 + (seqp + 1) / 2;
   d.seq = xmalloc(d.seql);
@@ -1520,19 +1424,21 @@ oaretry1:
   d.offadjn = offadjn;
   d.offadjs = offadjs;
   d.payformatoff = payformat - (char *)d.h->dp;
-  d.outlen = oldcpiolen;
+  d.outlen = oldcpio.len;
   if (rpmonly)
     d.h = xfree(d.h);
   d.deltacomp = paycomp;
   writedeltarpm(&d, indatalist);
   if (seqfile)
     write_seqfile(&d, seqfile);
+  if (verbose > 1)
+    cfile_printstats(vfp, cfstats);
   d.addblk = xfree(d.addblk);
   d.addblklen = 0;
   instr = xfree(instr);
   instrlen = 0;
-  oldcpio = xfree(oldcpio);
-  newcpio = xfree(newcpio);
+  oldcpio.data = xfree(oldcpio.data);
+  newcpio.data = xfree(newcpio.data);
   sigh = xfree(sigh);
   d.h = xfree(d.h);
   indatalist = xfree(indatalist);
@@ -1546,8 +1452,6 @@ oaretry1:
   d.leadl = 0;
   nevr = xfree(nevr);
   seq = xfree(seq);
-  sd.old = xfree(sd.old);
-  sd.new = xfree(sd.new);
   offadjs = xfree(offadjs);
   d.targetnevr = xfree(d.targetnevr);
   exit(0);
@@ -0,0 +1,679 @@
+/*
+ * Copyright (c) 2026 the deltarpm contributors
+ *
+ * This program is licensed under the BSD license, read LICENSE.BSD
+ * for further information
+ */
+
+/*
+ * mkdiffbench - run mkdiff over a corpus of old/new pairs
+ *
+ * The corpus consists of synthetic mutations of a generated base
+ * (scattered insertions, shifted blocks, relocated ELF like sections)
+ * and of pairs given on the command line, e.g. the cpio payloads of two
+ * rpm versions (gzip/bzip2/xz compressed payloads are uncompressed on
+ * the fly). Every diff runs in its own process so that the peak memory
+ * can be measured. The reported peak is what the diff needed on top of
+ * the corpus data the process starts with. The result is checked by
+ * reconstructing the new data.
+ *
+ * Each mode runs with an add block and without one. makedeltarpm
+ * diffs without an add block if the add block is turned off with
+ * "-z comp,off".
+ *
+ * With -C nothing is timed. Instead the instructions are checked to be
+ * the same for all suffix array modes, and for the chunked scan (-j,
+ * default 1) with one thread and with the -t threads (default 4).
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+
+#include <zlib.h>
+#include <bzlib.h>
+#include <lzma.h>
+
+#include "delta.h"
+#include "util.h"
+#include "cfile.h"
+
+struct corpus {
+  char *name;
+  unsigned char *old;
+  bsuint oldl;
+  unsigned char *new;
+  bsuint newl;
+};
+
+struct result {
+  int ok;
+  unsigned long long indexusecs;
+  unsigned long long scanusecs;
+  long maxrss;
+  unsigned long long instrs;
+  unsigned long long copyin;
+  unsigned long long deltasize;
+};
+
+struct corpus *corpora;
+int ncorpora;
+
+/****************************************************************
+ *
+ * synthetic data
+ *
+ */
+
+static unsigned long long rndstate;
+
+static unsigned int
+rnd(unsigned int n)
+{
+  rndstate ^= rndstate << 13;
+  rndstate ^= rndstate >> 7;
+  rndstate ^= rndstate << 17;
+  return n ? (unsigned int)(rndstate >> 16) % n : 0;
+}
+
+/* something that looks and compresses like a mix of text and binary */
+static void
+fillrnd(unsigned char *d, bsuint l)
+{
+  static const char *words[] = {
+    "the", "file", "usr", "lib", "share", "doc", "config", "version", "static",
+    "int", "return", "struct", "char", "const", "void", "data", "init", "free",
+    "error", "buffer", "length", "offset", "size", "table", "entry", "name"
+  };
+  bsuint i;
+  int j, n;
+  const char *w;
+  unsigned int v;
+
+  while (l)
+    {
+      n = 64 + rnd(1024);
+      if (n > l)
+	n = l;
+      if (rnd(2))
+	{
+	  for (i = 0; i < n; )
+	    {
+	      w = rnd(8) ? words[rnd(sizeof(words)/sizeof(*words))] : "\n";
+	      for (j = 0; w[j] && i < n; j++)
+		d[i++] = w[j];
+	      if (i < n)
+		d[i++] = ' ';
+	    }
+	}
+      else
+	{
+	  v = rnd(0x10000);
+	  for (i = 0; i < n; i++)
+	    d[i] = (i & 3) == 0 ? (v += rnd(64)) : (i & 3) == 1 ? v >> 8 : rnd(16) ? 0 : rnd(256);
+	}
+      d += n;
+      l -= n;
+    }
+}
+
+static void
+addcorpus(char *name, unsigned char *old, bsuint oldl, unsigned char *new, bsuint newl)
+{
+  struct corpus *c;
+
+  corpora = xrealloc2(corpora, ncorpora + 1, sizeof(*corpora));
+  c = corpora + ncorpora++;
+  c->name = name;
+  c->old = old;
+  c->oldl = oldl;
+  c->new = new;
+  c->newl = newl;
+}
+
+/* small insertions, deletions and changes all over the place */
+static void
+mkinsert(unsigned char *base, bsuint l)
+{
+  unsigned char *new = xmalloc(l + l / 8 + 4096);
+  bsuint i, nl, n;
+
+  for (i = nl = 0; i < l; )
+    {
+      n = 4096 + rnd(65536);
+      if (n > l - i)
+	n = l - i;
+      memcpy(new + nl, base + i, n);
+      i += n;
+      nl += n;
+      n = 1 + rnd(512);
+      switch (rnd(3))
+	{
+	case 0:
+	  fillrnd(new + nl, n);
+	  nl += n;
+	  break;
+	case 1:
+	  i += n < l - i ? n : l - i;
+	  break;
+	default:
+	  if (n > l - i)
+	    n = l - i;
+	  fillrnd(new + nl, n);
+	  nl += n;
+	  i += n;
+	  break;
+	}
+    }
+  addcorpus("insert", base, l, new, nl);
+}
+
+/* the same blocks in a different order */
+static void
+mkshift(unsigned char *base, bsuint l)
+{
+  unsigned char *new = xmalloc(l);
+  bsuint *blks = 0, i, nl;
+  int *order, nblks, j, k, t;
+
+  for (i = 0, nblks = 0; i < l; i += 4096 + rnd(256 * 1024))
+    {
+      blks = xrealloc2(blks, nblks + 1, sizeof(*blks));
+      blks[nblks++] = i;
+    }
+  blks = xrealloc2(blks, nblks + 1, sizeof(*blks));
+  blks[nblks] = l;
+  order = xmalloc2(nblks, sizeof(*order));
+  for (j = 0; j < nblks; j++)
+    order[j] = j;
+  /* move every 8th block somewhere else */
+  for (j = 0; j < nblks; j += 8)
+    {
+      k = rnd(nblks);
+      t = order[k];
+      order[k] = order[j];
+      order[j] = t;
+    }
+  for (j = 0, nl = 0; j < nblks; j++)
+    {
+      k = order[j];
+      memcpy(new + nl, base + blks[k], blks[k + 1] - blks[k]);
+      nl += blks[k + 1] - blks[k];
+    }
+  free(order);
+  free(blks);
+  addcorpus("shift", base, l, new, nl);
+}
+
+/*
+ * An image with absolute 32bit addresses into itself. Some sections
+ * grow, so that everything behind them moves and all addresses that
+ * point behind the growth change. This is the typical difference
+ * between two builds of the same binary.
+ */
+static void
+mkelf(unsigned char *base, bsuint l)
+{
+  unsigned char *old = xmalloc(l), *new;
+  bsuint *addrs = 0, naddrs = 0, growat[4], growl[4];
+  bsuint i, j, nl, v;
+  int k;
+
+  memcpy(old, base, l);
+  for (i = 0; i + 4 <= l; i += 4 + rnd(24))
+    {
+      if ((i >> 16) % 3 == 2)
+	continue;	/* data section without addresses */
+      v = rnd(l);
+      old[i] = v;
+      old[i + 1] = v >> 8;
+      old[i + 2] = v >> 16;
+      old[i + 3] = v >> 24;
+      if ((naddrs & 4095) == 0)
+	addrs = xrealloc2(addrs, naddrs + 4096, sizeof(*addrs));
+      addrs[naddrs++] = i;
+    }
+  if (!naddrs)
+    {
+      free(old);
+      free(addrs);
+      return;
+    }
+  /* grow in front of an address so that no address gets split */
+  for (k = 0; k < 4; k++)
+    {
+      growat[k] = addrs[rnd(naddrs)];
+      growl[k] = 16 + rnd(4096);
+    }
+  for (k = 1; k < 4; k++)
+    {
+      for (j = k; j > 0 && growat[j - 1] > growat[j]; j--)
+	{
+	  v = growat[j]; growat[j] = growat[j - 1]; growat[j - 1] = v;
+	  v = growl[j]; growl[j] = growl[j - 1]; growl[j - 1] = v;
+	}
+    }
+  new = xmalloc(l + 4 * 4096 + 64);
+  for (i = nl = 0, k = 0; k < 4; k++)
+    {
+      memcpy(new + nl, old + i, growat[k] - i);
+      nl += growat[k] - i;
+      i = growat[k];
+      fillrnd(new + nl, growl[k]);
+      nl += growl[k];
+    }
+  memcpy(new + nl, old + i, l - i);
+  nl += l - i;
+  /* relocate */
+  for (j = 0; j < naddrs; j++)
+    {
+      i = addrs[j];
+      v = old[i] | old[i + 1] << 8 | old[i + 2] << 16 | (bsuint)old[i + 3] << 24;
+      for (k = 0; k < 4; k++)
+	{
+	  if (v >= growat[k])
+	    v += growl[k];
+	  if (addrs[j] >= growat[k])
+	    i += growl[k];
+	}
+      new[i] = v;
+      new[i + 1] = v >> 8;
+      new[i + 2] = v >> 16;
+      new[i + 3] = v >> 24;
+    }
+  free(addrs);
+  addcorpus("elf", old, l, new, nl);
+}
+
+/****************************************************************
+ *
+ * user supplied data
+ *
+ */
+
+static unsigned char *
+readfile(char *fn, bsuint *lp)
+{
+  struct cfile *f;
+  unsigned char *d = 0;
+  bsuint l = 0, al = 0;
+  int fd, r;
+
+  if ((fd = open(fn, O_RDONLY)) == -1)
+    {
+      perror(fn);
+      exit(1);
+    }
+  if ((f = cfile_open(CFILE_OPEN_RD, fd, 0, CFILE_COMP_XX, CFILE_LEN_UNLIMITED, 0, 0)) == 0)
+    {
+      fprintf(stderr, "%s: could not open\n", fn);
+      exit(1);
+    }
+  for (;;)
+    {
+      if (al - l < 65536)
+	d = xrealloc(d, al += al / 2 + 65536);
+      r = f->read(f, d + l, 65536);
+      if (r < 0)
+	{
+	  fprintf(stderr, "%s: read error\n", fn);
+	  exit(1);
+	}
+      if (r == 0)
+	break;
+      l += r;
+    }
+  f->close(f);
+  close(fd);
+  *lp = l;
+  return d;
+}
+
+/****************************************************************
+ *
+ * benchmarking
+ *
+ */
+
+static int
+verify(struct corpus *c, struct instr *instr, int instrlen, unsigned char *addblk, unsigned int addblklen, int noaddblk)
+{
+  unsigned char *add;
+  unsigned int addl;
+  bsuint i, j, o, ap;
+  int ok = 1;
+
+  addl = c->newl + 1;
+  add = xmalloc(addl);
+  if (noaddblk)
+    {
+      /* the copies must be exact */
+      if (addblklen)
+	{
+	  free(add);
+	  return 0;
+	}
+      memset(add, 0, addl);
+      addl = c->newl;
+    }
+  else if (!addblklen)
+    addl = 0;
+  else if (BZ2_bzBuffToBuffDecompress((char *)add, &addl, (char *)addblk, addblklen, 0, 0) != BZ_OK)
+    {
+      free(add);
+      return 0;
+    }
+  for (i = o = ap = 0; ok && i < instrlen; i++)
+    {
+      if (instr[i].copyoutoff + instr[i].copyout > c->oldl || ap + instr[i].copyout > addl || instr[i].copyinoff != o + instr[i].copyout)
+	ok = 0;
+      for (j = 0; ok && j < instr[i].copyout; j++, o++)
+	if ((unsigned char)(c->old[instr[i].copyoutoff + j] + add[ap++]) != c->new[o])
+	  ok = 0;
+      o += instr[i].copyin;
+    }
+  if (o != c->newl || (!noaddblk && ap != addl))
+    ok = 0;
+  free(add);
+  return ok;
+}
+
+/* resident memory in kbytes */
+static long
+currss(void)
+{
+  FILE *fp;
+  long size, rss = 0;
+
+  if ((fp = fopen("/proc/self/statm", "r")) == 0)
+    return 0;
+  if (fscanf(fp, "%ld %ld", &size, &rss) != 2)
+    rss = 0;
+  fclose(fp);
+  return rss * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+static void
+runone(struct corpus *c, int mode, struct result *res)
+{
+  struct mkdiff_stats stats;
+  struct instr *instr;
+  int instrlen;
+  unsigned char *instrblk, *addblk, *extrablk;
+  unsigned int instrblklen, addblklen, extrablklen;
+  struct rusage ru;
+  long startrss;
+
+  /* the corpus pages we inherited are not part of the diff */
+  startrss = currss();
+  memset(&stats, 0, sizeof(stats));
+  mkdiff_stats(&stats);
+  mkdiff(mode, c->old, c->oldl, c->new, c->newl, &instr, &instrlen, &instrblk, &instrblklen, &addblk, &addblklen, &extrablk, &extrablklen);
+  mkdiff_stats(0);
+  getrusage(RUSAGE_SELF, &ru);
+  memset(res, 0, sizeof(*res));
+  res->indexusecs = stats.indexusecs;
+  res->scanusecs = stats.scanusecs;
+  res->maxrss = ru.ru_maxrss > startrss ? ru.ru_maxrss - startrss : 0;
+  res->instrs = stats.instrs;
+  res->copyin = stats.copyin;
+  res->deltasize = (unsigned long long)instrblklen + addblklen + extrablklen;
+  res->ok = verify(c, instr, instrlen, addblk, addblklen, (mode & DELTAMODE_NOADDBLK) != 0);
+}
+
+/* run in a child so that every run gets a fresh peak memory count */
+static int
+run(struct corpus *c, int mode, struct result *res)
+{
+  int fds[2], status;
+  pid_t pid;
+
+  if (pipe(fds))
+    {
+      perror("pipe");
+      exit(1);
+    }
+  if ((pid = fork()) == (pid_t)-1)
+    {
+      perror("fork");
+      exit(1);
+    }
+  if (pid == 0)
+    {
+      close(fds[0]);
+      runone(c, mode, res);
+      if (write(fds[1], res, sizeof(*res)) != sizeof(*res))
+	_exit(1);
+      _exit(0);
+    }
+  close(fds[1]);
+  if (xread(fds[0], res, sizeof(*res)) != sizeof(*res))
+    memset(res, 0, sizeof(*res));
+  close(fds[0]);
+  if (waitpid(pid, &status, 0) != pid || status)
+    return 0;
+  return 1;
+}
+
+static struct instr *
+diffinstr(struct corpus *c, int mode, int *instrlenp)
+{
+  struct instr *instr;
+
+  mkdiff(mode, c->old, c->oldl, c->new, c->newl, &instr, instrlenp, 0, 0, 0, 0, 0, 0);
+  return instr;
+}
+
+static int
+compare(struct corpus *c, int mode1, int mode2, char *what)
+{
+  struct instr *instr1, *instr2;
+  int instrlen1, instrlen2, ok;
+
+  instr1 = diffinstr(c, mode1, &instrlen1);
+  instr2 = diffinstr(c, mode2, &instrlen2);
+  ok = instrlen1 == instrlen2 && !memcmp(instr1, instr2, instrlen1 * sizeof(*instr1));
+  printf("%-16s %s%s\n", c->name, what, ok ? "" : " FAILED");
+  fflush(stdout);
+  free(instr1);
+  free(instr2);
+  return ok;
+}
+
+static void
+usage()
+{
+  fprintf(stderr, "usage: mkdiffbench [-C] [-M mode[,mode...]] [-t threads] [-j mbytes] [-H window[,density]] [-O] [-c cachedir] [-a on|off|on,off] [-s mbytes] [-S seed] [-r rounds] [<old> <new>...]\n");
+  exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+  int c, i, j, r, threads = 1, chunk = 0, hashparams = 0, optimize = 0;
+  int rounds = 1, size = 8, failed = 0, addblks = 3, a, mode;
+  int check = 0;
+  char what[256];
+  int modes[16], nmodes = 0;
+  char *modenames[16], *modestr = "suf,hash,sais", *p, *q;
+  unsigned char *base;
+  struct result res, best;
+
+  rndstate = 0x9e3779b97f4a7c15ULL;
+  while ((c = getopt(argc, argv, "CM:t:c:j:H:Os:S:r:a:")) != -1)
+    {
+      switch(c)
+	{
+	case 'C':
+	  check = 1;
+	  break;
+	case 'M':
+	  modestr = optarg;
+	  break;
+	case 'H':
+	  if ((hashparams = mkdiff_str2hashparams(optarg)) == -1)
+	    {
+	      fprintf(stderr, "illegal hash parameters: %s\n", optarg);
+	      exit(1);
+	    }
+	  break;
+	case 'O':
+	  optimize = DELTAMODE_OPTIMIZE;
+	  break;
+	case 'c':
+	  mkdiff_indexcache(optarg);
+	  break;
+	case 'j':
+	  chunk = atoi(optarg);
+	  if (chunk < 1 || chunk > 127)
+	    {
+	      fprintf(stderr, "illegal chunk size: %s\n", optarg);
+	      exit(1);
+	    }
+	  break;
+	case 't':
+	  threads = atoi(optarg);
+	  if (threads < 1 || threads > 255)
+	    {
+	      fprintf(stderr, "illegal thread count: %s\n", optarg);
+	      exit(1);
+	    }
+	  break;
+	case 's':
+	  size = atoi(optarg);
+	  if (size < 0 || size > 4095)
+	    {
+	      fprintf(stderr, "illegal size: %s\n", optarg);
+	      exit(1);
+	    }
+	  break;
+	case 'S':
+	  rndstate += strtoull(optarg, 0, 0) * 0x9e3779b97f4a7c15ULL;
+	  if (!rndstate)
+	    rndstate = 1;
+	  break;
+	case 'a':
+	  /* bit 0: with add block, bit 1: without */
+	  if (!strcmp(optarg, "on"))
+	    addblks = 1;
+	  else if (!strcmp(optarg, "off"))
+	    addblks = 2;
+	  else if (!strcmp(optarg, "on,off"))
+	    addblks = 3;
+	  else
+	    usage();
+	  break;
+	case 'r':
+	  rounds = atoi(optarg);
+	  if (rounds < 1)
+	    usage();
+	  break;
+	default:
+	  usage();
+	}
+    }
+  if ((argc - optind) % 2 != 0)
+    usage();
+
+  modestr = strdup(modestr);
+  for (p = modestr; p; p = q)
+    {
+      if ((q = strchr(p, ',')) != 0)
+	*q++ = 0;
+      if (nmodes == 16)
+	usage();
+      if ((modes[nmodes] = mkdiff_str2mode(p)) == -1)
+	{
+	  fprintf(stderr, "unknown mode: %s\n", p);
+	  continue;
+	}
+      modenames[nmodes++] = p;
+    }
+  if (!nmodes)
+    exit(1);
+
+  if (size)
+    {
+      base = xmalloc((bsuint)size << 20);
+      fillrnd(base, (bsuint)size << 20);
+      mkinsert(base, (bsuint)size << 20);
+      mkshift(base, (bsuint)size << 20);
+      mkelf(base, (bsuint)size << 20);
+    }
+  for (i = optind; i < argc; i += 2)
+    {
+      struct corpus *cp;
+      addcorpus(argv[i + 1], 0, 0, 0, 0);
+      cp = corpora + ncorpora - 1;
+      cp->old = readfile(argv[i], &cp->oldl);
+      cp->new = readfile(argv[i + 1], &cp->newl);
+    }
+
+  if (check)
+    {
+      if (!chunk)
+	chunk = 1;
+      if (threads == 1)
+	threads = 4;
+      for (i = 0; i < ncorpora; i++)
+	for (a = 0; a < 2; a++)
+	  {
+	    if (!(addblks & (1 << a)))
+	      continue;
+	    mode = hashparams | optimize | (a ? DELTAMODE_NOADDBLK : 0);
+	    for (j = 1; j < nmodes; j++)
+	      {
+		if (DELTAMODE_METHOD(modes[0]) == DELTAMODE_HASH || DELTAMODE_METHOD(modes[j]) == DELTAMODE_HASH)
+		  continue;
+		sprintf(what, "add %-3s %s = %s", a ? "off" : "on", modenames[0], modenames[j]);
+		if (!compare(corpora + i, modes[0] | mode, modes[j] | mode, what))
+		  failed = 1;
+	      }
+	    for (j = 0; j < nmodes; j++)
+	      {
+		sprintf(what, "add %-3s %s -j %d -t 1 = -t %d", a ? "off" : "on", modenames[j], chunk, threads);
+		if (!compare(corpora + i, modes[j] | mode | DELTAMODE_MKCHUNK(chunk) | DELTAMODE_MKTHREADS(1), modes[j] | mode | DELTAMODE_MKCHUNK(chunk) | DELTAMODE_MKTHREADS(threads), what))
+		  failed = 1;
+	      }
+	  }
+      exit(failed);
+    }
+
+  printf("%-16s %-5s %-3s %10s %10s %8s %8s %7s %8s %10s %10s\n", "corpus", "mode", "add", "old", "new", "index", "scan", "peak", "instrs", "copyin", "delta");
+  fflush(stdout);
+  for (i = 0; i < ncorpora; i++)
+    for (j = 0; j < nmodes; j++)
+      for (a = 0; a < 2; a++)
+	{
+	  if (!(addblks & (1 << a)))
+	    continue;
+	  mode = modes[j] | DELTAMODE_MKTHREADS(threads) | DELTAMODE_MKCHUNK(chunk) | hashparams | optimize;
+	  if (a)
+	    mode |= DELTAMODE_NOADDBLK;
+	  memset(&best, 0, sizeof(best));
+	  for (r = 0; r < rounds; r++)
+	    {
+	      if (!run(corpora + i, mode, &res))
+		res.ok = 0;
+	      if (r == 0 || res.indexusecs < best.indexusecs)
+		best.indexusecs = res.indexusecs;
+	      if (r == 0 || res.scanusecs < best.scanusecs)
+		best.scanusecs = res.scanusecs;
+	      if (res.maxrss > best.maxrss)
+		best.maxrss = res.maxrss;
+	      best.instrs = res.instrs;
+	      best.copyin = res.copyin;
+	      best.deltasize = res.deltasize;
+	      best.ok = r == 0 ? res.ok : best.ok && res.ok;
+	    }
+	  printf("%-16s %-5s %-3s %10llu %10llu %7.3fs %7.3fs %6ldM %8llu %10llu %10llu%s\n", corpora[i].name, modenames[j], a ? "off" : "on", (unsigned long long)corpora[i].oldl, (unsigned long long)corpora[i].newl, best.indexusecs / 1e6, best.scanusecs / 1e6, best.maxrss / 1024, best.instrs, best.copyin, best.deltasize, best.ok ? "" : " FAILED");
+	  fflush(stdout);
+	  if (!best.ok)
+	    failed = 1;
+	}
+  exit(failed);
+}
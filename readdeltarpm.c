@@ -210,13 +210,24 @@ expandseq(unsigned char *seq, int seql, int *nump, struct fileblock *fb, int (*c
 
 static unsigned int bzread4(struct cfile *bfp)
 {
-  unsigned char d[4];
-  if (bfp->read(bfp, d, 4) != 4)
+  unsigned char d[4], *p;
+  int l, n;
+
+  /* the instructions are many small numbers, so don't go through
+   * the decompressor for each one */
+  for (n = 0; n < 4; n += l)
     {
-      perror("bzread4 error");
-      exit(1);
+      l = cfile_borrow(bfp, &p, 4 - n);
+      if (l <= 0)
+	{
+	  perror("bzread4 error");
+	  exit(1);
+	}
+      if (l == 4)
+	return p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+      memcpy(d + n, p, l);
     }
-  return d[0] << 24 | d[1] << 16 | d[2] << 8 | d[3]; 
+  return d[0] << 24 | d[1] << 16 | d[2] << 8 | d[3];
 }
 
 void
@@ -276,7 +287,7 @@ readdeltarpm(char *n, struct deltarpm *d, struct cfile **cfp)
 	    }
 	}
       d->h = 0;
-      if ((bfp = cfile_open(CFILE_OPEN_RD, dfd, 0, CFILE_COMP_XX, CFILE_LEN_UNLIMITED, 0, 0)) == 0)
+      if ((bfp = cfile_open(CFILE_OPEN_RD, CFILE_IO_MMAP, &dfd, CFILE_COMP_XX, CFILE_LEN_UNLIMITED, 0, 0)) == 0)
 	{
 	  fprintf(stderr, "%s: payload open failed\n", n);
 	  exit(1);
@@ -314,7 +325,7 @@ readdeltarpm(char *n, struct deltarpm *d, struct cfile **cfp)
 	  exit(1);
 	}
       d->targetnevr = headtonevr(d->h);
-      if ((bfp = cfile_open(CFILE_OPEN_RD, dfd, 0, CFILE_COMP_XX, CFILE_LEN_UNLIMITED, 0, 0)) == 0)
+      if ((bfp = cfile_open(CFILE_OPEN_RD, CFILE_IO_MMAP, &dfd, CFILE_COMP_XX, CFILE_LEN_UNLIMITED, 0, 0)) == 0)
 	{
 	  fprintf(stderr, "%s: payload open failed\n", n);
 	  exit(1);
@@ -371,7 +382,13 @@ readdeltarpm(char *n, struct deltarpm *d, struct cfile **cfp)
       d->targetsize = bzread4(bfp);
       d->targetcomp = bzread4(bfp);
       d->targetcompparalen = bzread4(bfp);
-      if (d->targetcompparalen)
+      if (d->targetcompparalen == 4)
+	{
+	  /* the upper cfile comp bits (CFILE_COMP_MT and block size) */
+	  d->targetcomp |= bzread4(bfp) << 16;
+	  d->targetcompparalen = 0;
+	}
+      else if (d->targetcompparalen)
 	{
 	  d->targetcomppara = xmalloc(d->targetcompparalen);
 	  if (bfp->read(bfp, d->targetcomppara, d->targetcompparalen) != d->targetcompparalen)
@@ -407,6 +424,10 @@ readdeltarpm(char *n, struct deltarpm *d, struct cfile **cfp)
 	d->targetcomp = CFILE_COMP_LZMA;
       else if (compressor && !strcmp(compressor, "bzip2"))
 	d->targetcomp = CFILE_COMP_BZ;
+#ifdef WITH_ZSTD
+      else if (compressor && !strcmp(compressor, "zstd"))
+	d->targetcomp = CFILE_COMP_ZSTD;
+#endif
       else
 	d->targetcomp = CFILE_COMP_GZ;
       d->targetsize = 0;
@@ -327,7 +327,13 @@ rpmoffs(FILE *fp, char *isoname, struct rpmpay **retp)
 	  level = 0;
 	  payloadflags = headstring(h, TAG_PAYLOADFLAGS);
 	  if (payloadflags && *payloadflags >= '1' && *payloadflags <= '9')
-	    level = *payloadflags - '0';
+	    level = atoi(payloadflags);
+	  if (level > 15 || (payloadflags && strchr(payloadflags, 'T')))
+	    {
+	      /* the deltaiso rpm descriptor can't express this, diff it as raw data */
+	      free(h);
+	      continue;
+	    }
 
 	  free(h);
 
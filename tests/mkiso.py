@@ -0,0 +1,56 @@
+#!/usr/bin/python3
+#
+# Writes a minimal iso9660 image with Rock Ridge names holding the
+# given files in the root directory, just enough for makedeltaiso to
+# find the rpms in it.
+#
+# usage: mkiso.py out.iso file...
+
+import sys, os, struct
+
+out = sys.argv[1]
+files = sys.argv[2:]
+
+def both4(x):
+    return struct.pack('<I', x) + struct.pack('>I', x)
+
+def dirent(name, rrname, pos, size, flags):
+    e = both4(pos) + both4(size) + b'\0' * 7 + bytes((flags, 0, 0)) + b'\x01\0\0\x01'
+    e += bytes((len(name),)) + name
+    if len(name) % 2 == 0:
+        e += b'\0'
+    if rrname:
+        e += b'NM' + bytes((len(rrname) + 5, 1, 0)) + rrname
+    e += b'\0' * (len(e) % 2)
+    return bytes((len(e) + 2, 0)) + e
+
+# system area, primary volume descriptor, terminator, path table, root dir
+datapos = 20
+root = 19
+ents = []
+pos = datapos
+for i, f in enumerate(files):
+    size = os.path.getsize(f)
+    ents.append(dirent(b'F%d.;1' % i, os.path.basename(f).encode(), pos, size, 0))
+    pos += (size + 0x7ff) // 0x800
+dirdata = dirent(b'\0', None, root, 0x800, 2) + dirent(b'\1', None, root, 0x800, 2) + b''.join(ents)
+if len(dirdata) > 0x800:
+    sys.exit('too many files')
+
+pvd = bytearray(0x800)
+pvd[0:6] = b'\x01CD001'
+pvd[6] = 1
+pvd[80:88] = both4(pos)
+pvd[128:132] = struct.pack('<H', 0x800) + struct.pack('>H', 0x800)
+pathtable = bytes((1, 0)) + struct.pack('<IH', root, 1) + b'\0\0'
+pvd[132:140] = both4(len(pathtable))
+pvd[140:144] = struct.pack('<I', 18)
+pvd[156:190] = dirent(b'\0', None, root, 0x800, 2)
+
+def blk(b):
+    return b + b'\0' * (-len(b) % 0x800)
+
+with open(out, 'wb') as fp:
+    fp.write(b'\0' * 0x800 * 16 + bytes(pvd) + blk(b'\xffCD001\x01') + blk(pathtable) + blk(dirdata))
+    for f in files:
+        fp.write(blk(open(f, 'rb').read()))
@@ -0,0 +1,109 @@
+#!/usr/bin/python3
+#
+# Writes a minimal rpm with the files below rootdir installed under prefix.
+# Only the tags makedeltarpm and applydeltarpm -r look at are set.
+#
+# usage: mkrpm.py name version release rootdir prefix out.rpm compressor [flags [xzblock]]
+#
+# compressor is bzip2, gzip, gzip-rsyncable, zstd or xz, flags the payload
+# flags, e.g. "19T". zstd and xz payloads are created with the command line
+# tools, gzip-rsyncable with the minigzip of the rsync friendly zlib named
+# by $MINIGZIP.
+# For xz "6T2" compresses with two threads, xzblock is the block size
+# for the threaded encoder, e.g. "1MiB".
+
+import sys, os, struct, hashlib, bz2, zlib, subprocess
+
+name, ver, rel, root, prefix, out, comp = sys.argv[1:8]
+flags = sys.argv[8] if len(sys.argv) > 8 else '9'
+xzblock = sys.argv[9] if len(sys.argv) > 9 else None
+
+files = []
+for dp, dns, fns in os.walk(root):
+    for fn in fns:
+        files.append(os.path.relpath(os.path.join(dp, fn), root))
+files.sort()
+
+def header(entries, pad):
+    idx = b''
+    data = b''
+    for tag, typ, cnt, b in sorted(entries):
+        align = {3: 2, 4: 4}.get(typ, 1)
+        while len(data) % align:
+            data += b'\0'
+        idx += struct.pack('>iiii', tag, typ, len(data), cnt)
+        data += b
+    h = b'\x8e\xad\xe8\x01\0\0\0\0' + struct.pack('>ii', len(entries), len(data)) + idx + data
+    while pad and len(h) % 8:
+        h += b'\0'
+    return h
+
+def string(tag, v):
+    return (tag, 6, 1, v.encode() + b'\0')
+def strings(tag, l):
+    return (tag, 8, len(l), b''.join(x.encode() + b'\0' for x in l))
+def int32(tag, l):
+    return (tag, 4, len(l), b''.join(struct.pack('>I', x) for x in l))
+def int16(tag, l):
+    return (tag, 3, len(l), b''.join(struct.pack('>H', x) for x in l))
+def binary(tag, b):
+    return (tag, 7, len(b), b)
+
+paths = [prefix + '/' + f for f in files]
+dirs = sorted(set(os.path.dirname(p) + '/' for p in paths))
+datas = [open(os.path.join(root, f), 'rb').read() for f in files]
+nevr = name + '-' + ver + '-' + rel
+h = header([string(1000, name), string(1001, ver), string(1002, rel),
+            string(1022, 'x86_64'), string(1044, nevr + '.src.rpm'),
+            strings(1117, [os.path.basename(p) for p in paths]), strings(1118, dirs),
+            int32(1116, [dirs.index(os.path.dirname(p) + '/') for p in paths]),
+            int32(1028, [len(d) for d in datas]), int16(1030, [0o100644] * len(files)),
+            int16(1033, [0] * len(files)), int32(1034, [0] * len(files)),
+            strings(1035, [hashlib.md5(d).hexdigest() for d in datas]),
+            strings(1036, [''] * len(files)), int32(1037, [0] * len(files)),
+            int32(1045, [0xffffffff] * len(files)),
+            string(1124, 'cpio'), string(1125, comp.split('-')[0]), string(1126, flags)], 0)
+
+def cpioent(name, data, ino, mode):
+    n = name.encode() + b'\0'
+    e = b'070701' + b''.join(b'%08x' % x for x in (ino, mode, 0, 0, 1, 0, len(data), 0, 0, 0, 0, len(n), 0)) + n
+    e += b'\0' * (-len(e) % 4) + data
+    return e + b'\0' * (-len(e) % 4)
+
+cpio = b''
+for i, (p, d) in enumerate(zip(paths, datas)):
+    cpio += cpioent('.' + p, d, i + 1, 0o100644)
+cpio += cpioent('TRAILER!!!', b'', 0, 0)
+
+level = int(flags.split('T')[0] or 9)
+if comp == 'bzip2':
+    pay = bz2.compress(cpio, level)
+elif comp == 'gzip' or comp == 'gzip-rsyncable':
+    if comp == 'gzip':
+        c = zlib.compressobj(level, zlib.DEFLATED, -15, 8)
+        deflated = c.compress(cpio) + c.flush()
+    else:
+        # keep the deflate data, the header is written below
+        args = [os.environ['MINIGZIP'], '-R', '-%d' % level]
+        deflated = subprocess.run(args, input=cpio, stdout=subprocess.PIPE, check=True).stdout[10:-8]
+    xfl = 2 if level == 9 else 4 if level < 2 else 0
+    pay = b'\x1f\x8b\x08\0\0\0\0\0' + bytes((xfl, 3)) + deflated
+    pay += struct.pack('<II', zlib.crc32(cpio), len(cpio) & 0xffffffff)
+elif comp == 'zstd':
+    args = ['zstd', '-q', '-c', '--no-check', '--ultra', '-%d' % level]
+    args.append('-T2' if flags.endswith('T') else '--single-thread')
+    pay = subprocess.run(args, input=cpio, stdout=subprocess.PIPE, check=True).stdout
+elif comp == 'xz':
+    args = ['xz', '-q', '-c', '--check=sha256', '-%d' % level]
+    args.append('-T' + (flags.split('T')[1] or '0') if 'T' in flags else '-T1')
+    if xzblock:
+        args.append('--block-size=' + xzblock)
+    pay = subprocess.run(args, input=cpio, stdout=subprocess.PIPE, check=True).stdout
+else:
+    sys.exit('unknown compressor ' + comp)
+
+sig = header([int32(1000, [len(h) + len(pay)]), binary(1004, hashlib.md5(h + pay).digest())], 1)
+lead = b'\xed\xab\xee\xdb\x03\x00\x00\x00\x00\x01' + nevr.encode()[:65].ljust(66, b'\0')
+lead += b'\x00\x01\x00\x05' + b'\0' * 16
+with open(out, 'wb') as f:
+    f.write(lead + sig + h + pay)
@@ -0,0 +1,206 @@
+#!/bin/sh
+#
+# Creates a deltarpm between two generated rpms and checks that
+# applydeltarpm -r rebuilds the new rpm byte for byte, for several
+# payload compressions, delta modes and applydeltarpm options, and
+# does the same for makedeltaiso and applydeltaiso. Run with "make check".
+
+bindir=${1:-.}
+tests=`dirname $0`
+tmp=`mktemp -d` || exit 1
+trap 'rm -rf $tmp' 0
+failed=0
+
+python3 - $tmp <<'EOF' || exit 1
+import os, random, sys
+tmp = sys.argv[1]
+r = random.Random(1)
+words = [bytes(r.choice(b'abcdefghij ') for i in range(r.randint(2, 12))) for i in range(500)]
+for v in ('old', 'new'):
+    os.makedirs(tmp + '/' + v + '/lib')
+for i in range(8):
+    data = b' '.join(r.choice(words) for j in range(40000))
+    open(tmp + '/old/lib/f%d' % i, 'wb').write(data)
+    if i % 3 == 0:
+        data = data[:len(data) // 2] + b'changed' + data[len(data) // 2 + 1000:]
+    open(tmp + '/new/lib/f%d' % i, 'wb').write(data)
+# one big file with moved and copied pieces for the streaming diff
+r = random.Random(6)
+for v in ('bigold', 'bignew'):
+    os.makedirs(tmp + '/' + v + '/lib')
+data = b' '.join(r.choice(words) for j in range(450000))
+open(tmp + '/bigold/lib/big', 'wb').write(data)
+pieces = []
+pos = 0
+while pos < len(data):
+    n = r.randint(1000, 100000)
+    c = r.random()
+    if c < 0.3:
+        k = r.randint(0, len(data) - n)
+        pieces.append(data[k:k + n])
+    elif c < 0.4:
+        pos += n
+    else:
+        pieces.append(data[pos:pos + n])
+        pos += n
+    pieces.append(b'x' * r.randint(0, 20))
+open(tmp + '/bignew/lib/big', 'wb').write(b''.join(pieces))
+EOF
+
+mkrpms() {
+  python3 $tests/mkrpm.py pkg 1.0 1 $tmp/${payload}old ${prefix:-/usr} $tmp/old.rpm $1 $2 $xzblock &&
+  python3 $tests/mkrpm.py pkg 1.0 2 $tmp/${payload}new ${prefix:-/usr} $tmp/new.rpm $1 $2 $xzblock
+}
+
+# roundtrip comp flags [makedeltarpm options], $payload selects the
+# trees, $xzblock the block size of threaded xz payloads, $apply the
+# applydeltarpm options
+roundtrip() {
+  comp=$1 flags=$2
+  shift 2
+  mkrpms $comp $flags &&
+  $bindir/makedeltarpm "$@" $tmp/old.rpm $tmp/new.rpm $tmp/delta.drpm &&
+  $bindir/applydeltarpm $apply -r $tmp/old.rpm $tmp/delta.drpm $tmp/out.rpm >/dev/null &&
+  cmp -s $tmp/new.rpm $tmp/out.rpm
+}
+
+check() {
+  if roundtrip "$@" ; then
+    echo "ok: ${payload:+$payload }$*${xzblock:+ $xzblock}${apply:+ (apply $apply)}"
+  else
+    echo "FAILED: ${payload:+$payload }$*${xzblock:+ $xzblock}${apply:+ (apply $apply)}"
+    failed=1
+  fi
+}
+
+# checkinfo compression comp flags [makedeltarpm options], also checks
+# the target payload compression applydeltarpm -i reports
+checkinfo() {
+  expect=$1
+  shift
+  check "$@"
+  if ! $bindir/applydeltarpm -i $tmp/delta.drpm | grep -q "^target payload compression: $expect\$" ; then
+    echo "FAILED: $* is not recompressed as $expect"
+    failed=1
+  fi
+}
+
+payload=
+xzblock=
+apply=
+
+check bzip2 9
+checkinfo gzip gzip 9
+checkinfo gzip.6 gzip 6
+# rsyncable gzip payloads are written with the minigzip of the bundled
+# zlib, they are only detected at the default level 9
+MINIGZIP=$bindir/zlib-1.2.2.f-rsyncable/minigzip
+export MINIGZIP
+if ! test -x $MINIGZIP ; then
+  echo "skipped: gzip-rsyncable"
+else
+  checkinfo "gzip rsyncable" gzip-rsyncable 9
+  payload=big
+  checkinfo "gzip rsyncable" gzip-rsyncable 9 -m 1
+  payload=
+fi
+# tiny blocks and cache limits make applydeltarpm page blocks out,
+# the moved pieces of the big payload make it read them back
+for apply in "-b 1 -m 1" "-b 64 -m 1 -T $tmp" ; do
+  check bzip2 9
+  check gzip 9
+  payload=big
+  check gzip 6
+  payload=
+done
+# the pipelined mode, also for rpm-only deltas that copy the payload
+for apply in "-P" "-P -b 2 -m 1 -v -v" ; do
+  check bzip2 9
+  check gzip 9
+  check bzip2 9 -r
+  check gzip 9 -r
+  for comp in bzip2 gzip ; do
+    if mkrpms $comp 9 && $bindir/makedeltarpm -u $tmp/new.rpm $tmp/delta.drpm &&
+       $bindir/applydeltarpm $apply -r $tmp/new.rpm $tmp/delta.drpm $tmp/out.rpm >/dev/null &&
+       cmp -s $tmp/new.rpm $tmp/out.rpm ; then
+      echo "ok: $comp 9 -u (apply $apply)"
+    else
+      echo "FAILED: $comp 9 -u (apply $apply)"
+      failed=1
+    fi
+  done
+done
+apply=
+# the streaming diff with an old window far smaller than the payload
+payload=big
+check gzip 6 -m 1 -M hash
+check gzip 6 -m 1 -M suf
+check gzip 6 -m 1 -M sais
+payload=
+# apply against the old files installed below $tmp/inst, tests/applydeltarpm
+# gets the installed header from tests/rpmdumpheader.py
+if ! test -x $bindir/tests/applydeltarpm ; then
+  echo "skipped: filesystem"
+else
+  prefix=$tmp/inst
+  for apply in "" "-b 1 -m 1" "-P" ; do
+    for payload in "" big ; do
+      rm -rf $prefix
+      mkdir -p $prefix
+      cp -r $tmp/${payload}old/lib $prefix/
+      if mkrpms gzip 9 && $bindir/makedeltarpm $tmp/old.rpm $tmp/new.rpm $tmp/delta.drpm &&
+	 RPMDUMPHEADER_RPM=$tmp/old.rpm $bindir/tests/applydeltarpm $apply $tmp/delta.drpm $tmp/out.rpm >/dev/null &&
+	 cmp -s $tmp/new.rpm $tmp/out.rpm ; then
+	echo "ok: filesystem ${payload:+$payload }gzip 9${apply:+ (apply $apply)}"
+      else
+	echo "FAILED: filesystem ${payload:+$payload }gzip 9${apply:+ (apply $apply)}"
+	failed=1
+      fi
+    done
+  done
+  prefix=
+  payload=
+  apply=
+fi
+# isos with an rpm and a plain file, with block compressions other than bzip2
+printf 'disc 1\n' > $tmp/readme
+for z in "" "gzip,xz" "xz,gzip" ; do
+  if mkrpms gzip 9 && cp $tmp/old.rpm $tmp/pkg.rpm && python3 $tests/mkiso.py $tmp/old.iso $tmp/readme $tmp/pkg.rpm &&
+     cp $tmp/new.rpm $tmp/pkg.rpm && python3 $tests/mkiso.py $tmp/new.iso $tmp/readme $tmp/pkg.rpm &&
+     $bindir/makedeltaiso ${z:+-z $z} $tmp/old.iso $tmp/new.iso $tmp/delta.diso >/dev/null &&
+     $bindir/applydeltaiso $tmp/old.iso $tmp/delta.diso $tmp/out.iso >/dev/null &&
+     cmp -s $tmp/new.iso $tmp/out.iso ; then
+    echo "ok: iso${z:+ -z $z}"
+  else
+    echo "FAILED: iso${z:+ -z $z}"
+    failed=1
+  fi
+done
+if ! command -v xz >/dev/null ; then
+  echo "skipped: xz"
+else
+  check xz 6
+  check xz 6T1
+  check xz 6T2
+  xzblock=1MiB
+  check xz 6T2
+  # the block size is stored in megabytes, other sizes must be refused
+  xzblock=1500KiB
+  rm -f $tmp/delta.drpm
+  if mkrpms xz 6T2 && ! $bindir/makedeltarpm $tmp/old.rpm $tmp/new.rpm $tmp/delta.drpm 2>/dev/null && ! test -e $tmp/delta.drpm ; then
+    echo "ok: xz 6T2 $xzblock refused"
+  else
+    echo "FAILED: xz 6T2 $xzblock refused"
+    failed=1
+  fi
+  xzblock=
+fi
+if $bindir/makedeltarpm -z zstd 2>&1 | grep -q 'unknown compression' || ! command -v zstd >/dev/null ; then
+  echo "skipped: zstd"
+else
+  check zstd 3
+  check zstd 19
+  # the threaded flag must survive the non-default level
+  checkinfo "zstd.19 mt" zstd 19T
+fi
+exit $failed
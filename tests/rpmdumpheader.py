@@ -0,0 +1,15 @@
+#!/usr/bin/python3
+#
+# Stands in for rpmdumpheader in "make check": writes the header of the
+# rpm named by $RPMDUMPHEADER_RPM as if it was the installed package.
+#
+# usage: rpmdumpheader.py [-a arch] package
+
+import sys, os, struct
+
+rpm = open(os.environ['RPMDUMPHEADER_RPM'], 'rb').read()
+off = 96
+cnt, dl = struct.unpack('>ii', rpm[off + 8:off + 16])
+off += (16 + 16 * cnt + dl + 7) & ~7
+cnt, dl = struct.unpack('>ii', rpm[off + 8:off + 16])
+sys.stdout.buffer.write(rpm[off:off + 16 + 16 * cnt + dl])
@@ -194,8 +194,15 @@ writedeltarpm(struct deltarpm *d, unsigned char **indatalist)
   if (d->version != 0x444c5431)
     {
       write32(bfd, d->targetsize);
-      write32(bfd, d->targetcomp);
-      write32(bfd, 0);
+      write32(bfd, d->targetcomp & 0xffff);
+      if (d->targetcomp >> 16)
+	{
+	  /* multi threaded encoder settings, see readdeltarpm */
+	  write32(bfd, 4);
+	  write32(bfd, d->targetcomp >> 16);
+	}
+      else
+	write32(bfd, 0);
       if (d->version != 0x444c5432)
 	{
 	  write32(bfd, d->compheadlen);